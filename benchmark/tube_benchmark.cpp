@@ -0,0 +1,564 @@
+/*
+	Headless benchmark of the tube builders. It needs no window nor GPU, every measured step runs on
+	the CPU: the frame propagation of setTrajectory, the patch arrays of makeCylinderGeometry, the CPU
+	mesh backend, the bulk and batch paths for many tubes, the streaming of trajectory files and the
+	segment hierarchy used to pick the tubes.
+
+	For every case it reports the time of the best and mean run, the throughput in points per second,
+	the allocations made by the first run and the peak resident memory of the process so far, as CSV or JSON.
+
+	usage: tube_benchmark [--format csv|json] [--output file] [--max-points n] [--repeat n]
+*/
+
+#include <osg/ArgumentParser>
+#include <osg/Group>
+#include <osg/Timer>
+
+#include "TrajectoryReader.h"
+#include "TubeBatchBuilder.h"
+#include "TubeFrameKernel.h"
+#include "TubeGeometryBuilder.h"
+#include "TubeMeshBuilder.h"
+#include "TubeSegmentBVH.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#if defined( _WIN32 )
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+	#include <psapi.h>
+#else
+	#include <sys/resource.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+// Allocation counting, every operator new of the process goes through here
+
+static volatile long s_allocations = 0;
+static volatile long long s_allocatedBytes = 0;
+
+static void countAllocation( size_t size )
+{
+#if defined( _WIN32 )
+	InterlockedIncrement( &s_allocations );
+	InterlockedExchangeAdd64( &s_allocatedBytes, static_cast<long long>( size ) );
+#else
+	__sync_fetch_and_add( &s_allocations, 1 );
+	__sync_fetch_and_add( &s_allocatedBytes, static_cast<long long>( size ) );
+#endif
+}
+
+static void* allocate( size_t size )
+{
+	countAllocation( size );
+	void* p = malloc( size > 0 ? size : 1 );
+	if( !p )
+		throw std::bad_alloc();
+	return p;
+}
+
+#if __cplusplus >= 201103L || defined( _MSC_VER )
+	#define BENCHMARK_THROW_BAD_ALLOC
+#else
+	#define BENCHMARK_THROW_BAD_ALLOC throw( std::bad_alloc )
+#endif
+
+void* operator new( size_t size ) BENCHMARK_THROW_BAD_ALLOC { return allocate( size ); }
+void* operator new[]( size_t size ) BENCHMARK_THROW_BAD_ALLOC { return allocate( size ); }
+void* operator new( size_t size, const std::nothrow_t& ) throw() { countAllocation( size ); return malloc( size > 0 ? size : 1 ); }
+void* operator new[]( size_t size, const std::nothrow_t& ) throw() { countAllocation( size ); return malloc( size > 0 ? size : 1 ); }
+void operator delete( void* p ) throw() { free( p ); }
+void operator delete[]( void* p ) throw() { free( p ); }
+void operator delete( void* p, const std::nothrow_t& ) throw() { free( p ); }
+void operator delete[]( void* p, const std::nothrow_t& ) throw() { free( p ); }
+
+// Peak resident memory of the process in kilobytes
+static long peakResidentKB()
+{
+#if defined( _WIN32 )
+	PROCESS_MEMORY_COUNTERS counters;
+	if( !GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) )
+		return 0;
+	return static_cast<long>( counters.PeakWorkingSetSize / 1024 );
+#else
+	struct rusage usage;
+	if( getrusage( RUSAGE_SELF, &usage ) != 0 )
+		return 0;
+	#if defined( __APPLE__ )
+		return usage.ru_maxrss / 1024; // bytes on OS X
+	#else
+		return usage.ru_maxrss;
+	#endif
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trajectory shapes
+
+enum Shape { STRAIGHT, HELIX, NOISY, REPEATS, NUM_SHAPES };
+
+static const char* shapeName( Shape shape )
+{
+	static const char* names[NUM_SHAPES] = { "straight", "helix", "noisy", "repeats" };
+	return names[shape];
+}
+
+static std::vector<osg::Vec3> genTrajectory( Shape shape, unsigned int numPoints )
+{
+	std::vector<osg::Vec3> trajectory;
+	trajectory.reserve( numPoints );
+
+	// Fixed seed, every run measures the same points
+	unsigned int seed = 12345;
+	osg::Vec3 walk;
+	for( unsigned int i = 0; i < numPoints; i++ )
+	{
+		switch( shape )
+		{
+		case STRAIGHT:
+			trajectory.push_back( osg::Vec3( 0.0f, 0.0f, 0.1f * i ) );
+			break;
+		case HELIX:
+			trajectory.push_back( osg::Vec3( cosf( 0.05f * i ), sinf( 0.05f * i ), 0.01f * i ) );
+			break;
+		case NOISY:
+			for( int c = 0; c < 3; c++ )
+			{
+				seed = seed * 1664525u + 1013904223u;
+				walk[c] += ( seed >> 8 ) / 16777216.0f - 0.5f;
+			}
+			walk[2] += 0.1f;
+			trajectory.push_back( walk );
+			break;
+		default:
+		{
+			// Every point 4 times, the repeats make zero length segments
+			unsigned int j = i / 4;
+			trajectory.push_back( osg::Vec3( cosf( 0.05f * j ), sinf( 0.05f * j ), 0.01f * j ) );
+			break;
+		}
+		}
+	}
+	return trajectory;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Measurements
+
+static const unsigned int MAX_MESH_SECTIONS = 1000000;
+
+class Operation
+{
+public:
+	virtual ~Operation() {}
+
+	virtual void run() = 0;
+};
+
+struct Result
+{
+	std::string operation;
+	std::string shape;
+	unsigned int points;
+	unsigned int tubes;
+	unsigned int sections;
+	unsigned int repeats;
+	double bestMs;
+	double meanMs;
+	double pointsPerSecond;
+	long allocations;
+	long long allocatedBytes;
+	long peakRssKB;
+};
+
+static Result measure( Operation& operation, unsigned int repeats, const std::string& name, const std::string& shape,
+	unsigned int points, unsigned int tubes )
+{
+	Result result;
+	result.operation = name;
+	result.shape = shape;
+	result.points = points;
+	result.tubes = tubes;
+	result.sections = 0;
+	result.repeats = repeats;
+	result.bestMs = 0.0;
+
+	double totalMs = 0.0;
+	for( unsigned int r = 0; r < repeats; r++ )
+	{
+		long allocations = s_allocations;
+		long long allocatedBytes = s_allocatedBytes;
+		osg::Timer_t start = osg::Timer::instance()->tick();
+		operation.run();
+		double ms = osg::Timer::instance()->delta_m( start, osg::Timer::instance()->tick() );
+
+		// Allocations of the first run, later ones may reuse the buffers it allocated
+		if( r == 0 )
+		{
+			result.allocations = s_allocations - allocations;
+			result.allocatedBytes = s_allocatedBytes - allocatedBytes;
+		}
+		totalMs += ms;
+		if( r == 0 || ms < result.bestMs )
+			result.bestMs = ms;
+	}
+	result.meanMs = repeats > 0 ? totalMs / repeats : 0.0;
+	result.pointsPerSecond = result.bestMs > 0.0 ? points / ( result.bestMs * 0.001 ) : 0.0;
+	result.peakRssKB = peakResidentKB();
+	return result;
+}
+
+class SetTrajectory : public Operation
+{
+public:
+	SetTrajectory( TubeGeometryBuilder& builder, const std::vector<osg::Vec3>& points ) : _builder( builder ), _points( points ) {}
+
+	virtual void run() { _builder.setTrajectory( _points ); }
+
+private:
+	TubeGeometryBuilder& _builder;
+	const std::vector<osg::Vec3>& _points;
+};
+
+class MakeCylinderGeometry : public Operation
+{
+public:
+	MakeCylinderGeometry( TubeGeometryBuilder& builder ) : _builder( builder ) {}
+
+	virtual void run()
+	{
+		osg::ref_ptr<osg::Geometry> geometry = _builder.makeCylinderGeometry( 0.4, osg::Vec4( 1, 0, 0, 1 ), 10,
+			TubePatchLayout::DEFAULT_PATCH_VERTICES );
+	}
+
+private:
+	TubeGeometryBuilder& _builder;
+};
+
+class MakeMesh : public Operation
+{
+public:
+	MakeMesh( const std::vector<TubeSection>& sections ) : _sections( sections ) {}
+
+	virtual void run()
+	{
+		osg::ref_ptr<osg::Geometry> geometry = TubeMeshBuilder::createGeometry( _sections, 0.4f, TubeMeshBuilder::Settings() );
+	}
+
+private:
+	const std::vector<TubeSection>& _sections;
+};
+
+class BuildSectionsBulk : public Operation
+{
+public:
+	BuildSectionsBulk( const std::vector< std::vector<osg::Vec3> >& trajectories, std::vector< std::vector<TubeSection> >& sections ) :
+		_trajectories( trajectories ), _sections( sections ) {}
+
+	virtual void run() { TubeGeometryBuilder::buildSectionsBulk( _trajectories, _sections ); }
+
+private:
+	const std::vector< std::vector<osg::Vec3> >& _trajectories;
+	std::vector< std::vector<TubeSection> >& _sections;
+};
+
+class CreateBatch : public Operation
+{
+public:
+	CreateBatch( const std::vector< std::vector<TubeSection> >& sections ) : _sections( sections ) {}
+
+	virtual void run()
+	{
+		TubeBatchBuilder batchBuilder;
+		for( unsigned int i = 0; i < _sections.size(); i++ )
+			batchBuilder.addTube( _sections[i], TubeStyle() );
+		osg::ref_ptr<osg::Group> group = new osg::Group;
+		batchBuilder.createBatch( group.get(), NULL );
+	}
+
+private:
+	const std::vector< std::vector<TubeSection> >& _sections;
+};
+
+// Copies of \sections on a square grid, so the tubes of a TubeSegmentBVH do not overlap
+static std::vector< std::vector<TubeSection> > spreadTubes( const std::vector< std::vector<TubeSection> >& sections, float spacing )
+{
+	unsigned int columns = static_cast<unsigned int>( ceilf( sqrtf( static_cast<float>( sections.size() ) ) ) );
+	std::vector< std::vector<TubeSection> > spread( sections );
+	for( unsigned int i = 0; i < spread.size(); i++ )
+	{
+		osg::Vec3 offset( spacing * ( i % columns ), spacing * ( i / columns ), 0.0f );
+		for( unsigned int j = 0; j < spread[i].size(); j++ )
+			spread[i][j].position += offset;
+	}
+	return spread;
+}
+
+class BuildSegmentBVH : public Operation
+{
+public:
+	BuildSegmentBVH( const std::vector< std::vector<TubeSection> >& sections ) : _sections( sections ) {}
+
+	virtual void run()
+	{
+		_bvh = new TubeSegmentBVH;
+		for( unsigned int i = 0; i < _sections.size(); i++ )
+			_bvh->addTube( _sections[i], 0.4f );
+
+		// The tube hierarchy is built by the first query
+		TubeSegmentBVH::Hit hit;
+		_bvh->nearest( osg::Vec3(), hit );
+	}
+
+	TubeSegmentBVH* getBVH() { return _bvh.get(); }
+
+private:
+	const std::vector< std::vector<TubeSection> >& _sections;
+	osg::ref_ptr<TubeSegmentBVH> _bvh;
+};
+
+// Vertical rays over the tubes, the points of the result are the rays
+class PickSegmentBVH : public Operation
+{
+public:
+	PickSegmentBVH( TubeSegmentBVH* bvh, const osg::BoundingBox& box, unsigned int numRays ) :
+		_bvh( bvh ), _box( box ), _numRays( numRays ), _numHits( 0 ) {}
+
+	virtual void run()
+	{
+		unsigned int seed = 12345;
+		_numHits = 0;
+		for( unsigned int i = 0; i < _numRays; i++ )
+		{
+			seed = seed * 1664525u + 1013904223u;
+			float x = _box.xMin() + ( _box.xMax() - _box.xMin() ) * ( ( seed >> 8 ) / 16777216.0f );
+			seed = seed * 1664525u + 1013904223u;
+			float y = _box.yMin() + ( _box.yMax() - _box.yMin() ) * ( ( seed >> 8 ) / 16777216.0f );
+
+			TubeSegmentBVH::Hit hit;
+			if( _bvh->pick( osg::Vec3( x, y, _box.zMax() + 1.0f ), osg::Vec3( x, y, _box.zMin() - 1.0f ), hit ) )
+				_numHits++;
+		}
+	}
+
+	unsigned int getNumHits() const { return _numHits; }
+
+private:
+	TubeSegmentBVH* _bvh;
+	osg::BoundingBox _box;
+	unsigned int _numRays;
+	unsigned int _numHits;
+};
+
+// Builds the sections of every trajectory of a file, streamed by TrajectoryReader
+class LoadTrajectories : public Operation, public TrajectoryReader::Consumer
+{
+public:
+	LoadTrajectories( const std::string& fileName ) : _fileName( fileName ), _numSections( 0 ) {}
+
+	virtual void run()
+	{
+		_numSections = 0;
+		TrajectoryReader reader;
+		if( reader.open( _fileName ) )
+			reader.buildSections( *this );
+	}
+
+	virtual void consume( const TrajectoryReader::Chunk&, const std::vector< std::vector<TubeSection> >& sections )
+	{
+		for( unsigned int i = 0; i < sections.size(); i++ )
+			_numSections += sections[i].size();
+	}
+
+	unsigned int getNumSections() const { return _numSections; }
+
+private:
+	std::string _fileName;
+	unsigned int _numSections;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Output
+
+static void writeCSV( std::ostream& out, const std::vector<Result>& results )
+{
+	out << "operation,shape,points,tubes,sections,repeats,best_ms,mean_ms,points_per_s,allocations,allocated_bytes,peak_rss_kb\n";
+	for( unsigned int i = 0; i < results.size(); i++ )
+	{
+		const Result& r = results[i];
+		out << r.operation << "," << r.shape << "," << r.points << "," << r.tubes << "," << r.sections << ","
+			<< r.repeats << "," << r.bestMs << "," << r.meanMs << "," << r.pointsPerSecond << ","
+			<< r.allocations << "," << r.allocatedBytes << "," << r.peakRssKB << "\n";
+	}
+}
+
+static void writeJSON( std::ostream& out, const std::vector<Result>& results )
+{
+	out << "{\n  \"instructionSet\": \"" << TubeFrameKernel::getInstructionSet() << "\",\n  \"results\": [\n";
+	for( unsigned int i = 0; i < results.size(); i++ )
+	{
+		const Result& r = results[i];
+		out << "    { \"operation\": \"" << r.operation << "\", \"shape\": \"" << r.shape << "\", \"points\": " << r.points
+			<< ", \"tubes\": " << r.tubes << ", \"sections\": " << r.sections << ", \"repeats\": " << r.repeats
+			<< ", \"bestMs\": " << r.bestMs << ", \"meanMs\": " << r.meanMs << ", \"pointsPerSecond\": " << r.pointsPerSecond
+			<< ", \"allocations\": " << r.allocations << ", \"allocatedBytes\": " << r.allocatedBytes
+			<< ", \"peakRssKB\": " << r.peakRssKB << " }" << ( i + 1 < results.size() ? "," : "" ) << "\n";
+	}
+	out << "  ]\n}\n";
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+int main( int argc, char** argv )
+{
+	osg::ArgumentParser arguments( &argc, argv );
+	std::string format = "csv";
+	std::string outputFile;
+	unsigned int maxPoints = 10000000;
+	unsigned int repeats = 3;
+	arguments.read( "--format", format );
+	arguments.read( "--output", outputFile );
+	arguments.read( "--max-points", maxPoints );
+	arguments.read( "--repeat", repeats );
+	if( repeats == 0 )
+		repeats = 1;
+
+	std::vector<Result> results;
+
+	// Single tubes of every shape and size
+	for( int shape = 0; shape < NUM_SHAPES; shape++ )
+	{
+		for( unsigned int numPoints = 1000; numPoints <= maxPoints; numPoints *= 10 )
+		{
+			std::vector<osg::Vec3> points = genTrajectory( static_cast<Shape>( shape ), numPoints );
+			TubeGeometryBuilder builder;
+
+			SetTrajectory setTrajectory( builder, points );
+			results.push_back( measure( setTrajectory, repeats, "setTrajectory", shapeName( static_cast<Shape>( shape ) ), numPoints, 1 ) );
+			unsigned int numSections = builder.getSections().size();
+			results.back().sections = numSections;
+
+			MakeCylinderGeometry makeCylinderGeometry( builder );
+			results.push_back( measure( makeCylinderGeometry, repeats, "makeCylinderGeometry", shapeName( static_cast<Shape>( shape ) ), numPoints, 1 ) );
+			results.back().sections = numSections;
+
+			// Same geometry in the compact layout
+			builder.setCompactVertices( true );
+			results.push_back( measure( makeCylinderGeometry, repeats, "makeCompactGeometry", shapeName( static_cast<Shape>( shape ) ), numPoints, 1 ) );
+			builder.setCompactVertices( false );
+			results.back().sections = numSections;
+
+			// The mesh has radialVertices vertices per section, past a million sections it needs gigabytes
+			if( numSections <= MAX_MESH_SECTIONS )
+			{
+				MakeMesh makeMesh( builder.getSections() );
+				results.push_back( measure( makeMesh, repeats, "cpuMesh", shapeName( static_cast<Shape>( shape ) ), numPoints, 1 ) );
+				results.back().sections = numSections;
+			}
+
+			std::cerr << shapeName( static_cast<Shape>( shape ) ) << " " << numPoints << " points done" << std::endl;
+		}
+	}
+
+	// The same amount of points split in more and more tubes
+	unsigned int totalPoints = std::min( maxPoints, 1000000u );
+	for( unsigned int numTubes = 1; numTubes <= 4096 && numTubes <= totalPoints / 16; numTubes *= 16 )
+	{
+		std::vector< std::vector<osg::Vec3> > trajectories( numTubes, genTrajectory( HELIX, totalPoints / numTubes ) );
+		std::vector< std::vector<TubeSection> > sections;
+
+		BuildSectionsBulk buildSectionsBulk( trajectories, sections );
+		results.push_back( measure( buildSectionsBulk, repeats, "buildSectionsBulk", shapeName( HELIX ), totalPoints, numTubes ) );
+
+		unsigned int numSections = 0;
+		for( unsigned int i = 0; i < sections.size(); i++ )
+			numSections += sections[i].size();
+		results.back().sections = numSections;
+
+		CreateBatch createBatch( sections );
+		results.push_back( measure( createBatch, repeats, "createBatch", shapeName( HELIX ), totalPoints, numTubes ) );
+		results.back().sections = numSections;
+
+		std::vector< std::vector<TubeSection> > spread = spreadTubes( sections, 4.0f );
+		BuildSegmentBVH buildSegmentBVH( spread );
+		results.push_back( measure( buildSegmentBVH, repeats, "buildSegmentBVH", shapeName( HELIX ), totalPoints, numTubes ) );
+		results.back().sections = numSections;
+
+		osg::BoundingBox box;
+		for( unsigned int i = 0; i < spread.size(); i++ )
+		{
+			for( unsigned int j = 0; j < spread[i].size(); j++ )
+				box.expandBy( spread[i][j].position );
+		}
+		const unsigned int numRays = 10000;
+		PickSegmentBVH pickSegmentBVH( buildSegmentBVH.getBVH(), box, numRays );
+		results.push_back( measure( pickSegmentBVH, repeats, "pickSegmentBVH", shapeName( HELIX ), numRays, numTubes ) );
+		results.back().sections = numSections;
+
+		std::cerr << numTubes << " tubes done" << std::endl;
+	}
+
+	// The same points again, read from a binary and a CSV file
+	{
+		unsigned int numTubes = std::max( std::min( 4096u, totalPoints / 16 ), 1u );
+		std::vector< std::vector<osg::Vec3> > trajectories( numTubes, genTrajectory( HELIX, totalPoints / numTubes ) );
+
+		const char* binaryFile = "tube_benchmark_trajectories.trj";
+		const char* csvFile = "tube_benchmark_trajectories.csv";
+		TrajectoryReader::writeBinary( binaryFile, trajectories );
+		{
+			std::ofstream csv( csvFile );
+			char line[128];
+			for( unsigned int i = 0; i < trajectories.size(); i++ )
+			{
+				for( unsigned int j = 0; j < trajectories[i].size(); j++ )
+				{
+					const osg::Vec3& p = trajectories[i][j];
+					sprintf( line, "%u,%.9g,%.9g,%.9g\n", i, p.x(), p.y(), p.z() );
+					csv << line;
+				}
+			}
+		}
+
+		unsigned int numPoints = numTubes * ( totalPoints / numTubes );
+		LoadTrajectories loadBinary( binaryFile );
+		results.push_back( measure( loadBinary, repeats, "loadBinaryTrajectories", shapeName( HELIX ), numPoints, numTubes ) );
+		results.back().sections = loadBinary.getNumSections();
+
+		LoadTrajectories loadCSV( csvFile );
+		results.push_back( measure( loadCSV, repeats, "loadCSVTrajectories", shapeName( HELIX ), numPoints, numTubes ) );
+		results.back().sections = loadCSV.getNumSections();
+
+		remove( binaryFile );
+		remove( csvFile );
+		std::cerr << "trajectory files done" << std::endl;
+	}
+
+	std::ofstream file;
+	if( !outputFile.empty() )
+	{
+		file.open( outputFile.c_str() );
+		if( !file )
+		{
+			std::cerr << "Can not write \"" << outputFile << "\"." << std::endl;
+			return 1;
+		}
+	}
+	std::ostream& out = outputFile.empty() ? std::cout : file;
+
+	if( format == "json" )
+		writeJSON( out, results );
+	else
+		writeCSV( out, results );
+	return 0;
+}
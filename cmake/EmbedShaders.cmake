@@ -0,0 +1,50 @@
+# Embeds the shaders of shaders/ in the binary, see src/TubeShaders.h.
+#
+# Included, it defines tube_embed_shaders( <variable> ), which sets <variable> to a source file generated
+# in the binary directory of the caller, to be added to its target. The file is generated again whenever
+# a shader changes. Run with -P, it generates that file from -DSHADER_DIR= into -DOUTPUT=.
+
+if( CMAKE_SCRIPT_MODE_FILE )
+	file( GLOB _shaders RELATIVE ${SHADER_DIR} ${SHADER_DIR}/*.vert ${SHADER_DIR}/*.frag ${SHADER_DIR}/*.control ${SHADER_DIR}/*.eval )
+	list( SORT _shaders )
+
+	set( _content "// Generated by cmake/EmbedShaders.cmake from the shaders directory, do not edit\n\n#include \"TubeShaders.h\"\n\n" )
+	set( _table "" )
+	foreach( _shader ${_shaders} )
+		# Hexadecimal bytes, a string literal would need escaping and overflow the compiler limits
+		file( READ ${SHADER_DIR}/${_shader} _hex HEX )
+		string( REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," _bytes "${_hex}" )
+		string( REGEX REPLACE "(0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,)" "\\1\n\t" _bytes "${_bytes}" )
+		string( REGEX REPLACE "[^A-Za-z0-9_]" "_" _name "s_${_shader}" )
+		set( _content "${_content}static const unsigned char ${_name}[] =\n{\n\t${_bytes}0x00\n};\n\n" )
+		set( _table "${_table}\t{ \"${_shader}\", reinterpret_cast<const char*>( ${_name} ) },\n" )
+	endforeach()
+
+	set( _content "${_content}const TubeShaders::EmbeddedSource TubeShaders::s_embeddedSources[] =\n{\n${_table}\t{ NULL, NULL }\n};\n" )
+
+	# Unchanged sources are not written, so the dependent objects are not built again
+	set( _old "" )
+	if( EXISTS ${OUTPUT} )
+		file( READ ${OUTPUT} _old )
+	endif()
+	if( NOT _old STREQUAL _content )
+		file( WRITE ${OUTPUT} "${_content}" )
+	endif()
+	return()
+endif()
+
+set( TUBE_EMBED_SHADERS_SCRIPT ${CMAKE_CURRENT_LIST_FILE} )
+
+function( tube_embed_shaders _output_variable )
+	set( _shader_dir ${CMAKE_SOURCE_DIR}/shaders )
+	set( _output ${CMAKE_CURRENT_BINARY_DIR}/TubeEmbeddedShaders.cpp )
+	file( GLOB _shaders ${_shader_dir}/*.vert ${_shader_dir}/*.frag ${_shader_dir}/*.control ${_shader_dir}/*.eval )
+
+	add_custom_command(
+		OUTPUT ${_output}
+		COMMAND ${CMAKE_COMMAND} -DSHADER_DIR=${_shader_dir} -DOUTPUT=${_output} -P ${TUBE_EMBED_SHADERS_SCRIPT}
+		DEPENDS ${_shaders} ${TUBE_EMBED_SHADERS_SCRIPT}
+		COMMENT "Embedding the tube shaders"
+	)
+	set( ${_output_variable} ${_output} PARENT_SCOPE )
+endfunction()
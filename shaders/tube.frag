@@ -1,8 +1,19 @@
 #version 400
+#if defined( TUBE_BATCH ) || defined( TUBE_FLUX_TABLE )
+// Tube parameters are read from the style table, see TubeStyleTable
+uniform sampler2D tubeTable;
+uniform float fluxTime;
+#ifdef TUBE_BATCH
+flat in float teTubeId;
+#else
+uniform int tubeTableId;
+#endif
+#else
 uniform float fluxStep;
 uniform float TimeUpdate;
 uniform vec4 color;
 uniform vec4 fluxColor;
+#endif
 
 in vec3 teNormal;
 in vec3 tePosition;
@@ -12,6 +23,26 @@ uniform vec3 lightPos;
 
 void main( void )
 {
+#if defined( TUBE_BATCH ) || defined( TUBE_FLUX_TABLE )
+#ifdef TUBE_BATCH
+	int tubeId = int( teTubeId + 0.5 );
+#else
+	int tubeId = tubeTableId;
+#endif
+	ivec2 tubeTexel = ivec2( ( tubeId % TUBE_TABLE_ROW_TUBES ) * 3, tubeId / TUBE_TABLE_ROW_TUBES );
+	vec4 color = texelFetch( tubeTable, tubeTexel, 0 );
+	vec4 fluxColor = texelFetch( tubeTable, tubeTexel + ivec2( 1, 0 ), 0 );
+	vec4 tubeParams = texelFetch( tubeTable, tubeTexel + ivec2( 2, 0 ), 0 );
+	float fluxStep = tubeParams.z;
+
+	// Same stepping TimeUpdate does on the CPU, the sign of the speed is the flux direction
+	float elapsedTime = floor( mod( fluxTime * abs( tubeParams.w ), fluxStep + 1.0 ) );
+	float TimeUpdate = tubeParams.w >= 0.0 ? elapsedTime : fluxStep - elapsedTime;
+#endif
+
+#ifdef TUBE_NO_LIGHTING
+	vec3 lightTotal = vec3( 1.0, 1.0, 1.0 );
+#else
 	vec3 lightPower = vec3( 0.5, 0.5 ,0.5 );
 	
 	vec3 s = normalize( lightPos - tePosition.xyz );
@@ -24,10 +55,15 @@ void main( void )
 	float spec = pow( max( dot(r,v), 0.0 ), 3 );
 	
 	vec3 lightTotal = ambient + diffuse + vec3( spec, spec, spec );
+#endif
 
+#ifdef TUBE_NO_FLUX
+	vec4 finalColor = color;
+#else
 	float hasNoFlux = mod( teDistanceTo0 + TimeUpdate, fluxStep ) / fluxStep;
 
 	vec4 finalColor = mix( fluxColor, color, sin( hasNoFlux * 3.14 ) );
+#endif
 	
 	gl_FragColor = vec4( finalColor.xyz * lightTotal, finalColor.w );
 }
@@ -1,8 +1,20 @@
 #version 400
+#ifdef TUBE_COMPACT
+// Compact layout, see TubeVertexCodec: snorm16 position in the range of its block, the block in w,
+// and snorm16 frame quaternion
+in vec4 osg_Vertex;
+in vec4 Frame;
+uniform vec4 positionBlocks[TUBE_POSITION_BLOCKS];
+#else
 in vec4 osg_Vertex;
 in vec3 Normal;
 in vec3 Binormal;
+#endif
 in float distanceTo0;
+#ifdef TUBE_BATCH
+in float tubeId;
+out float vTubeId;
+#endif
 
 out vec3 vNormal;
 out vec3 vPosition;
@@ -11,9 +23,20 @@ out float vDistanceTo0;
 
  void main( void )
  {
+#ifdef TUBE_COMPACT
+	vec4 block = positionBlocks[int( osg_Vertex.w )];
+	vPosition = block.xyz + osg_Vertex.xyz * ( block.w / 32767.0 );
+	vec4 q = normalize( Frame );
+	vNormal = vec3( 1.0 - 2.0 * ( q.y * q.y + q.z * q.z ), 2.0 * ( q.x * q.y + q.w * q.z ), 2.0 * ( q.x * q.z - q.w * q.y ) );
+	vBinormal = vec3( 2.0 * ( q.x * q.y - q.w * q.z ), 1.0 - 2.0 * ( q.x * q.x + q.z * q.z ), 2.0 * ( q.y * q.z + q.w * q.x ) );
+#else
 	vNormal = Normal;
     vPosition = osg_Vertex.xyz;
 	vBinormal = Binormal;
+#endif
 	vDistanceTo0 = distanceTo0;
+#ifdef TUBE_BATCH
+	vTubeId = tubeId;
+#endif
  }
  
\ No newline at end of file
@@ -1,14 +1,39 @@
 #version 400
+#ifdef TUBE_FLUX_TABLE
+// Flux parameters are read from the style table, see TubeStyleTable
+uniform sampler2D tubeTable;
+uniform float fluxTime;
+uniform int tubeTableId;
+#else
 uniform float fluxStep;
 uniform float TimeUpdate;
 uniform vec4 color;
 uniform vec4 fluxColor;
+#endif
 
 in float vDistanceTo0;
 
 void main( void )
 {
+#ifdef TUBE_FLUX_TABLE
+	ivec2 tubeTexel = ivec2( ( tubeTableId % TUBE_TABLE_ROW_TUBES ) * 3, tubeTableId / TUBE_TABLE_ROW_TUBES );
+	vec4 color = texelFetch( tubeTable, tubeTexel, 0 );
+	vec4 fluxColor = texelFetch( tubeTable, tubeTexel + ivec2( 1, 0 ), 0 );
+	vec4 tubeParams = texelFetch( tubeTable, tubeTexel + ivec2( 2, 0 ), 0 );
+	float fluxStep = tubeParams.z;
+
+	// Same stepping as tube.frag
+	float elapsedTime = floor( mod( fluxTime * abs( tubeParams.w ), fluxStep + 1.0 ) );
+	float TimeUpdate = tubeParams.w >= 0.0 ? elapsedTime : fluxStep - elapsedTime;
+#endif
+
+#ifdef TUBE_NO_FLUX
+	vec4 finalColor = color;
+#else
 	float hasNoFlux = mod( vDistanceTo0 + TimeUpdate, fluxStep ) / fluxStep;
 
-	gl_FragColor = mix( fluxColor, color, sin( hasNoFlux * 3.14 ) ) * vec4( 0.65, 0.65, 0.65, 1.0 );
+	vec4 finalColor = mix( fluxColor, color, sin( hasNoFlux * 3.14 ) );
+#endif
+
+	gl_FragColor = finalColor * vec4( 0.65, 0.65, 0.65, 1.0 );
 }
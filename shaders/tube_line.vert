@@ -2,6 +2,13 @@
 in vec4 osg_Vertex;
 in float distanceTo0;
 
+uniform mat4 osg_ModelViewMatrix;
+uniform mat4 osg_ProjectionMatrix;
+#ifdef TUBE_COMPACT
+// Snorm16 position in the range of its block, the block in w, see TubeVertexCodec
+uniform vec4 positionBlocks[TUBE_POSITION_BLOCKS];
+#endif
+
 out vec3 vPosition;
 out float vDistanceTo0;
 
@@ -9,6 +16,12 @@ out float vDistanceTo0;
  {
 	vDistanceTo0 = distanceTo0;
 	
-	gl_Position = gl_ProjectionMatrix * gl_ModelViewMatrix * vec4( osg_Vertex.xyz, 1.0f );
+#ifdef TUBE_COMPACT
+	vec4 block = positionBlocks[int( osg_Vertex.w )];
+	vec3 position = block.xyz + osg_Vertex.xyz * ( block.w / 32767.0 );
+#else
+	vec3 position = osg_Vertex.xyz;
+#endif
+	gl_Position = osg_ProjectionMatrix * osg_ModelViewMatrix * vec4( position, 1.0 );
  }
  
\ No newline at end of file
@@ -0,0 +1,20 @@
+#version 400
+// Tube mesh made on the CPU by TubeMeshBuilder, it gives tube.frag what tube.eval would
+in vec4 osg_Vertex;
+in vec3 Normal;
+in float distanceTo0;
+
+uniform mat4 osg_ModelViewMatrix;
+uniform mat4 osg_ProjectionMatrix;
+
+out vec3 tePosition;
+out vec3 teNormal;
+out float teDistanceTo0;
+
+ void main( void )
+ {
+	tePosition = osg_Vertex.xyz;
+	teNormal = Normal;
+	teDistanceTo0 = distanceTo0;
+	gl_Position = osg_ProjectionMatrix * osg_ModelViewMatrix * vec4( osg_Vertex.xyz, 1.0 );
+ }
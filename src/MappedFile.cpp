@@ -0,0 +1,163 @@
+#include "MappedFile.h"
+
+#include <algorithm>
+
+#if defined( _WIN32 )
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() :
+	_data( NULL ), _size( 0 )
+#if defined( _WIN32 )
+	, _file( INVALID_HANDLE_VALUE ), _mapping( NULL )
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#if defined( _WIN32 )
+
+bool MappedFile::open( const std::string& fileName )
+{
+	close();
+
+	HANDLE file = CreateFileA( fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if( file == INVALID_HANDLE_VALUE )
+		return false;
+
+	LARGE_INTEGER size;
+	if( !GetFileSizeEx( file, &size ) || size.QuadPart == 0 )
+	{
+		CloseHandle( file );
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+	if( mapping == NULL )
+	{
+		CloseHandle( file );
+		return false;
+	}
+
+	const void* data = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+	if( data == NULL )
+	{
+		CloseHandle( mapping );
+		CloseHandle( file );
+		return false;
+	}
+
+	_file = file;
+	_mapping = mapping;
+	_data = static_cast<const char*>( data );
+	_size = static_cast<size_t>( size.QuadPart );
+	return true;
+}
+
+void MappedFile::prefetch( size_t, size_t ) const
+{
+	// FILE_FLAG_SEQUENTIAL_SCAN already reads ahead
+}
+
+void MappedFile::release( size_t offset, size_t size ) const
+{
+	if( !_data || offset >= _size )
+		return;
+
+	// Unlocking pages that are not locked removes them from the working set
+	VirtualUnlock( const_cast<char*>( _data ) + offset, std::min( size, _size - offset ) );
+}
+
+void MappedFile::close()
+{
+	if( _data )
+		UnmapViewOfFile( _data );
+	if( _mapping )
+		CloseHandle( _mapping );
+	if( _file != INVALID_HANDLE_VALUE )
+		CloseHandle( _file );
+
+	_data = NULL;
+	_size = 0;
+	_mapping = NULL;
+	_file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool MappedFile::open( const std::string& fileName )
+{
+	close();
+
+	int file = ::open( fileName.c_str(), O_RDONLY );
+	if( file < 0 )
+		return false;
+
+	struct stat status;
+	if( fstat( file, &status ) != 0 || status.st_size == 0 )
+	{
+		::close( file );
+		return false;
+	}
+
+	// The mapping keeps the file referenced, the descriptor is not needed anymore
+	void* data = mmap( NULL, status.st_size, PROT_READ, MAP_PRIVATE, file, 0 );
+	::close( file );
+	if( data == MAP_FAILED )
+		return false;
+
+	_data = static_cast<const char*>( data );
+	_size = static_cast<size_t>( status.st_size );
+	madvise( data, _size, MADV_SEQUENTIAL );
+	return true;
+}
+
+void MappedFile::prefetch( size_t offset, size_t size ) const
+{
+	if( !_data || offset >= _size )
+		return;
+
+	size_t pageSize = static_cast<size_t>( sysconf( _SC_PAGESIZE ) );
+	size_t begin = offset / pageSize * pageSize;
+	size_t end = std::min( offset + size, _size );
+	madvise( const_cast<char*>( _data ) + begin, end - begin, MADV_WILLNEED );
+}
+
+void MappedFile::release( size_t offset, size_t size ) const
+{
+	if( !_data || offset >= _size )
+		return;
+
+	// The pages are read only, dropping them loses nothing
+	size_t pageSize = static_cast<size_t>( sysconf( _SC_PAGESIZE ) );
+	size_t begin = ( offset + pageSize - 1 ) / pageSize * pageSize;
+	size_t end = std::min( offset + size, _size );
+	if( end < _size )
+		end = end / pageSize * pageSize;
+	if( begin < end )
+		madvise( const_cast<char*>( _data ) + begin, end - begin, MADV_DONTNEED );
+}
+
+void MappedFile::close()
+{
+	if( _data )
+		munmap( const_cast<char*>( _data ), _size );
+
+	_data = NULL;
+	_size = 0;
+}
+
+#endif
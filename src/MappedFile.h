@@ -0,0 +1,52 @@
+#ifndef _MAPPED_FILE_
+#define _MAPPED_FILE_
+
+#include <string>
+
+#include <stddef.h>
+
+/*
+	Read only memory mapping of a whole file. The contents are paged in by the OS as they are read, so
+	large files are used in place without being copied or parsed.
+*/
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	//! Maps \fileName, returns false if it can not be opened. A previous mapping is closed.
+	bool open( const std::string& fileName );
+
+	void close();
+
+	bool isOpen() const { return _data != NULL; }
+
+	const char* getData() const { return _data; }
+
+	size_t getSize() const { return _size; }
+
+	//! Asks the OS to read the pages of [\offset, \offset + \size) ahead, without waiting for them.
+	void prefetch( size_t offset, size_t size ) const;
+
+	/*
+		Drops the pages of [\offset, \offset + \size) from memory, a later read pages them in again.
+		Only the pages entirely in the range are dropped. Reading a file from start to end and releasing
+		what was read keeps the resident memory bounded whatever the file size.
+	*/
+	void release( size_t offset, size_t size ) const;
+
+private:
+	// Not copyable, the mapping is released once
+	MappedFile( const MappedFile& );
+	MappedFile& operator=( const MappedFile& );
+
+	const char* _data;
+	size_t _size;
+#if defined( _WIN32 )
+	void* _file;
+	void* _mapping;
+#endif
+};
+
+#endif
@@ -0,0 +1,493 @@
+#include "TrajectoryReader.h"
+
+#include <osg/Notify>
+#include <OpenThreads/Condition>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+
+#include "TubeGeometryBuilder.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+namespace {
+
+const char MAGIC[8] = { 'T', 'U', 'B', 'E', 'T', 'R', 'A', 'J' };
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+struct FileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t scalarBytes;
+	uint32_t reserved;
+};
+
+// Digits kept in the mantissa, more would overflow it and are beyond the precision of a double anyway
+const uint64_t MAX_MANTISSA = 100000000000000000ULL;
+
+inline bool isDigit( char c )
+{
+	return c >= '0' && c <= '9';
+}
+
+inline bool isBlank( char c )
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline double powerOf10( int exponent )
+{
+	static const double exact[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	if( exponent >= 0 && exponent <= 22 )
+		return exact[exponent];
+	return std::pow( 10.0, exponent );
+}
+
+/*
+	Parses a decimal number at \p, which is not null terminated, moving \p past it. strtod would need
+	a copy of every field and depends on the locale.
+*/
+bool parseNumber( const char*& p, const char* end, double& value )
+{
+	const char* s = p;
+	bool negative = false;
+	if( s < end && ( *s == '-' || *s == '+' ) )
+	{
+		negative = *s == '-';
+		s++;
+	}
+
+	uint64_t mantissa = 0;
+	int exponent = 0;
+	int digits = 0;
+	for( ; s < end && isDigit( *s ); s++, digits++ )
+	{
+		if( mantissa < MAX_MANTISSA )
+			mantissa = mantissa * 10 + ( *s - '0' );
+		else
+			exponent++;
+	}
+	if( s < end && *s == '.' )
+	{
+		for( s++; s < end && isDigit( *s ); s++, digits++ )
+		{
+			if( mantissa < MAX_MANTISSA )
+			{
+				mantissa = mantissa * 10 + ( *s - '0' );
+				exponent--;
+			}
+		}
+	}
+	if( digits == 0 )
+		return false;
+
+	if( s < end && ( *s == 'e' || *s == 'E' ) )
+	{
+		const char* e = s + 1;
+		bool negativeExponent = false;
+		if( e < end && ( *e == '-' || *e == '+' ) )
+		{
+			negativeExponent = *e == '-';
+			e++;
+		}
+		int written = 0;
+		int exponentDigits = 0;
+		for( ; e < end && isDigit( *e ); e++, exponentDigits++ )
+			written = std::min( written * 10 + ( *e - '0' ), 100000 );
+		if( exponentDigits > 0 )
+		{
+			exponent += negativeExponent ? -written : written;
+			s = e;
+		}
+	}
+
+	double magnitude = static_cast<double>( mantissa );
+	value = exponent < 0 ? magnitude / powerOf10( -exponent ) : magnitude * powerOf10( exponent );
+	if( negative )
+		value = -value;
+	p = s;
+	return true;
+}
+
+/*
+	Parses the CSV line at \p into up to 4 \values and moves \p to the start of the next line.
+	Returns the number of values, 0 for an empty line and -1 for a line to skip.
+*/
+int parseLine( const char*& p, const char* end, double values[4] )
+{
+	const char* s = p;
+	while( s < end && isBlank( *s ) )
+		s++;
+
+	int numValues = 0;
+	if( s < end && *s != '\n' )
+	{
+		for( ;; )
+		{
+			double value;
+			if( !parseNumber( s, end, value ) )
+			{
+				numValues = -1;
+				break;
+			}
+			if( numValues < 4 )
+				values[numValues] = value;
+			numValues++;
+
+			while( s < end && isBlank( *s ) )
+				s++;
+			if( s == end || *s == '\n' )
+				break;
+			if( *s != ',' && *s != ';' )
+			{
+				numValues = -1;
+				break;
+			}
+			s++;
+			while( s < end && isBlank( *s ) )
+				s++;
+		}
+	}
+
+	const char* lineEnd = static_cast<const char*>( memchr( s, '\n', end - s ) );
+	p = lineEnd ? lineEnd + 1 : end;
+	return numValues;
+}
+
+bool writeHeader( std::ofstream& file, uint32_t scalarBytes )
+{
+	FileHeader header;
+	memcpy( header.magic, MAGIC, sizeof( MAGIC ) );
+	header.version = TrajectoryReader::VERSION;
+	header.byteOrder = BYTE_ORDER_MARK;
+	header.scalarBytes = scalarBytes;
+	header.reserved = 0;
+	return file.write( reinterpret_cast<const char*>( &header ), sizeof( header ) ).good();
+}
+
+bool writeRecord( std::ofstream& file, const void* coordinates, uint64_t numPoints, uint32_t scalarBytes )
+{
+	file.write( reinterpret_cast<const char*>( &numPoints ), sizeof( numPoints ) );
+	if( numPoints > 0 )
+		file.write( static_cast<const char*>( coordinates ), static_cast<std::streamsize>( numPoints * 3 * scalarBytes ) );
+	return file.good();
+}
+
+/*
+	Reads the chunks ahead of TrajectoryReader::buildSections. Three chunks rotate: the one being read,
+	the one read and waiting, and the one whose sections are being built.
+*/
+class ChunkReaderThread : public OpenThreads::Thread
+{
+public:
+	ChunkReaderThread( TrajectoryReader& reader, size_t maxPoints ) :
+		_reader( reader ), _maxPoints( maxPoints ), _filling( &_chunks[0] ), _pending( &_chunks[1] ), _current( &_chunks[2] ),
+		_hasPending( false ), _done( false ), _stop( false )
+	{
+	}
+
+	virtual void run()
+	{
+		for( ;; )
+		{
+			bool read = _reader.readChunk( *_filling, _maxPoints );
+
+			OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+			while( _hasPending && !_stop )
+				_condition.wait( &_mutex );
+			if( _stop || !read )
+			{
+				_done = true;
+				_condition.broadcast();
+				return;
+			}
+			std::swap( _filling, _pending );
+			_hasPending = true;
+			_condition.broadcast();
+		}
+	}
+
+	//! Waits for the next chunk, NULL at the end. The previous one is given back to the reader.
+	TrajectoryReader::Chunk* next()
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+		while( !_hasPending && !_done )
+			_condition.wait( &_mutex );
+		if( !_hasPending )
+			return NULL;
+
+		std::swap( _current, _pending );
+		_hasPending = false;
+		_condition.broadcast();
+		return _current;
+	}
+
+	void stop()
+	{
+		{
+			OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+			_stop = true;
+			_condition.broadcast();
+		}
+		join();
+	}
+
+private:
+	TrajectoryReader& _reader;
+	size_t _maxPoints;
+
+	TrajectoryReader::Chunk _chunks[3];
+	TrajectoryReader::Chunk* _filling;
+	TrajectoryReader::Chunk* _pending;
+	TrajectoryReader::Chunk* _current;
+
+	OpenThreads::Mutex _mutex;
+	OpenThreads::Condition _condition;
+	bool _hasPending;
+	bool _done;
+	bool _stop;
+};
+
+}
+
+TrajectoryReader::TrajectoryReader() :
+	_format( AUTO ), _offset( 0 ), _numTrajectories( 0 ), _scalarBytes( sizeof( float ) )
+{
+}
+
+bool TrajectoryReader::open( const std::string& fileName, Format format )
+{
+	close();
+	if( !_file.open( fileName ) )
+	{
+		osg::notify(osg::WARN) << "Can not open the trajectories \"" << fileName << "\"." << std::endl;
+		return false;
+	}
+
+	const FileHeader* header = _file.getSize() >= sizeof( FileHeader ) ?
+		reinterpret_cast<const FileHeader*>( _file.getData() ) : NULL;
+	bool binary = header && memcmp( header->magic, MAGIC, sizeof( MAGIC ) ) == 0;
+	if( format == AUTO )
+		format = binary ? BINARY : CSV;
+
+	if( format == BINARY )
+	{
+		if( !binary || header->version != VERSION || header->byteOrder != BYTE_ORDER_MARK ||
+			( header->scalarBytes != sizeof( float ) && header->scalarBytes != sizeof( double ) ) )
+		{
+			osg::notify(osg::WARN) << "\"" << fileName << "\" is not a binary trajectory file of version " << VERSION
+				<< " and of this byte order." << std::endl;
+			close();
+			return false;
+		}
+		_scalarBytes = header->scalarBytes;
+		_offset = sizeof( FileHeader );
+	}
+
+	_format = format;
+	_fileName = fileName;
+	return true;
+}
+
+void TrajectoryReader::close()
+{
+	_file.close();
+	_format = AUTO;
+	_fileName.clear();
+	_offset = 0;
+	_numTrajectories = 0;
+	_scalarBytes = sizeof( float );
+}
+
+double TrajectoryReader::getProgress() const
+{
+	return _file.getSize() > 0 ? static_cast<double>( _offset ) / _file.getSize() : 1.0;
+}
+
+bool TrajectoryReader::readChunk( Chunk& chunk, size_t maxPoints )
+{
+	chunk.trajectories.clear();
+	chunk.points.clear();
+	chunk.numPoints = 0;
+	chunk.firstTrajectory = _numTrajectories;
+	chunk.beginOffset = _offset;
+
+	bool read = false;
+	if( _format == BINARY )
+		read = readBinaryChunk( chunk, maxPoints );
+	else if( _format == CSV )
+		read = readCSVChunk( chunk, maxPoints );
+
+	chunk.endOffset = _offset;
+	_numTrajectories += chunk.trajectories.size();
+	return read;
+}
+
+bool TrajectoryReader::readBinaryChunk( Chunk& chunk, size_t maxPoints )
+{
+	const char* data = _file.getData();
+	size_t size = _file.getSize();
+	while( _offset < size && ( chunk.trajectories.empty() || chunk.numPoints < maxPoints ) )
+	{
+		uint64_t numPoints = 0;
+		uint64_t pointBytes = 0;
+		if( size - _offset >= sizeof( numPoints ) )
+		{
+			memcpy( &numPoints, data + _offset, sizeof( numPoints ) );
+			pointBytes = numPoints * 3 * _scalarBytes;
+		}
+		if( size - _offset < sizeof( numPoints ) || numPoints > UINT_MAX ||
+			pointBytes > size - _offset - sizeof( numPoints ) )
+		{
+			osg::notify(osg::WARN) << "\"" << _fileName << "\" is truncated after " << _numTrajectories + chunk.trajectories.size()
+				<< " trajectories." << std::endl;
+			_offset = size;
+			break;
+		}
+
+		const char* points = data + _offset + sizeof( numPoints );
+		if( _scalarBytes == sizeof( double ) )
+			chunk.trajectories.push_back( TrajectoryView::fromDoubles( reinterpret_cast<const double*>( points ),
+				static_cast<unsigned int>( numPoints ) ) );
+		else
+			chunk.trajectories.push_back( TrajectoryView::fromFloats( reinterpret_cast<const float*>( points ),
+				static_cast<unsigned int>( numPoints ) ) );
+		chunk.numPoints += static_cast<size_t>( numPoints );
+		_offset += sizeof( numPoints ) + static_cast<size_t>( pointBytes );
+	}
+
+	// The points are only read when the sections are built, the disk can start on them now
+	_file.prefetch( chunk.beginOffset, _offset - chunk.beginOffset );
+	return !chunk.trajectories.empty();
+}
+
+bool TrajectoryReader::readCSVChunk( Chunk& chunk, size_t maxPoints )
+{
+	const char* data = _file.getData();
+	const char* end = data + _file.getSize();
+	const char* p = data + _offset;
+
+	bool inTrajectory = false;
+	double id = 0.0;
+	while( p < end )
+	{
+		const char* line = p;
+		double values[4];
+		int numValues = parseLine( p, end, values );
+		if( numValues == 0 )
+		{
+			// An empty line ends the trajectory
+			bool ended = inTrajectory;
+			inTrajectory = false;
+			if( ended && chunk.numPoints >= maxPoints )
+				break;
+			continue;
+		}
+		if( numValues < 3 )
+			continue;
+
+		const double* xyz = values;
+		if( numValues >= 4 )
+		{
+			if( inTrajectory && values[0] != id )
+			{
+				inTrajectory = false;
+				if( chunk.numPoints >= maxPoints )
+				{
+					// The line starts the first trajectory of the next chunk
+					p = line;
+					break;
+				}
+			}
+			id = values[0];
+			xyz = values + 1;
+		}
+
+		if( !inTrajectory )
+		{
+			chunk.trajectories.push_back( TrajectoryView() );
+			inTrajectory = true;
+		}
+		chunk.points.push_back( static_cast<float>( xyz[0] ) );
+		chunk.points.push_back( static_cast<float>( xyz[1] ) );
+		chunk.points.push_back( static_cast<float>( xyz[2] ) );
+		chunk.trajectories.back().numPoints++;
+		chunk.numPoints++;
+	}
+	_offset = p - data;
+
+	// The points buffer is complete, it will not move anymore
+	const float* points = chunk.points.empty() ? NULL : &chunk.points[0];
+	for( size_t i = 0; i < chunk.trajectories.size(); i++ )
+	{
+		chunk.trajectories[i] = TrajectoryView::fromFloats( points, chunk.trajectories[i].numPoints );
+		points += 3 * chunk.trajectories[i].numPoints;
+	}
+	return !chunk.trajectories.empty();
+}
+
+size_t TrajectoryReader::buildSections( Consumer& consumer, float verticalScale, float curveTolerance,
+	size_t maxChunkPoints, TubeWorkerPool* pool )
+{
+	ChunkReaderThread readerThread( *this, maxChunkPoints );
+	readerThread.start();
+
+	// Reused by every chunk, its vectors keep their capacity
+	std::vector< std::vector<TubeSection> > sections;
+	size_t numTrajectories = 0;
+	while( Chunk* chunk = readerThread.next() )
+	{
+		TubeGeometryBuilder::buildSectionsBulk( chunk->trajectories, sections, verticalScale, curveTolerance, pool );
+		consumer.consume( *chunk, sections );
+		numTrajectories += chunk->trajectories.size();
+		_file.release( chunk->beginOffset, chunk->endOffset - chunk->beginOffset );
+	}
+	readerThread.stop();
+	return numTrajectories;
+}
+
+bool TrajectoryReader::writeBinary( const std::string& fileName, const std::vector< std::vector<osg::Vec3> >& trajectories )
+{
+	std::ofstream file( fileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+	if( !file || !writeHeader( file, sizeof( float ) ) )
+		return false;
+
+	for( size_t i = 0; i < trajectories.size(); i++ )
+	{
+		const std::vector<osg::Vec3>& trajectory = trajectories[i];
+		if( !writeRecord( file, trajectory.empty() ? NULL : trajectory[0].ptr(), trajectory.size(), sizeof( float ) ) )
+			return false;
+	}
+	return true;
+}
+
+bool TrajectoryReader::convertToBinary( const std::string& input, const std::string& output, size_t maxChunkPoints )
+{
+	TrajectoryReader reader;
+	if( !reader.open( input ) )
+		return false;
+
+	std::ofstream file( output.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+	if( !file || !writeHeader( file, reader._scalarBytes ) )
+		return false;
+
+	// The views of a chunk are packed, each one is written at once
+	Chunk chunk;
+	while( reader.readChunk( chunk, maxChunkPoints ) )
+	{
+		for( size_t i = 0; i < chunk.trajectories.size(); i++ )
+		{
+			if( !writeRecord( file, chunk.trajectories[i].x, chunk.trajectories[i].numPoints, reader._scalarBytes ) )
+				return false;
+		}
+		reader._file.release( chunk.beginOffset, chunk.endOffset - chunk.beginOffset );
+	}
+	return true;
+}
@@ -0,0 +1,131 @@
+#ifndef _TRAJECTORY_READER_
+#define _TRAJECTORY_READER_
+
+#include <osg/Vec3>
+
+#include "MappedFile.h"
+#include "TrajectoryView.h"
+#include "TubeSection.h"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+class TubeWorkerPool;
+
+/*
+	Reads the trajectories of files too large to be held in memory, in chunks of whole trajectories.
+
+	The file is memory mapped. A binary file is read in place: the views of a chunk point into the
+	mapping, so the points are neither copied nor allocated, they are paged in when the sections are
+	built. A CSV file is parsed into the point buffer of the chunk, which is reused by the next chunks.
+	Either way the memory used is bounded by the chunk size, not by the file size.
+
+	The binary format is a header, TUBETRAJ, a version, a byte order mark and the size of a coordinate,
+	4 for float or 8 for double, followed by one record per trajectory: its number of points as a
+	uint64_t and its x, y, z coordinates. writeBinary makes such files, convertToBinary turns a CSV file
+	into one.
+
+	A CSV line is either "x,y,z", trajectories being separated by empty lines, or "id,x,y,z", a new
+	trajectory starting where the id changes. Lines that do not start with a number, such as a header
+	or # comments, are skipped.
+*/
+class TrajectoryReader
+{
+public:
+	static const uint32_t VERSION = 1;
+
+	//! Points from which a chunk is complete.
+	static const size_t DEFAULT_CHUNK_POINTS = 1 << 20;
+
+	enum Format
+	{
+		//! Binary when the file starts with the binary header, else CSV.
+		AUTO,
+		BINARY,
+		CSV
+	};
+
+	//! Consecutive trajectories of the file.
+	struct Chunk
+	{
+		Chunk() : firstTrajectory( 0 ), numPoints( 0 ), beginOffset( 0 ), endOffset( 0 ) {}
+
+		//! Index in the file of the first trajectory of the chunk.
+		size_t firstTrajectory;
+		std::vector<TrajectoryView> trajectories;
+		size_t numPoints;
+
+		//! Bytes of the file the chunk was read from.
+		size_t beginOffset;
+		size_t endOffset;
+
+		//! Coordinates parsed from a CSV file, the views point into it. Unused for binary files.
+		std::vector<float> points;
+	};
+
+	/*
+		Receives the chunks read by buildSections, in the file order. \sections[i] holds the sections of
+		\chunk.trajectories[i], both are reused for the next chunk once consume returns, so they must be
+		copied to be kept.
+	*/
+	class Consumer
+	{
+	public:
+		virtual ~Consumer() {}
+
+		virtual void consume( const Chunk& chunk, const std::vector< std::vector<TubeSection> >& sections ) = 0;
+	};
+
+	TrajectoryReader();
+
+	//! Maps \fileName, returns false and warns if it can not be read as \format.
+	bool open( const std::string& fileName, Format format = AUTO );
+
+	void close();
+
+	//! Format of the opened file, BINARY or CSV.
+	Format getFormat() const { return _format; }
+
+	//! Fraction of the file read so far.
+	double getProgress() const;
+
+	/*
+		Reads the next trajectories into \chunk, until it holds \maxPoints points or more. A trajectory is
+		never split. Returns false at the end of the file, a truncated binary file ends at its last whole trajectory.
+	*/
+	bool readChunk( Chunk& chunk, size_t maxPoints = DEFAULT_CHUNK_POINTS );
+
+	/*
+		Reads the whole file and builds the sections of every chunk with TubeGeometryBuilder::buildSectionsBulk,
+		handing them to \consumer. The next chunk is read on another thread while the sections of the current
+		one are built, and the pages of the consumed chunks are released. Returns the number of trajectories.
+	*/
+	size_t buildSections( Consumer& consumer, float verticalScale = 1.0f, float curveTolerance = 0.001f,
+		size_t maxChunkPoints = DEFAULT_CHUNK_POINTS, TubeWorkerPool* pool = NULL );
+
+	//! Writes \trajectories to \fileName in the binary format.
+	static bool writeBinary( const std::string& fileName, const std::vector< std::vector<osg::Vec3> >& trajectories );
+
+	//! Rewrites the trajectories of \input, in any format, to \output in the binary format, chunk by chunk.
+	static bool convertToBinary( const std::string& input, const std::string& output,
+		size_t maxChunkPoints = DEFAULT_CHUNK_POINTS );
+
+private:
+	// Not copyable, like the mapping
+	TrajectoryReader( const TrajectoryReader& );
+	TrajectoryReader& operator=( const TrajectoryReader& );
+
+	bool readBinaryChunk( Chunk& chunk, size_t maxPoints );
+	bool readCSVChunk( Chunk& chunk, size_t maxPoints );
+
+	MappedFile _file;
+	Format _format;
+	std::string _fileName;
+	size_t _offset;
+	size_t _numTrajectories;
+	uint32_t _scalarBytes;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef _TRAJECTORY_VIEW_
+#define _TRAJECTORY_VIEW_
+
+#include <osg/Vec3>
+
+#include <vector>
+
+/*
+	Trajectory points stored in memory owned by the caller, read in place by the section builders.
+	Point i is ( x, y, z ) read at byte offset i * strideBytes from each of the three pointers, as
+	float or double. An interleaved array with other per sample fields only needs the right stride.
+	The view does not own the memory, which must outlive the builder call.
+*/
+struct TrajectoryView
+{
+	TrajectoryView() : x( NULL ), y( NULL ), z( NULL ), numPoints( 0 ), strideBytes( 0 ), isDouble( false )
+	{
+	}
+
+	//! Points whose first three floats are x, y and z, \strideBytes apart.
+	static TrajectoryView fromFloats( const float* points, unsigned int numPoints, unsigned int strideBytes = 3 * sizeof( float ) )
+	{
+		return fromComponents( points, points + 1, points + 2, numPoints, strideBytes );
+	}
+
+	//! Points whose first three doubles are x, y and z, \strideBytes apart.
+	static TrajectoryView fromDoubles( const double* points, unsigned int numPoints, unsigned int strideBytes = 3 * sizeof( double ) )
+	{
+		return fromComponents( points, points + 1, points + 2, numPoints, strideBytes );
+	}
+
+	//! Coordinates in separate arrays, \strideBytes is sizeof( float ) when they are packed.
+	static TrajectoryView fromComponents( const float* x, const float* y, const float* z, unsigned int numPoints,
+		unsigned int strideBytes = sizeof( float ) )
+	{
+		TrajectoryView view;
+		view.x = x; view.y = y; view.z = z;
+		view.numPoints = numPoints;
+		view.strideBytes = strideBytes;
+		view.isDouble = false;
+		return view;
+	}
+
+	static TrajectoryView fromComponents( const double* x, const double* y, const double* z, unsigned int numPoints,
+		unsigned int strideBytes = sizeof( double ) )
+	{
+		TrajectoryView view;
+		view.x = x; view.y = y; view.z = z;
+		view.numPoints = numPoints;
+		view.strideBytes = strideBytes;
+		view.isDouble = true;
+		return view;
+	}
+
+	static TrajectoryView fromVector( const std::vector<osg::Vec3>& trajectory )
+	{
+		if( trajectory.empty() )
+			return TrajectoryView();
+		return fromFloats( trajectory[0].ptr(), trajectory.size(), sizeof( osg::Vec3 ) );
+	}
+
+	const void* x;
+	const void* y;
+	const void* z;
+	unsigned int numPoints;
+	unsigned int strideBytes;
+	bool isDouble;
+};
+
+#endif
@@ -0,0 +1,102 @@
+#include "TubeArrayPool.h"
+
+size_t TubeArrayPool::Arrays::getCapacity() const
+{
+	return distanceTo0.valid() ? distanceTo0->capacity() : 0;
+}
+
+size_t TubeArrayPool::Arrays::getNumBytes() const
+{
+	if( compact )
+		return getCapacity() * ( 2 * sizeof( osg::Vec4s ) + sizeof( float ) );
+	return getCapacity() * ( 3 * sizeof( osg::Vec3 ) + sizeof( float ) );
+}
+
+TubeArrayPool::TubeArrayPool( size_t maxBytes ) :
+	_numBytes( 0 ), _maxBytes( maxBytes )
+{
+}
+
+void TubeArrayPool::release( osg::Geometry* geometry )
+{
+	Arrays arrays;
+	arrays.position = geometry->getVertexArray();
+	arrays.distanceTo0 = dynamic_cast<osg::FloatArray*>( geometry->getVertexAttribArray( 6 ) );
+	arrays.frame = dynamic_cast<osg::Vec4sArray*>( geometry->getVertexAttribArray( 4 ) );
+	arrays.compact = arrays.frame.valid();
+	if( !arrays.compact )
+	{
+		arrays.normal = dynamic_cast<osg::Vec3Array*>( geometry->getVertexAttribArray( 2 ) );
+		arrays.binormal = dynamic_cast<osg::Vec3Array*>( geometry->getVertexAttribArray( 3 ) );
+	}
+
+	// Not a tube, e.g. a CPU mesh
+	bool complete = arrays.position.valid() && arrays.distanceTo0.valid() &&
+		( arrays.compact ? dynamic_cast<osg::Vec4sArray*>( arrays.position.get() ) != NULL :
+			dynamic_cast<osg::Vec3Array*>( arrays.position.get() ) && arrays.normal.valid() && arrays.binormal.valid() );
+	if( !complete || _numBytes + arrays.getNumBytes() > _maxBytes )
+		return;
+
+	_numBytes += arrays.getNumBytes();
+	_arrays.push_back( arrays );
+}
+
+bool TubeArrayPool::acquire( bool compact, size_t numVertices, Arrays& arrays )
+{
+	size_t best = _arrays.size();
+	for( size_t i = 0; i < _arrays.size(); i++ )
+	{
+		if( _arrays[i].compact != compact )
+			continue;
+		if( best == _arrays.size() )
+		{
+			best = i;
+			continue;
+		}
+
+		// The smallest large enough, else the largest
+		size_t capacity = _arrays[i].getCapacity();
+		size_t bestCapacity = _arrays[best].getCapacity();
+		bool fits = capacity >= numVertices;
+		bool bestFits = bestCapacity >= numVertices;
+		if( fits ? ( !bestFits || capacity < bestCapacity ) : ( !bestFits && capacity > bestCapacity ) )
+			best = i;
+	}
+	if( best == _arrays.size() )
+		return false;
+
+	arrays = _arrays[best];
+	_numBytes -= arrays.getNumBytes();
+	_arrays[best] = _arrays.back();
+	_arrays.pop_back();
+
+	if( compact )
+	{
+		static_cast<osg::Vec4sArray*>( arrays.position.get() )->clear();
+		arrays.frame->clear();
+	}
+	else
+	{
+		static_cast<osg::Vec3Array*>( arrays.position.get() )->clear();
+		arrays.normal->clear();
+		arrays.binormal->clear();
+	}
+	arrays.distanceTo0->clear();
+	return true;
+}
+
+void TubeArrayPool::setMaxBytes( size_t maxBytes )
+{
+	_maxBytes = maxBytes;
+	while( _numBytes > _maxBytes && !_arrays.empty() )
+	{
+		_numBytes -= _arrays.back().getNumBytes();
+		_arrays.pop_back();
+	}
+}
+
+void TubeArrayPool::clear()
+{
+	_arrays.clear();
+	_numBytes = 0;
+}
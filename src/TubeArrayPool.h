@@ -0,0 +1,72 @@
+#ifndef _TUBE_ARRAY_POOL_
+#define _TUBE_ARRAY_POOL_
+
+#include <osg/Array>
+#include <osg/Geometry>
+
+#include <vector>
+
+#include <stddef.h>
+
+/*
+	Vertex arrays of tubes that were built again, kept to be filled by the next tubes instead of
+	allocating new ones. A recycled array keeps its memory and its buffer object, so the new tube
+	also reuses the GL buffer of the one it replaces.
+
+	The arrays must not be used by a geometry of the scene anymore when they are released, e.g. the
+	tube was removed by createTubeWithLOD. A draw thread may still be drawing the frame the tube was
+	removed after, the geometries of makeCylinderGeometry are DYNAMIC so the next frame, which refills
+	the arrays, waits for that draw. The pool keeps at most \maxBytes of arrays, the ones released past
+	it are dropped.
+*/
+class TubeArrayPool
+{
+public:
+	//! Arrays of one tube, in the layout of TubeGeometryBuilder::makeCylinderGeometry.
+	struct Arrays
+	{
+		Arrays() : compact( false ) {}
+
+		bool compact;
+		//! Vec3Array, or Vec4sArray in the compact layout.
+		osg::ref_ptr<osg::Array> position;
+		//! Vec3Arrays, NULL in the compact layout.
+		osg::ref_ptr<osg::Vec3Array> normal;
+		osg::ref_ptr<osg::Vec3Array> binormal;
+		//! Compact frames, NULL in the standard layout.
+		osg::ref_ptr<osg::Vec4sArray> frame;
+		osg::ref_ptr<osg::FloatArray> distanceTo0;
+
+		//! Vertices the arrays hold without reallocating.
+		size_t getCapacity() const;
+
+		size_t getNumBytes() const;
+	};
+
+	TubeArrayPool( size_t maxBytes = 64 << 20 );
+
+	//! Takes the tube arrays of \geometry, made by makeCylinderGeometry. The geometry keeps them too.
+	void release( osg::Geometry* geometry );
+
+	/*
+		Gives the smallest arrays of the \compact layout holding \numVertices vertices, emptied. When none
+		is large enough, the largest one, which will grow. Returns false when the pool has no arrays of
+		that layout.
+	*/
+	bool acquire( bool compact, size_t numVertices, Arrays& arrays );
+
+	size_t getNumBytes() const { return _numBytes; }
+
+	size_t getMaxBytes() const { return _maxBytes; }
+
+	void setMaxBytes( size_t maxBytes );
+
+	void clear();
+
+private:
+	std::vector<Arrays> _arrays;
+	size_t _numBytes;
+	size_t _maxBytes;
+};
+
+#endif
@@ -0,0 +1,103 @@
+#include "TubeBatchBuilder.h"
+
+#include <osg/PatchParameter>
+
+#include <algorithm>
+
+TubeBatchBuilder::TubeBatchBuilder() :
+	_patchVertices( 0 )
+{
+	clear();
+}
+
+void TubeBatchBuilder::clear()
+{
+	_pos = new osg::Vec3Array;
+	_nor = new osg::Vec3Array;
+	_bin = new osg::Vec3Array;
+	_distanceTo0 = new osg::FloatArray;
+	_tubeIds = new osg::FloatArray;
+	_tubeFirstVertex.clear();
+	_styleTable = new TubeStyleTable;
+	_segmentBVH = NULL;
+}
+
+unsigned int TubeBatchBuilder::addTube( const TubeGeometryBuilder& builder, const TubeStyle& style )
+{
+	return addTube( builder.getSections(), style );
+}
+
+unsigned int TubeBatchBuilder::addTube( const std::vector<TubeGeometryBuilder::Section>& sections, const TubeStyle& style )
+{
+	unsigned int tubeId = _styleTable->addTube( style );
+	_tubeFirstVertex.push_back( _pos->size() );
+	TubeGeometryBuilder::packSectionVertices( sections, _pos.get(), _nor.get(), _bin.get(), _distanceTo0.get(),
+		_tubeIds.get(), static_cast<float>( tubeId ) );
+	if( _segmentBVH.valid() )
+		_segmentBVH->setTube( tubeId, sections, style.radius );
+	return tubeId;
+}
+
+void TubeBatchBuilder::createBatch( osg::Group* batchGroup, osg::Camera* cam )
+{
+	batchGroup->removeChildren( 0, batchGroup->getNumChildren() );
+	batchGroup->getOrCreateStateSet()->clear();
+
+	// The patch size suits the average tube, all the tubes of the batch share the program
+	unsigned int numTubes = _tubeFirstVertex.size();
+	unsigned int patchVertices = _patchVertices;
+	if( patchVertices == 0 )
+		patchVertices = TubePatchLayout::choosePatchSize( numTubes > 0 ? _pos->size() / numTubes : 0 );
+
+	osg::DrawElementsUInt* patches = new osg::DrawElementsUInt( osg::PrimitiveSet::PATCHES );
+	for( unsigned int i = 0; i < numTubes; i++ )
+	{
+		unsigned int end = i + 1 < numTubes ? _tubeFirstVertex[i + 1] : _pos->size();
+		TubePatchLayout::appendIndices( patches, _tubeFirstVertex[i], end - _tubeFirstVertex[i], patchVertices );
+	}
+
+	osg::Geometry* geo = new osg::Geometry();
+	geo->setVertexArray( _pos.get() );
+	geo->addPrimitiveSet( patches );
+	geo->setVertexAttribArray( 2, _nor.get() );
+	geo->setVertexAttribBinding( 2, osg::Geometry::BIND_PER_VERTEX );
+	geo->setVertexAttribArray( 3, _bin.get() );
+	geo->setVertexAttribBinding( 3, osg::Geometry::BIND_PER_VERTEX );
+	geo->setVertexAttribArray( 6, _distanceTo0.get() );
+	geo->setVertexAttribBinding( 6, osg::Geometry::BIND_PER_VERTEX );
+	geo->setVertexAttribArray( 7, _tubeIds.get() );
+	geo->setVertexAttribBinding( 7, osg::Geometry::BIND_PER_VERTEX );
+	geo->setUseDisplayList( false );
+	geo->setUseVertexBufferObjects( true );
+
+	osg::Geode* tubes = new osg::Geode();
+	tubes->addDrawable( geo );
+	batchGroup->addChild( tubes );
+
+	if( _segmentBVH.valid() )
+	{
+		for( unsigned int i = 0; i < numTubes; i++ )
+			_segmentBVH->setTubeGroup( i, batchGroup );
+	}
+
+	osg::StateSet* batchSS = batchGroup->getOrCreateStateSet();
+	batchSS->setAttributeAndModes( TubeGeometryBuilder::getBatchProgram( patchVertices ), osg::StateAttribute::ON );
+	batchSS->setAttribute( new osg::PatchParameter( patchVertices ) );
+	_tessellation.forPatch( patchVertices ).apply( batchSS );
+	_styleTable->apply( batchSS, 0 );
+
+	// Without a camera the view uniforms come from a TubeCameraUniforms above the batch
+	if( cam )
+	{
+		osg::Uniform* mvpInverseUniform = new osg::Uniform( "MVPinverse", osg::Matrixf() );
+		mvpInverseUniform->setUpdateCallback( new MVPInverseCallback( cam ) );
+		batchSS->addUniform( mvpInverseUniform );
+
+		osg::Uniform* screenUniform = new osg::Uniform( "screenWidth", 10000.0f );
+		screenUniform->setUpdateCallback( new ScreenCallback( cam ) );
+		batchSS->addUniform( screenUniform );
+	}
+
+	// One light shared by every tube of the batch
+	batchSS->addUniform( new osg::Uniform( "lightPos", ::osg::Vec3( 10000, 10000, 10000 ) ) );
+}
@@ -0,0 +1,74 @@
+#ifndef _TUBE_BATCH_BUILDER_
+#define _TUBE_BATCH_BUILDER_
+
+#include "TubeGeometryBuilder.h"
+#include "TubeSegmentBVH.h"
+#include "TubeStyleTable.h"
+
+/*
+	Packs many trajectories in a single geometry so they are drawn with one draw call, one program
+	and one StateSet. The patches of every tube are indexed as TubePatchLayout describes, so the batch
+	is a single DrawElements of patches. The style of each tube lives in a TubeStyleTable indexed by a per vertex tube id.
+*/
+class TubeBatchBuilder
+{
+public:
+	TubeBatchBuilder();
+
+	/*
+		Adds the sections of the last trajectory set on \builder to the batch.
+		Returns the tube id, which can be used to change the tube style later.
+	*/
+	unsigned int addTube( const TubeGeometryBuilder& builder, const TubeStyle& style );
+
+	unsigned int addTube( const std::vector<TubeGeometryBuilder::Section>& sections, const TubeStyle& style );
+
+	//! Changes the style of a tube, also after the batch has been created.
+	void setTubeStyle( unsigned int tubeId, const TubeStyle& style )
+	{
+		_styleTable->setTube( tubeId, style );
+		if( _segmentBVH.valid() )
+			_segmentBVH->setTubeRadius( tubeId, style.radius );
+	}
+
+	unsigned int getNumTubes() const { return _styleTable->getNumTubes(); }
+
+	/*
+		Creates the geometry with all the tubes added so far under \batchGroup.
+		The builder keeps the style table, so setTubeStyle still affects the created batch.
+		\cam may be NULL when a TubeCameraUniforms above the batch provides the view uniforms.
+	*/
+	void createBatch( osg::Group* batchGroup, osg::Camera* cam );
+
+	//! Tessellation of the batches created afterwards, the levels are chosen per patch on screen size.
+	void setTessellation( const TubeTessellation::Settings& settings ) { _tessellation = settings; }
+
+	//! Patch size of the batches created afterwards, 0 chooses it from the average tube length.
+	void setPatchVertices( unsigned int patchVertices ) { _patchVertices = patchVertices; }
+
+	/*
+		Adds the tubes added afterwards to \bvh, with their batch tube id, so the hits of its queries are
+		tubes of this batch. The tube ids start again from 0 with a new batch, clear removes the BVH.
+	*/
+	void setSegmentBVH( TubeSegmentBVH* bvh ) { _segmentBVH = bvh; }
+
+	TubeSegmentBVH* getSegmentBVH() { return _segmentBVH.get(); }
+
+	//! Starts a new batch, previously created batches are not affected.
+	void clear();
+
+private:
+	osg::ref_ptr<osg::Vec3Array> _pos;
+	osg::ref_ptr<osg::Vec3Array> _nor;
+	osg::ref_ptr<osg::Vec3Array> _bin;
+	osg::ref_ptr<osg::FloatArray> _distanceTo0;
+	osg::ref_ptr<osg::FloatArray> _tubeIds;
+	//! First vertex of every tube, the tubes are contiguous in the arrays.
+	std::vector<unsigned int> _tubeFirstVertex;
+	osg::ref_ptr<TubeStyleTable> _styleTable;
+	osg::ref_ptr<TubeSegmentBVH> _segmentBVH;
+	TubeTessellation::Settings _tessellation;
+	unsigned int _patchVertices;
+};
+
+#endif
@@ -0,0 +1,284 @@
+#include "TubeBuildService.h"
+
+#include <osg/Notify>
+#include <osg/Timer>
+#include <OpenThreads/ScopedLock>
+
+#include <algorithm>
+#include <cfloat>
+#include <stdexcept>
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+class TubeBuildService::WorkerThread : public OpenThreads::Thread
+{
+public:
+	WorkerThread( TubeBuildService* service ) : _service( service )
+	{
+	}
+
+	virtual void run()
+	{
+		_service->workerLoop();
+	}
+
+private:
+	TubeBuildService* _service;
+};
+
+TubeBuildService::Parameters::Parameters() :
+	verticalScale( 1.0f ), curveTolerance( 0.001f ), radius( 0.4f ), minRadius( 4.0f ), color( 1, 1, 1, 1 ),
+	fluxColor( 1, 0, 0, 1 ), fluxUp( true ), fluxSpeed( 10.0f ), fluxStep( 10 ), numRadialVertices( 10 ), lineWidth( 4.0f ),
+	backend( TubeGeometryBuilder::TESSELLATION_SHADERS ), patchVertices( 0 ), chunkPatches( 0 ), compactVertices( false ),
+	priority( 0 )
+{
+}
+
+TubeBuildService::TubeBuildService( unsigned int numThreads ) :
+	_quit( false ), _running( 0 ), _nextId( INVALID_JOB + 1 ), _nextSequence( 0 ), _hasEye( false ), _frameBudget( 2.0 )
+{
+	// The viewer thread keeps a processor for itself
+	if( numThreads == 0 )
+		numThreads = std::max( OpenThreads::GetNumberOfProcessors() - 1, 1 );
+
+	for( unsigned int i = 0; i < numThreads; i++ )
+	{
+		WorkerThread* thread = new WorkerThread( this );
+		_threads.push_back( thread );
+		thread->start();
+	}
+}
+
+TubeBuildService::~TubeBuildService()
+{
+	cancelAll();
+	{
+		ScopedLock lock( _mutex );
+		_quit = true;
+		_wakeCondition.broadcast();
+	}
+
+	for( unsigned int i = 0; i < _threads.size(); i++ )
+	{
+		_threads[i]->join();
+		delete _threads[i];
+	}
+}
+
+TubeBuildService* TubeBuildService::install( osg::Node* sceneRoot, unsigned int numThreads )
+{
+	TubeBuildService* service = new TubeBuildService( numThreads );
+	sceneRoot->addUpdateCallback( service );
+	return service;
+}
+
+TubeBuildService::JobId TubeBuildService::submit( const std::vector<osg::Vec3>& trajectory, const Parameters& parameters,
+	osg::Group* parent, osg::Node* replaced )
+{
+	osg::ref_ptr<Job> job = new Job;
+	job->trajectory = trajectory;
+	job->parameters = parameters;
+	job->parent = parent;
+	job->replaced = replaced;
+	job->state = PENDING;
+
+	// A bounding box is enough to know which tubes are near the eye
+	osg::Vec3 boxMin( FLT_MAX, FLT_MAX, FLT_MAX );
+	osg::Vec3 boxMax( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for( size_t i = 0; i < trajectory.size(); i++ )
+	{
+		for( int k = 0; k < 3; k++ )
+		{
+			boxMin[k] = std::min( boxMin[k], trajectory[i][k] );
+			boxMax[k] = std::max( boxMax[k], trajectory[i][k] );
+		}
+	}
+	job->center = trajectory.empty() ? osg::Vec3() : ( boxMin + boxMax ) * 0.5f;
+	job->radius = trajectory.empty() ? 0.0f : ( boxMax - boxMin ).length() * 0.5f;
+
+	ScopedLock lock( _mutex );
+	job->id = _nextId++;
+	if( _nextId == INVALID_JOB )
+		_nextId++;
+	job->sequence = _nextSequence++;
+	_jobs[job->id] = job;
+	_pending.push_back( job );
+	_wakeCondition.signal();
+	return job->id;
+}
+
+bool TubeBuildService::cancel( JobId id )
+{
+	ScopedLock lock( _mutex );
+	std::map< JobId, osg::ref_ptr<Job> >::iterator itr = _jobs.find( id );
+	if( itr == _jobs.end() )
+		return false;
+
+	Job* job = itr->second.get();
+	if( job->state == PENDING )
+		_pending.erase( std::find( _pending.begin(), _pending.end(), job ) );
+	else if( job->state == READY )
+		_ready.erase( std::find( _ready.begin(), _ready.end(), job ) );
+
+	// A running job is dropped by its worker when the build is over
+	job->state = CANCELLED;
+	_jobs.erase( itr );
+	return true;
+}
+
+void TubeBuildService::cancelAll()
+{
+	ScopedLock lock( _mutex );
+	for( std::map< JobId, osg::ref_ptr<Job> >::iterator itr = _jobs.begin(); itr != _jobs.end(); ++itr )
+		itr->second->state = CANCELLED;
+	_jobs.clear();
+	_pending.clear();
+	_ready.clear();
+}
+
+bool TubeBuildService::setPriority( JobId id, int priority )
+{
+	ScopedLock lock( _mutex );
+	std::map< JobId, osg::ref_ptr<Job> >::iterator itr = _jobs.find( id );
+	if( itr == _jobs.end() || itr->second->state != PENDING )
+		return false;
+
+	itr->second->parameters.priority = priority;
+	return true;
+}
+
+unsigned int TubeBuildService::getNumPending() const
+{
+	ScopedLock lock( _mutex );
+	return _pending.size() + _running;
+}
+
+unsigned int TubeBuildService::getNumReady() const
+{
+	ScopedLock lock( _mutex );
+	return _ready.size();
+}
+
+osg::ref_ptr<TubeBuildService::Job> TubeBuildService::popBestJob()
+{
+	// The pending jobs are few compared to the work of a build, a scan is cheaper than keeping a heap
+	// ordered while the eye moves
+	size_t best = 0;
+	float bestDistance = 0.0f;
+	for( size_t i = 0; i < _pending.size(); i++ )
+	{
+		const Job* job = _pending[i].get();
+		float distance = _hasEye ? std::max( ( job->center - _eye ).length() - job->radius, 0.0f ) : 0.0f;
+		if( i > 0 )
+		{
+			const Job* bestJob = _pending[best].get();
+			if( job->parameters.priority < bestJob->parameters.priority )
+				continue;
+			if( job->parameters.priority == bestJob->parameters.priority &&
+				( distance > bestDistance || ( distance == bestDistance && job->sequence > bestJob->sequence ) ) )
+				continue;
+		}
+		best = i;
+		bestDistance = distance;
+	}
+
+	osg::ref_ptr<Job> job = _pending[best];
+	_pending.erase( _pending.begin() + best );
+	return job;
+}
+
+void TubeBuildService::workerLoop()
+{
+	for( ;; )
+	{
+		osg::ref_ptr<Job> job;
+		{
+			ScopedLock lock( _mutex );
+			while( _pending.empty() && !_quit )
+				_wakeCondition.wait( &_mutex );
+			if( _quit )
+				return;
+
+			job = popBestJob();
+			job->state = RUNNING;
+			_running++;
+		}
+
+		osg::ref_ptr<osg::Group> tube = build( job.get() );
+
+		ScopedLock lock( _mutex );
+		_running--;
+		if( job->state == CANCELLED || !tube.valid() )
+		{
+			_jobs.erase( job->id );
+			continue;
+		}
+		job->tube = tube;
+		job->state = READY;
+		_ready.push_back( job );
+	}
+}
+
+osg::Group* TubeBuildService::build( Job* job )
+{
+	const Parameters& parameters = job->parameters;
+	try
+	{
+		TubeGeometryBuilder builder;
+		builder.setBackend( parameters.backend );
+		builder.setTessellation( parameters.tessellation );
+		builder.setPatchVertices( parameters.patchVertices );
+		builder.setChunkPatches( parameters.chunkPatches );
+		builder.setCompactVertices( parameters.compactVertices );
+		builder.setFluxTable( parameters.fluxTable.get() );
+		builder.setTrajectory( job->trajectory, parameters.verticalScale, parameters.curveTolerance );
+
+		// The trajectory is not needed past the sections
+		std::vector<osg::Vec3>().swap( job->trajectory );
+
+		osg::ref_ptr<osg::Group> tube = new osg::Group;
+		builder.createTubeWithLOD( tube.get(), NULL, parameters.radius, parameters.minRadius, parameters.color,
+			parameters.fluxColor, parameters.fluxUp, parameters.fluxSpeed, parameters.fluxStep,
+			parameters.numRadialVertices, parameters.lineWidth );
+		return tube.release();
+	}
+	catch( const std::runtime_error& e )
+	{
+		osg::notify(osg::WARN) << "Tube build failed: " << e.what() << std::endl;
+		return NULL;
+	}
+}
+
+void TubeBuildService::operator()( osg::Node* node, osg::NodeVisitor* nv )
+{
+	osg::ref_ptr<osg::Camera> camera;
+	bool hasEye = _camera.lock( camera );
+	osg::Vec3 eye = hasEye ? osg::Vec3( camera->getInverseViewMatrix().getTrans() ) : osg::Vec3();
+
+	osg::Timer_t start = osg::Timer::instance()->tick();
+	for( ;; )
+	{
+		osg::ref_ptr<Job> job;
+		{
+			ScopedLock lock( _mutex );
+			_eye = eye;
+			_hasEye = hasEye;
+			if( _ready.empty() )
+				break;
+			job = _ready.front();
+			_ready.erase( _ready.begin() );
+			_jobs.erase( job->id );
+		}
+
+		// The scene graph is only changed here, in the update traversal
+		if( job->replaced.valid() && job->parent->containsNode( job->replaced.get() ) )
+			job->parent->replaceChild( job->replaced.get(), job->tube.get() );
+		else
+			job->parent->addChild( job->tube.get() );
+
+		if( osg::Timer::instance()->delta_m( start, osg::Timer::instance()->tick() ) >= _frameBudget )
+			break;
+	}
+
+	traverse( node, nv );
+}
@@ -0,0 +1,167 @@
+#ifndef _TUBE_BUILD_SERVICE_
+#define _TUBE_BUILD_SERVICE_
+
+#include <osg/Camera>
+#include <osg/Group>
+#include <osg/NodeCallback>
+#include <osg/observer_ptr>
+
+#include <OpenThreads/Condition>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/Thread>
+
+#include "TubeGeometryBuilder.h"
+
+#include <map>
+#include <vector>
+
+/*
+	Builds tubes on background threads and attaches them to the scene during the update traversal,
+	so loading thousands of trajectories does not stall the frames.
+
+	Jobs are taken by priority, and among equal priorities the one nearest to the eye of the camera
+	given to setCamera first. The sections, the arrays and the whole tube subgraph are made on a
+	worker thread, off the scene graph; the update callback only adds the finished groups to their
+	parents, as many as fit in the frame budget. The GL objects are created by the first draw.
+
+	The tubes are created without a camera, a TubeCameraUniforms above them must provide the view uniforms.
+*/
+class TubeBuildService : public osg::NodeCallback
+{
+public:
+	typedef unsigned int JobId;
+
+	//! Never returned by submit.
+	static const JobId INVALID_JOB = 0;
+
+	//! Builder settings and createTubeWithLOD arguments of a job.
+	struct Parameters
+	{
+		Parameters();
+
+		float verticalScale;
+		float curveTolerance;
+
+		float radius;
+		float minRadius;
+		osg::Vec4 color;
+		osg::Vec4 fluxColor;
+		bool fluxUp;
+		float fluxSpeed;
+		int fluxStep;
+		int numRadialVertices;
+		float lineWidth;
+
+		TubeGeometryBuilder::Backend backend;
+		TubeTessellation::Settings tessellation;
+		unsigned int patchVertices;
+		unsigned int chunkPatches;
+		bool compactVertices;
+		//! Table receiving the flux of the tubes, see TubeGeometryBuilder::setFluxTable, NULL for uniforms.
+		osg::ref_ptr<TubeStyleTable> fluxTable;
+
+		//! Jobs with a higher priority are built first.
+		int priority;
+	};
+
+	//! \numThreads worker threads, 0 means one per processor but the one running the viewer.
+	TubeBuildService( unsigned int numThreads = 0 );
+
+	//! Installs a new service as update callback of \sceneRoot.
+	static TubeBuildService* install( osg::Node* sceneRoot, unsigned int numThreads = 0 );
+
+	/*
+		Queues the build of a tube along \trajectory, which is copied. The tube group is added to \parent,
+		replacing \replaced if it is not NULL, in the update traversal that follows the build.
+	*/
+	JobId submit( const std::vector<osg::Vec3>& trajectory, const Parameters& parameters, osg::Group* parent,
+		osg::Node* replaced = NULL );
+
+	/*
+		Drops a job that was not attached yet. A job being built finishes on its worker, but its tube is
+		thrown away. Returns false if the job is unknown or already attached.
+	*/
+	bool cancel( JobId id );
+
+	void cancelAll();
+
+	//! Changes the priority of a job still waiting for a worker.
+	bool setPriority( JobId id, int priority );
+
+	//! Camera whose eye orders the jobs of equal priority, NULL keeps the submission order.
+	void setCamera( osg::Camera* camera ) { _camera = camera; }
+
+	/*
+		Time in milliseconds the update traversal may spend attaching finished tubes. At least one tube
+		is attached per frame, so a small budget slows the swap-in down but never stops it.
+	*/
+	void setFrameBudget( double milliseconds ) { _frameBudget = milliseconds; }
+
+	//! Jobs waiting for a worker or being built.
+	unsigned int getNumPending() const;
+
+	//! Jobs built and waiting to be attached.
+	unsigned int getNumReady() const;
+
+	//! Attaches the finished tubes, then goes on with the traversal.
+	virtual void operator()( osg::Node* node, osg::NodeVisitor* nv );
+
+protected:
+	//! Cancels every job and waits for the workers.
+	virtual ~TubeBuildService();
+
+private:
+	class WorkerThread;
+
+	enum JobState
+	{
+		PENDING,
+		RUNNING,
+		READY,
+		CANCELLED
+	};
+
+	struct Job : public osg::Referenced
+	{
+		JobId id;
+		std::vector<osg::Vec3> trajectory;
+		Parameters parameters;
+		osg::ref_ptr<osg::Group> parent;
+		osg::ref_ptr<osg::Node> replaced;
+		//! Bounding sphere of the trajectory, orders the jobs by distance to the eye.
+		osg::Vec3 center;
+		float radius;
+		//! Submission order, breaks the remaining ties.
+		unsigned int sequence;
+		JobState state;
+		osg::ref_ptr<osg::Group> tube;
+	};
+
+	//! Takes the pending job to build next, the mutex must be locked.
+	osg::ref_ptr<Job> popBestJob();
+
+	void workerLoop();
+
+	static osg::Group* build( Job* job );
+
+	std::vector<WorkerThread*> _threads;
+
+	mutable OpenThreads::Mutex _mutex;
+	OpenThreads::Condition _wakeCondition;
+	bool _quit;
+
+	std::map< JobId, osg::ref_ptr<Job> > _jobs;
+	std::vector< osg::ref_ptr<Job> > _pending;
+	std::vector< osg::ref_ptr<Job> > _ready;
+	unsigned int _running;
+	JobId _nextId;
+	unsigned int _nextSequence;
+
+	osg::observer_ptr<osg::Camera> _camera;
+	//! Eye of the camera in the last update traversal.
+	osg::Vec3 _eye;
+	bool _hasEye;
+	double _frameBudget;
+};
+
+#endif
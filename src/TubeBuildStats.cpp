@@ -0,0 +1,99 @@
+#include "TubeBuildStats.h"
+
+#include "TubeGeometryBuilder.h"
+
+void TubeBuildStats::reset()
+{
+	inputPoints = 0;
+	sections = 0;
+	vertices = 0;
+	patches = 0;
+	indices = 0;
+	repeatedIndices = 0;
+	positionBytes = 0;
+	normalBytes = 0;
+	binormalBytes = 0;
+	distanceBytes = 0;
+	indexBytes = 0;
+	frameTime = 0.0;
+	packTime = 0.0;
+}
+
+void TubeBuildStats::add( const TubeBuildStats& other )
+{
+	inputPoints += other.inputPoints;
+	sections += other.sections;
+	vertices += other.vertices;
+	patches += other.patches;
+	indices += other.indices;
+	repeatedIndices += other.repeatedIndices;
+	positionBytes += other.positionBytes;
+	normalBytes += other.normalBytes;
+	binormalBytes += other.binormalBytes;
+	distanceBytes += other.distanceBytes;
+	indexBytes += other.indexBytes;
+	frameTime += other.frameTime;
+	packTime += other.packTime;
+}
+
+// Bytes used by the elements of an array, which may be NULL
+static size_t arrayBytes( const osg::Array* array )
+{
+	return array ? array->getTotalDataSize() : 0;
+}
+
+void TubeBuildStats::countGeometry( osg::Geometry* geometry, unsigned int patchVertices, unsigned int numSections )
+{
+	vertices = geometry->getVertexArray() ? geometry->getVertexArray()->getNumElements() : 0;
+	positionBytes = arrayBytes( geometry->getVertexArray() );
+	// The compact frame of TubeVertexCodec is counted as normals
+	normalBytes = arrayBytes( geometry->getVertexAttribArray( 2 ) ) + arrayBytes( geometry->getVertexAttribArray( 4 ) );
+	binormalBytes = arrayBytes( geometry->getVertexAttribArray( 3 ) );
+	distanceBytes = arrayBytes( geometry->getVertexAttribArray( 6 ) );
+
+	patches = 0;
+	indices = 0;
+	repeatedIndices = 0;
+	indexBytes = 0;
+	osg::DrawElements* elements = geometry->getNumPrimitiveSets() > 0 ?
+		dynamic_cast<osg::DrawElements*>( geometry->getPrimitiveSet( 0 ) ) : NULL;
+	if( !elements )
+		return;
+
+	indices = elements->getNumIndices();
+	indexBytes = elements->getTotalDataSize();
+	if( elements->getMode() == osg::PrimitiveSet::PATCHES && patchVertices > 0 )
+	{
+		patches = indices / patchVertices;
+		repeatedIndices = indices > numSections ? indices - numSections : 0;
+	}
+}
+
+void TubeBuildStats::publish( osg::Stats* stats, unsigned int frameNumber, const std::string& prefix ) const
+{
+	stats->setAttribute( frameNumber, prefix + "Tube input points", inputPoints );
+	stats->setAttribute( frameNumber, prefix + "Tube sections", sections );
+	stats->setAttribute( frameNumber, prefix + "Tube culled points", inputPoints > sections ? inputPoints - sections : 0 );
+	stats->setAttribute( frameNumber, prefix + "Tube vertices", vertices );
+	stats->setAttribute( frameNumber, prefix + "Tube patches", patches );
+	stats->setAttribute( frameNumber, prefix + "Tube indices", indices );
+	stats->setAttribute( frameNumber, prefix + "Tube repeated indices", repeatedIndices );
+	stats->setAttribute( frameNumber, prefix + "Tube position bytes", static_cast<double>( positionBytes ) );
+	stats->setAttribute( frameNumber, prefix + "Tube normal bytes", static_cast<double>( normalBytes ) );
+	stats->setAttribute( frameNumber, prefix + "Tube binormal bytes", static_cast<double>( binormalBytes ) );
+	stats->setAttribute( frameNumber, prefix + "Tube distance bytes", static_cast<double>( distanceBytes ) );
+	stats->setAttribute( frameNumber, prefix + "Tube index bytes", static_cast<double>( indexBytes ) );
+	stats->setAttribute( frameNumber, prefix + "Tube frame time", frameTime );
+	stats->setAttribute( frameNumber, prefix + "Tube pack time", packTime );
+}
+
+void TubeStatsPublisher::operator()( osg::Node* node, osg::NodeVisitor* nv )
+{
+	if( _stats.valid() && nv->getFrameStamp() )
+	{
+		unsigned int frameNumber = nv->getFrameStamp()->getFrameNumber();
+		_builder->getLastBuildStats().publish( _stats.get(), frameNumber );
+		_builder->getTotalBuildStats().publish( _stats.get(), frameNumber, "Total " );
+	}
+	traverse( node, nv );
+}
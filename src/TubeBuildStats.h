@@ -0,0 +1,74 @@
+#ifndef _TUBE_BUILD_STATS_
+#define _TUBE_BUILD_STATS_
+
+#include <osg/Geometry>
+#include <osg/NodeCallback>
+#include <osg/Stats>
+
+#include <stddef.h>
+
+class TubeGeometryBuilder;
+
+/*
+	Counters of the tube builds of a TubeGeometryBuilder. The builder keeps the ones of the last build,
+	from setTrajectory to the geometries made from it, and the sum of every build since it was created
+	or reset. appendTrajectory counts as a build whose geometry counters describe the whole grown tube,
+	and only its points, sections and times are added to the sum.
+*/
+struct TubeBuildStats
+{
+	TubeBuildStats() { reset(); }
+
+	void reset();
+
+	//! Adds the counters of \other, used for the cumulative stats.
+	void add( const TubeBuildStats& other );
+
+	//! Fills the vertex, index and byte counters from the geometry of a tube of \numSections sections.
+	void countGeometry( osg::Geometry* geometry, unsigned int patchVertices, unsigned int numSections );
+
+	//! Points given to setTrajectory or appendTrajectory.
+	unsigned int inputPoints;
+	//! Sections kept by the frame propagation, the rest of the points were culled.
+	unsigned int sections;
+	unsigned int vertices;
+	//! Patches of the tessellation backend, 0 for the CPU mesh.
+	unsigned int patches;
+	unsigned int indices;
+	//! Indices repeating a section: the boundaries shared by consecutive patches and the tail padding.
+	unsigned int repeatedIndices;
+
+	size_t positionBytes;
+	size_t normalBytes;
+	size_t binormalBytes;
+	size_t distanceBytes;
+	size_t indexBytes;
+
+	//! Milliseconds spent propagating frames and packing the vertex arrays.
+	double frameTime;
+	double packTime;
+
+	/*
+		Sets the counters as attributes of \stats for \frameNumber, named "Tube " followed by the counter,
+		e.g. "Tube sections". \prefix goes before them, to tell several builders apart.
+	*/
+	void publish( osg::Stats* stats, unsigned int frameNumber, const std::string& prefix = std::string() ) const;
+};
+
+/*
+	Update callback publishing the stats of a builder into \stats every frame, typically the viewer stats,
+	so they can be shown by osgViewer::StatsHandler user lines. The builder must outlive the callback.
+*/
+class TubeStatsPublisher : public osg::NodeCallback
+{
+public:
+	TubeStatsPublisher( const TubeGeometryBuilder* builder, osg::Stats* stats ) : _builder( builder ), _stats( stats ) {}
+
+	virtual void operator()( osg::Node* node, osg::NodeVisitor* nv );
+
+private:
+	const TubeGeometryBuilder* _builder;
+	osg::ref_ptr<osg::Stats> _stats;
+};
+
+#endif
@@ -0,0 +1,361 @@
+#include "TubeBundleBuilder.h"
+
+#include <osg/LOD>
+#include <osg/Notify>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <map>
+
+// Points at equal distances along the polyline of \sections, the first and last sections included
+static void resample( const std::vector<TubeSection>& sections, unsigned int numPoints, osg::Vec3* points )
+{
+	float length = 0.0f;
+	for( size_t i = 1; i < sections.size(); i++ )
+		length += ( sections[i].position - sections[i - 1].position ).length();
+
+	if( sections.size() < 2 || length <= 0.0f )
+	{
+		std::fill( points, points + numPoints, sections.empty() ? osg::Vec3() : sections[0].position );
+		return;
+	}
+
+	size_t segment = 1;
+	float segmentStart = 0.0f;
+	for( unsigned int k = 0; k < numPoints; k++ )
+	{
+		float target = length * k / ( numPoints - 1 );
+		float segmentLength = ( sections[segment].position - sections[segment - 1].position ).length();
+		while( segment + 1 < sections.size() && segmentStart + segmentLength < target )
+		{
+			segmentStart += segmentLength;
+			segment++;
+			segmentLength = ( sections[segment].position - sections[segment - 1].position ).length();
+		}
+		float t = segmentLength > 0.0f ? std::min( ( target - segmentStart ) / segmentLength, 1.0f ) : 1.0f;
+		points[k] = sections[segment - 1].position * ( 1.0f - t ) + sections[segment].position * t;
+	}
+}
+
+// Mean of \numPoints points
+static osg::Vec3 meanPoint( const osg::Vec3* points, unsigned int numPoints )
+{
+	osg::Vec3 sum;
+	for( unsigned int k = 0; k < numPoints; k++ )
+		sum += points[k];
+	return sum / static_cast<float>( numPoints );
+}
+
+// Grid of the cluster means, only the clusters of the cells around a tube can be closer than a cell size
+class CenterGrid
+{
+public:
+	CenterGrid( float cellSize ) : _cellSize( cellSize ) {}
+
+	long long getCell( const osg::Vec3& center ) const { return getCell( center, 0, 0, 0 ); }
+
+	// Cell of \center moved by \dx, \dy, \dz cells, the coordinates wrap around, which only adds candidates
+	long long getCell( const osg::Vec3& center, int dx, int dy, int dz ) const
+	{
+		long long cell = 0;
+		int offsets[3] = { dx, dy, dz };
+		for( int k = 0; k < 3; k++ )
+		{
+			double index = std::min( std::max( floor( center[k] / _cellSize ), -1e9 ), 1e9 );
+			cell = ( cell << 21 ) | ( ( static_cast<long long>( index ) + offsets[k] ) & 0x1FFFFF );
+		}
+		return cell;
+	}
+
+	void insert( long long cell, unsigned int cluster ) { _cells[cell].push_back( cluster ); }
+
+	void remove( long long cell, unsigned int cluster )
+	{
+		std::vector<unsigned int>& clusters = _cells[cell];
+		std::vector<unsigned int>::iterator it = std::find( clusters.begin(), clusters.end(), cluster );
+		if( it != clusters.end() )
+		{
+			*it = clusters.back();
+			clusters.pop_back();
+		}
+	}
+
+	const std::vector<unsigned int>* find( long long cell ) const
+	{
+		std::map< long long, std::vector<unsigned int> >::const_iterator it = _cells.find( cell );
+		return it != _cells.end() ? &it->second : NULL;
+	}
+
+private:
+	float _cellSize;
+	std::map< long long, std::vector<unsigned int> > _cells;
+};
+
+TubeBundleBuilder::TubeBundleBuilder() :
+	_clustered( false ), _samplePoints( 16 ), _switchPixels( 4.0f ), _proxyRadiusScale( 1.0f ), _patchVertices( 0 )
+{
+}
+
+unsigned int TubeBundleBuilder::addTube( const TubeGeometryBuilder& builder, const TubeStyle& style )
+{
+	return addTube( builder.getSections(), style );
+}
+
+unsigned int TubeBundleBuilder::addTube( const std::vector<TubeSection>& sections, const TubeStyle& style )
+{
+	unsigned int tubeId = _styles.size();
+	_tubes.addTube( sections, style );
+	_styles.push_back( style );
+	_samples.resize( _samples.size() + _samplePoints );
+	resample( sections, _samplePoints, &_samples[tubeId * _samplePoints] );
+	for( size_t i = 0; i < sections.size(); i++ )
+		_box.expandBy( sections[i].position );
+	_clustered = false;
+	return tubeId;
+}
+
+void TubeBundleBuilder::setSamplePoints( unsigned int samplePoints )
+{
+	if( !_styles.empty() )
+	{
+		osg::notify(osg::WARN) << "TubeBundleBuilder::setSamplePoints must be called before adding tubes." << std::endl;
+		return;
+	}
+	_samplePoints = std::max( samplePoints, 2u );
+}
+
+float TubeBundleBuilder::distance( const osg::Vec3* a, const osg::Vec3* b, bool& flipped ) const
+{
+	float direct = 0.0f;
+	float reversed = 0.0f;
+	for( unsigned int k = 0; k < _samplePoints; k++ )
+	{
+		direct += ( a[k] - b[k] ).length();
+		reversed += ( a[k] - b[_samplePoints - 1 - k] ).length();
+	}
+	flipped = reversed < direct;
+	return std::min( direct, reversed ) / _samplePoints;
+}
+
+void TubeBundleBuilder::clusterItems( const std::vector<osg::Vec3>& itemPoints, const std::vector<unsigned int>& itemWeights,
+	float threshold, std::vector<unsigned int>& itemCluster, std::vector<osg::Vec3>& centroids,
+	std::vector<unsigned int>& weights ) const
+{
+	const unsigned int numPoints = _samplePoints;
+	const unsigned int numItems = itemWeights.size();
+	itemCluster.resize( numItems );
+	centroids.clear();
+	weights.clear();
+
+	// Weighted sums of the points, the centroids are the sums over the weights
+	std::vector<osg::Vec3> sums;
+	std::vector<osg::Vec3> centers;
+	std::vector<long long> centerCells;
+	CenterGrid grid( threshold );
+	for( unsigned int i = 0; i < numItems; i++ )
+	{
+		const osg::Vec3* points = &itemPoints[i * numPoints];
+		float weight = static_cast<float>( itemWeights[i] );
+		osg::Vec3 center = meanPoint( points, numPoints );
+
+		// The distance between the means is a lower bound of the distance, it skips the far clusters
+		unsigned int best = weights.size();
+		float bestDistance = threshold;
+		bool bestFlipped = false;
+		for( int cell = 0; cell < 27; cell++ )
+		{
+			const std::vector<unsigned int>* clusters = grid.find( grid.getCell( center, cell % 3 - 1, cell / 3 % 3 - 1, cell / 9 - 1 ) );
+			for( size_t j = 0; clusters && j < clusters->size(); j++ )
+			{
+				unsigned int c = ( *clusters )[j];
+				if( ( center - centers[c] ).length() >= bestDistance )
+					continue;
+				bool flipped;
+				float d = distance( points, &centroids[c * numPoints], flipped );
+				if( d < bestDistance || ( d == bestDistance && c < best ) )
+				{
+					best = c;
+					bestDistance = d;
+					bestFlipped = flipped;
+				}
+			}
+		}
+
+		if( best == weights.size() )
+		{
+			for( unsigned int k = 0; k < numPoints; k++ )
+			{
+				sums.push_back( points[k] * weight );
+				centroids.push_back( points[k] );
+			}
+			centers.push_back( center );
+			centerCells.push_back( grid.getCell( center ) );
+			grid.insert( centerCells.back(), best );
+			weights.push_back( itemWeights[i] );
+		}
+		else
+		{
+			weights[best] += itemWeights[i];
+			float total = static_cast<float>( weights[best] );
+			for( unsigned int k = 0; k < numPoints; k++ )
+			{
+				osg::Vec3& sum = sums[best * numPoints + k];
+				sum += points[bestFlipped ? numPoints - 1 - k : k] * weight;
+				centroids[best * numPoints + k] = sum / total;
+			}
+			centers[best] = meanPoint( &centroids[best * numPoints], numPoints );
+
+			long long cell = grid.getCell( centers[best] );
+			if( cell != centerCells[best] )
+			{
+				grid.remove( centerCells[best], best );
+				grid.insert( cell, best );
+				centerCells[best] = cell;
+			}
+		}
+		itemCluster[i] = best;
+	}
+}
+
+void TubeBundleBuilder::cluster()
+{
+	_levels.clear();
+	_levelThresholds.clear();
+	_clustered = true;
+	if( _styles.empty() )
+		return;
+
+	std::vector<float> thresholds;
+	for( size_t i = 0; i < _thresholds.size(); i++ )
+	{
+		if( _thresholds[i] > 0.0f )
+			thresholds.push_back( _thresholds[i] );
+	}
+	if( thresholds.empty() )
+	{
+		float diagonal = ( _box._max - _box._min ).length();
+		thresholds.push_back( diagonal / 64.0f );
+		thresholds.push_back( diagonal / 16.0f );
+	}
+	std::sort( thresholds.begin(), thresholds.end() );
+
+	// Each level clusters the centroids of the finer one, weighted by their tubes
+	const unsigned int numPoints = _samplePoints;
+	const unsigned int numTubes = _styles.size();
+	std::vector<osg::Vec3> itemPoints( _samples );
+	std::vector<unsigned int> itemWeights( numTubes, 1 );
+	std::vector<unsigned int> tubeItem( numTubes );
+	for( unsigned int t = 0; t < numTubes; t++ )
+		tubeItem[t] = t;
+
+	std::vector<unsigned int> itemCluster;
+	std::vector<osg::Vec3> centroids;
+	std::vector<unsigned int> weights;
+	for( size_t level = 0; level < thresholds.size(); level++ )
+	{
+		clusterItems( itemPoints, itemWeights, thresholds[level], itemCluster, centroids, weights );
+
+		_levels.push_back( std::vector<Cluster>( weights.size() ) );
+		std::vector<Cluster>& clusters = _levels.back();
+		for( unsigned int c = 0; c < clusters.size(); c++ )
+			clusters[c].centroid.assign( centroids.begin() + c * numPoints, centroids.begin() + ( c + 1 ) * numPoints );
+		for( unsigned int t = 0; t < numTubes; t++ )
+		{
+			tubeItem[t] = itemCluster[tubeItem[t]];
+			clusters[tubeItem[t]].tubes.push_back( t );
+		}
+
+		for( unsigned int c = 0; c < clusters.size(); c++ )
+		{
+			Cluster& cluster = clusters[c];
+			float spread = 0.0f;
+			float radius = 0.0f;
+			osg::Vec4 color;
+			osg::Vec4 fluxColor;
+			for( size_t i = 0; i < cluster.tubes.size(); i++ )
+			{
+				unsigned int t = cluster.tubes[i];
+				bool flipped;
+				spread += distance( &_samples[t * numPoints], &cluster.centroid[0], flipped );
+				radius += _styles[t].radius;
+				color += _styles[t].color;
+				fluxColor += _styles[t].fluxColor;
+			}
+			float count = static_cast<float>( cluster.tubes.size() );
+			cluster.spread = spread / count;
+
+			// The flux of the first tube, the mean colors, and thick enough to cover the tubes
+			cluster.style = _styles[cluster.tubes[0]];
+			cluster.style.radius = radius / count + _proxyRadiusScale * cluster.spread;
+			cluster.style.color = color / count;
+			cluster.style.fluxColor = fluxColor / count;
+		}
+
+		itemPoints.swap( centroids );
+		itemWeights.swap( weights );
+	}
+	_levelThresholds = thresholds;
+}
+
+void TubeBundleBuilder::createBundle( osg::Group* bundleGroup, osg::Camera* cam )
+{
+	if( !_clustered )
+		cluster();
+
+	bundleGroup->removeChildren( 0, bundleGroup->getNumChildren() );
+	osg::LOD* lod = new osg::LOD;
+	lod->setRangeMode( osg::LOD::PIXEL_SIZE_ON_SCREEN );
+
+	osg::Group* tubes = new osg::Group;
+	_tubes.setTessellation( _tessellation );
+	_tubes.setPatchVertices( _patchVertices );
+	_tubes.createBatch( tubes, cam );
+	lod->addChild( tubes );
+
+	// The proxies are tubes along the centroids
+	for( unsigned int level = 0; level < _levels.size(); level++ )
+	{
+		const std::vector<Cluster>& clusters = _levels[level];
+		std::vector< std::vector<osg::Vec3> > trajectories( clusters.size() );
+		for( unsigned int c = 0; c < clusters.size(); c++ )
+			trajectories[c] = clusters[c].centroid;
+		std::vector< std::vector<TubeSection> > sections;
+		TubeGeometryBuilder::buildSectionsBulk( trajectories, sections );
+
+		TubeBatchBuilder proxies;
+		proxies.setTessellation( _tessellation );
+		proxies.setPatchVertices( _patchVertices );
+		for( unsigned int c = 0; c < clusters.size(); c++ )
+		{
+			if( sections[c].size() >= 2 )
+				proxies.addTube( sections[c], clusters[c].style );
+		}
+		osg::Group* proxyGroup = new osg::Group;
+		proxies.createBatch( proxyGroup, cam );
+		lod->addChild( proxyGroup );
+	}
+
+	// A level is drawn once its threshold is smaller than the switch pixels, which is as many times
+	// smaller than the pixel size of the bound as the threshold is smaller than the bound radius
+	float boundRadius = lod->getBound().radius();
+	float maxPixels = FLT_MAX;
+	for( unsigned int level = 0; level <= _levels.size(); level++ )
+	{
+		float minPixels = level < _levels.size() ? _switchPixels * boundRadius / _levelThresholds[level] : 0.0f;
+		lod->setRange( level, minPixels, maxPixels );
+		maxPixels = minPixels;
+	}
+	bundleGroup->addChild( lod );
+}
+
+void TubeBundleBuilder::clear()
+{
+	_tubes.clear();
+	_samples.clear();
+	_styles.clear();
+	_box.init();
+	_levels.clear();
+	_levelThresholds.clear();
+	_clustered = false;
+}
@@ -0,0 +1,132 @@
+#ifndef _TUBE_BUNDLE_BUILDER_
+#define _TUBE_BUNDLE_BUILDER_
+
+#include <osg/Group>
+#include <osg/Vec3>
+
+#include "TubeBatchBuilder.h"
+#include "TubeGeometryBuilder.h"
+#include "TubeStyleTable.h"
+#include "TubeTessellation.h"
+
+#include <vector>
+
+/*
+	Draws a bundle of many tubes, e.g. the streamlines of a fiber tract, with a cost that depends on
+	its size on screen rather than on the number of tubes. The tubes are clustered at a few distance
+	thresholds, and each cluster is drawn as a single proxy tube along the mean of its tubes, thick
+	enough to cover them. An osg::LOD in PIXEL_SIZE_ON_SCREEN mode draws every tube up close, and the
+	proxies of a level once its threshold is smaller than getSwitchPixels pixels on screen.
+
+	The clustering is QuickBundles: the tubes are resampled to the same number of points, a tube joins
+	the closest cluster whose mean is closer than the threshold, or starts a new one. The distance is
+	the mean distance between the matching points, in the direction or reversed, whichever is smaller,
+	so tubes along the same path in opposite directions are bundled. Each level clusters the means of
+	the finer one, so the levels are nested.
+
+	Every level, the tubes included, is drawn by a TubeBatchBuilder: one draw call and one style table
+	per level.
+*/
+class TubeBundleBuilder
+{
+public:
+	//! Tubes of a level drawn as a single proxy.
+	struct Cluster
+	{
+		Cluster() : spread( 0.0f ) {}
+
+		//! Mean of the resampled tubes, oriented like the first one.
+		std::vector<osg::Vec3> centroid;
+		//! Ids of the tubes, as returned by addTube.
+		std::vector<unsigned int> tubes;
+		//! Mean distance of the tubes to the centroid.
+		float spread;
+		//! Style of the proxy: the mean colors and radius of the tubes, the radius grown by the spread.
+		TubeStyle style;
+	};
+
+	TubeBundleBuilder();
+
+	//! Adds the sections of the last trajectory set on \builder, returns the id of the tube.
+	unsigned int addTube( const TubeGeometryBuilder& builder, const TubeStyle& style );
+
+	unsigned int addTube( const std::vector<TubeSection>& sections, const TubeStyle& style );
+
+	unsigned int getNumTubes() const { return _styles.size(); }
+
+	/*
+		Distance thresholds of the levels of proxies, in the units of the sections, sorted from the finest.
+		Empty, the default, uses 1/64 and 1/16 of the diagonal of the bundle.
+	*/
+	void setThresholds( const std::vector<float>& thresholds ) { _thresholds = thresholds; _clustered = false; }
+
+	const std::vector<float>& getThresholds() const { return _thresholds; }
+
+	//! Points each tube is resampled to for the clustering, and of the proxy tubes. Default 16, set before adding tubes.
+	void setSamplePoints( unsigned int samplePoints );
+
+	unsigned int getSamplePoints() const { return _samplePoints; }
+
+	//! Size in pixels under which a threshold switches to its level. Default 4.
+	void setSwitchPixels( float pixels ) { _switchPixels = pixels; }
+
+	float getSwitchPixels() const { return _switchPixels; }
+
+	//! Part of the spread of a cluster added to the radius of its proxy. Default 1.
+	void setProxyRadiusScale( float scale ) { _proxyRadiusScale = scale; _clustered = false; }
+
+	//! Tessellation and patch size of every level, see TubeBatchBuilder.
+	void setTessellation( const TubeTessellation::Settings& settings ) { _tessellation = settings; }
+
+	void setPatchVertices( unsigned int patchVertices ) { _patchVertices = patchVertices; }
+
+	//! Clusters the tubes added so far at every threshold. createBundle calls it when needed.
+	void cluster();
+
+	unsigned int getNumLevels() const { return _levels.size(); }
+
+	//! Clusters of \level, from the finest.
+	const std::vector<Cluster>& getClusters( unsigned int level ) const { return _levels[level]; }
+
+	//! Threshold \level was clustered with, the default ones included.
+	float getLevelThreshold( unsigned int level ) const { return _levelThresholds[level]; }
+
+	/*
+		Creates under \bundleGroup the LOD drawing the tubes added so far and their proxies. \cam may be
+		NULL when a TubeCameraUniforms above the bundle provides the view uniforms.
+	*/
+	void createBundle( osg::Group* bundleGroup, osg::Camera* cam );
+
+	//! Starts a new bundle, previously created bundles are not affected.
+	void clear();
+
+private:
+	/*
+		Clusters the items whose resampled points are \itemPoints and whose numbers of tubes are \itemWeights.
+		\itemCluster receives the cluster of every item, \centroids and \weights the ones of the clusters.
+	*/
+	void clusterItems( const std::vector<osg::Vec3>& itemPoints, const std::vector<unsigned int>& itemWeights,
+		float threshold, std::vector<unsigned int>& itemCluster, std::vector<osg::Vec3>& centroids,
+		std::vector<unsigned int>& weights ) const;
+
+	//! Mean distance between the points of two resampled tubes, \flipped tells if reversed was closer.
+	float distance( const osg::Vec3* a, const osg::Vec3* b, bool& flipped ) const;
+
+	TubeBatchBuilder _tubes;
+	//! Resampled points of every tube, _samplePoints per tube.
+	std::vector<osg::Vec3> _samples;
+	std::vector<TubeStyle> _styles;
+	osg::BoundingBox _box;
+
+	std::vector<float> _thresholds;
+	std::vector< std::vector<Cluster> > _levels;
+	std::vector<float> _levelThresholds;
+	bool _clustered;
+	unsigned int _samplePoints;
+	float _switchPixels;
+	float _proxyRadiusScale;
+	TubeTessellation::Settings _tessellation;
+	unsigned int _patchVertices;
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include "TubeCameraUniforms.h"
+
+#include <osg/Viewport>
+#include <osgUtil/CullVisitor>
+
+#include <OpenThreads/ScopedLock>
+
+TubeCameraUniforms::TubeCameraUniforms()
+{
+}
+
+TubeCameraUniforms* TubeCameraUniforms::install( osg::Node* sceneRoot )
+{
+	TubeCameraUniforms* uniforms = new TubeCameraUniforms;
+	sceneRoot->setCullCallback( uniforms );
+	return uniforms;
+}
+
+void TubeCameraUniforms::operator()( osg::Node* node, osg::NodeVisitor* nv )
+{
+	osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>( nv );
+	if( !cv )
+	{
+		traverse( node, nv );
+		return;
+	}
+
+	cv->pushStateSet( getStateSet( cv ) );
+	traverse( node, nv );
+	cv->popStateSet();
+}
+
+osg::StateSet* TubeCameraUniforms::getStateSet( osgUtil::CullVisitor* cv )
+{
+	// Cameras may be culled in parallel, each one only touches its own entry after the lookup
+	CameraUniforms* camera;
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+		camera = &_cameras[cv];
+		if( !camera->stateSet.valid() )
+		{
+			camera->stateSet = new osg::StateSet;
+			// Changed during the cull, the draw of the previous frame must be over before
+			camera->stateSet->setDataVariance( osg::Object::DYNAMIC );
+			camera->mvpInverse = new osg::Uniform( "MVPinverse", osg::Matrixf() );
+			camera->screenWidth = new osg::Uniform( "screenWidth", 10000.0f );
+			camera->stateSet->addUniform( camera->mvpInverse.get() );
+			camera->stateSet->addUniform( camera->screenWidth.get() );
+		}
+	}
+
+	unsigned int frameNumber = cv->getFrameStamp() ? cv->getFrameStamp()->getFrameNumber() : 0;
+	if( camera->frameNumber != frameNumber )
+	{
+		camera->frameNumber = frameNumber;
+
+		// The tubes have no model transform of their own, as with MVPInverseCallback
+		osg::Matrixd modelViewProjection = ( *cv->getModelViewMatrix() ) * ( *cv->getProjectionMatrix() );
+		camera->mvpInverse->set( osg::Matrixf( osg::Matrixd::inverse( modelViewProjection ) ) );
+
+		const osg::Viewport* viewport = cv->getViewport();
+		if( viewport )
+			camera->screenWidth->set( static_cast<float>( viewport->width() ) );
+	}
+
+	return camera->stateSet.get();
+}
@@ -0,0 +1,53 @@
+#ifndef _TUBE_CAMERA_UNIFORMS_
+#define _TUBE_CAMERA_UNIFORMS_
+
+#include <osg/NodeCallback>
+#include <osg/StateSet>
+#include <osg/Uniform>
+
+#include <OpenThreads/Mutex>
+
+#include <map>
+
+namespace osgUtil {
+class CullVisitor;
+}
+
+/*
+	Provides the view dependent uniforms of the tube shaders, MVPinverse and screenWidth, for every
+	tube below the node it is installed on. It replaces the per tube MVPInverseCallback and
+	ScreenCallback: the matrix is inverted once per frame and per camera instead of once per tube.
+
+	It works as a cull callback that pushes a StateSet holding the uniforms of the camera being culled,
+	so each view of a CompositeViewer, and each eye in stereo, gets its own values. Tubes must then
+	be created with a NULL camera.
+*/
+class TubeCameraUniforms : public osg::NodeCallback
+{
+public:
+	TubeCameraUniforms();
+
+	//! Installs a new provider as cull callback of \sceneRoot.
+	static TubeCameraUniforms* install( osg::Node* sceneRoot );
+
+	virtual void operator()( osg::Node* node, osg::NodeVisitor* nv );
+
+private:
+	struct CameraUniforms
+	{
+		CameraUniforms() : frameNumber( ~0u ) {}
+
+		osg::ref_ptr<osg::StateSet> stateSet;
+		osg::ref_ptr<osg::Uniform> mvpInverse;
+		osg::ref_ptr<osg::Uniform> screenWidth;
+		unsigned int frameNumber;
+	};
+
+	osg::StateSet* getStateSet( osgUtil::CullVisitor* cv );
+
+	// Keyed by cull visitor, there is one per camera and per eye
+	std::map<const osgUtil::CullVisitor*, CameraUniforms> _cameras;
+	OpenThreads::Mutex _mutex;
+};
+
+#endif
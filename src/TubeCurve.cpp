@@ -0,0 +1,122 @@
+#include "TubeCurve.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Frame tangent of \section pointing the way of \chord, the frame does not tell the direction of the tube
+osg::Vec3 orientedTangent( const TubeSection& section, const osg::Vec3& chord )
+{
+	osg::Vec3 tangent = section.normal ^ section.binormal;
+	tangent.normalize();
+	return tangent * chord < 0.0f ? -tangent : tangent;
+}
+
+// Distance from \p to the segment from \a to \b
+float distanceToSegment( const osg::Vec3& p, const osg::Vec3& a, const osg::Vec3& b )
+{
+	osg::Vec3 ab = b - a;
+	osg::Vec3 ap = p - a;
+	float length2 = ab.length2();
+	if( length2 == 0.0f )
+		return ap.length();
+
+	float t = std::min( std::max( ( ap * ab ) / length2, 0.0f ), 1.0f );
+	return ( ap - ab * t ).length();
+}
+
+}
+
+TubeSection TubeCurve::evaluate( const TubeSection& a, const TubeSection& b, float t )
+{
+	osg::Vec3 chord = b.position - a.position;
+	float length = chord.length();
+	osg::Vec3 m0 = orientedTangent( a, chord ) * length;
+	osg::Vec3 m1 = orientedTangent( b, chord ) * length;
+
+	float t2 = t * t;
+	float t3 = t2 * t;
+	TubeSection section;
+	section.position = a.position * ( 2.0f * t3 - 3.0f * t2 + 1.0f ) + m0 * ( t3 - 2.0f * t2 + t ) +
+		b.position * ( -2.0f * t3 + 3.0f * t2 ) + m1 * ( t3 - t2 );
+	osg::Vec3 derivative = a.position * ( 6.0f * t2 - 6.0f * t ) + m0 * ( 3.0f * t2 - 4.0f * t + 1.0f ) +
+		b.position * ( -6.0f * t2 + 6.0f * t ) + m1 * ( 3.0f * t2 - 2.0f * t );
+
+	// Gram-Schmidt from the tangent, which a degenerated segment does not have
+	osg::Vec3 normal = a.normal * ( 1.0f - t ) + b.normal * t;
+	osg::Vec3 binormal = a.binormal * ( 1.0f - t ) + b.binormal * t;
+	float derivativeLength = derivative.length();
+	if( derivativeLength > 1e-6f )
+	{
+		osg::Vec3 tangent = derivative / derivativeLength;
+		normal -= tangent * ( normal * tangent );
+		binormal -= tangent * ( binormal * tangent );
+	}
+	normal.normalize();
+	binormal -= normal * ( binormal * normal );
+	binormal.normalize();
+
+	section.normal = normal;
+	section.binormal = binormal;
+	return section;
+}
+
+TubeSection TubeCurve::evaluatePatch( const TubeSection* sections, unsigned int numSections, float v,
+	const float* distances, float* distance )
+{
+	if( numSections < 2 )
+	{
+		if( distances && distance )
+			*distance = numSections > 0 ? distances[0] : 0.0f;
+		return numSections > 0 ? sections[0] : TubeSection();
+	}
+
+	// Same segment and parameter as tube.eval
+	float s = std::min( std::max( v, 0.0f ), 1.0f ) * static_cast<float>( numSections - 1 );
+	unsigned int i = std::min( static_cast<unsigned int>( s ), numSections - 2 );
+	float t = s - static_cast<float>( i );
+	if( distances && distance )
+		*distance = distances[i] * ( 1.0f - t ) + distances[i + 1] * t;
+	return evaluate( sections[i], sections[i + 1], t );
+}
+
+void TubeCurve::expandBound( osg::BoundingBox& box, const TubeSection& a, const TubeSection& b )
+{
+	osg::Vec3 chord = b.position - a.position;
+	float length = chord.length();
+	box.expandBy( a.position );
+	box.expandBy( a.position + orientedTangent( a, chord ) * ( length / 3.0f ) );
+	box.expandBy( b.position - orientedTangent( b, chord ) * ( length / 3.0f ) );
+	box.expandBy( b.position );
+}
+
+void TubeCurve::sample( const TubeSection& a, const TubeSection& b, unsigned int numSegments,
+	std::vector<osg::Vec3>& points )
+{
+	numSegments = std::max( numSegments, 1u );
+	points.resize( numSegments + 1 );
+	points[0] = a.position;
+	for( unsigned int i = 1; i < numSegments; i++ )
+		points[i] = evaluate( a, b, static_cast<float>( i ) / numSegments ).position;
+	points[numSegments] = b.position;
+}
+
+float TubeCurve::distanceToPolyline( const osg::Vec3& p, const std::vector<osg::Vec3>& points )
+{
+	if( points.size() < 2 )
+		return points.empty() ? 0.0f : ( p - points[0] ).length();
+
+	float distance = distanceToSegment( p, points[0], points[1] );
+	for( size_t i = 2; i < points.size(); i++ )
+		distance = std::min( distance, distanceToSegment( p, points[i - 1], points[i] ) );
+	return distance;
+}
+
+float TubeCurve::distanceToCurve( const osg::Vec3& p, const TubeSection& a, const TubeSection& b,
+	unsigned int numSegments )
+{
+	std::vector<osg::Vec3> points;
+	sample( a, b, numSegments, points );
+	return distanceToPolyline( p, points );
+}
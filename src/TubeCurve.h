@@ -0,0 +1,57 @@
+#ifndef _TUBE_CURVE_
+#define _TUBE_CURVE_
+
+#include <osg/BoundingBox>
+#include <osg/Vec3>
+
+#include "TubeSection.h"
+
+#include <vector>
+
+/*
+	Smooth tube axis between consecutive sections. tube.eval does this on the GPU, evaluate and
+	evaluatePatch are the same computation on the CPU, for the CPU mesh, the simplifier and tests.
+	Keep both in sync.
+
+	The position is a cubic Hermite curve whose end tangents are the tangents of the section frames,
+	normal ^ binormal oriented along the segment, scaled by the segment length. The curve between two
+	sections only depends on them, so consecutive patches meet with the same tangent direction, and a
+	segment of zero length, e.g. the padding of the last patch, stays a point. The frame is the
+	linear blend of the end frames made orthonormal to the curve tangent, the distance to the first
+	section is blended linearly.
+*/
+class TubeCurve
+{
+public:
+	//! Section at \t, from 0 at \a to 1 at \b.
+	static TubeSection evaluate( const TubeSection& a, const TubeSection& b, float t );
+
+	/*
+		Section at \v, from 0 to 1 along the \numSections sections of a patch, as tube.eval places the
+		tessellated rings. \distances, if not NULL, holds distanceTo0 of the sections, and \distance receives
+		its value at \v.
+	*/
+	static TubeSection evaluatePatch( const TubeSection* sections, unsigned int numSections, float v,
+		const float* distances = NULL, float* distance = NULL );
+
+	/*
+		Expands \box by the curve from \a to \b: the hull of the Bezier control points of the Hermite
+		curve, a.position + Ta * L / 3 and b.position - Tb * L / 3, holds it.
+	*/
+	static void expandBound( osg::BoundingBox& box, const TubeSection& a, const TubeSection& b );
+
+	//! Writes to \points the \numSegments + 1 positions of a polyline along the curve from \a to \b.
+	static void sample( const TubeSection& a, const TubeSection& b, unsigned int numSegments, std::vector<osg::Vec3>& points );
+
+	/*
+		Distance from \p to the polyline made by sample. It underestimates the distance to the curve by
+		at most the sagitta of a polyline segment.
+	*/
+	static float distanceToPolyline( const osg::Vec3& p, const std::vector<osg::Vec3>& points );
+
+	//! Same as above, sampling the curve from \a to \b on \numSegments segments.
+	static float distanceToCurve( const osg::Vec3& p, const TubeSection& a, const TubeSection& b,
+		unsigned int numSegments = 16 );
+};
+
+#endif
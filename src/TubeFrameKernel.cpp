@@ -0,0 +1,293 @@
+#include "TubeFrameKernel.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if !defined( TUBE_FRAME_KERNEL_SCALAR )
+	#if defined( __AVX__ )
+		#define TUBE_FRAME_KERNEL_AVX
+		#include <immintrin.h>
+	#elif defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+		#define TUBE_FRAME_KERNEL_SSE2
+		#include <emmintrin.h>
+	#endif
+#endif
+
+const char* TubeFrameKernel::getInstructionSet()
+{
+#if defined( TUBE_FRAME_KERNEL_AVX )
+	return "AVX";
+#elif defined( TUBE_FRAME_KERNEL_SSE2 )
+	return "SSE2";
+#else
+	return "scalar";
+#endif
+}
+
+namespace {
+
+// Reads the component of point \index from an array of floats or doubles with a stride in bytes
+template<typename T>
+inline float readComponent( const void* component, unsigned int index, unsigned int strideBytes )
+{
+	return static_cast<float>( *reinterpret_cast<const T*>( static_cast<const char*>( component ) + static_cast<size_t>( index ) * strideBytes ) );
+}
+
+template<typename T>
+inline osg::Vec3 readPoint( const TrajectoryView& trajectory, unsigned int index, float verticalScale )
+{
+	return osg::Vec3( readComponent<T>( trajectory.x, index, trajectory.strideBytes ),
+		readComponent<T>( trajectory.y, index, trajectory.strideBytes ),
+		readComponent<T>( trajectory.z, index, trajectory.strideBytes ) * verticalScale );
+}
+
+// Same as osg::Vec3::normalize, vectors of length 0 are left untouched
+inline void normalize( float& x, float& y, float& z )
+{
+	float norm = sqrtf( x * x + y * y + z * z );
+	if( norm > 0.0f )
+	{
+		float inv = 1.0f / norm;
+		x *= inv;
+		y *= inv;
+		z *= inv;
+	}
+}
+
+/*
+	Writes normalize( p[i] - p[i+1] ) for i in [0, count). The block arrays hold count + 1 points.
+*/
+void computeForwardDirections( const float* bx, const float* by, const float* bz, unsigned int count,
+	float* fx, float* fy, float* fz )
+{
+	unsigned int i = 0;
+
+#if defined( TUBE_FRAME_KERNEL_AVX )
+	const __m256 one8 = _mm256_set1_ps( 1.0f );
+	const __m256 zero8 = _mm256_setzero_ps();
+	for( ; i + 8 <= count; i += 8 )
+	{
+		__m256 dx = _mm256_sub_ps( _mm256_loadu_ps( bx + i ), _mm256_loadu_ps( bx + i + 1 ) );
+		__m256 dy = _mm256_sub_ps( _mm256_loadu_ps( by + i ), _mm256_loadu_ps( by + i + 1 ) );
+		__m256 dz = _mm256_sub_ps( _mm256_loadu_ps( bz + i ), _mm256_loadu_ps( bz + i + 1 ) );
+		__m256 len2 = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( dx, dx ), _mm256_mul_ps( dy, dy ) ), _mm256_mul_ps( dz, dz ) );
+		__m256 norm = _mm256_sqrt_ps( len2 );
+		__m256 valid = _mm256_cmp_ps( norm, zero8, _CMP_GT_OQ );
+		__m256 inv = _mm256_blendv_ps( one8, _mm256_div_ps( one8, norm ), valid );
+		_mm256_storeu_ps( fx + i, _mm256_mul_ps( dx, inv ) );
+		_mm256_storeu_ps( fy + i, _mm256_mul_ps( dy, inv ) );
+		_mm256_storeu_ps( fz + i, _mm256_mul_ps( dz, inv ) );
+	}
+#endif
+
+#if defined( TUBE_FRAME_KERNEL_AVX ) || defined( TUBE_FRAME_KERNEL_SSE2 )
+	const __m128 one4 = _mm_set1_ps( 1.0f );
+	const __m128 zero4 = _mm_setzero_ps();
+	for( ; i + 4 <= count; i += 4 )
+	{
+		__m128 dx = _mm_sub_ps( _mm_loadu_ps( bx + i ), _mm_loadu_ps( bx + i + 1 ) );
+		__m128 dy = _mm_sub_ps( _mm_loadu_ps( by + i ), _mm_loadu_ps( by + i + 1 ) );
+		__m128 dz = _mm_sub_ps( _mm_loadu_ps( bz + i ), _mm_loadu_ps( bz + i + 1 ) );
+		__m128 len2 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, dx ), _mm_mul_ps( dy, dy ) ), _mm_mul_ps( dz, dz ) );
+		__m128 norm = _mm_sqrt_ps( len2 );
+		__m128 valid = _mm_cmpgt_ps( norm, zero4 );
+		// inv = valid ? 1 / norm : 1, without SSE4.1 blend
+		__m128 inv = _mm_or_ps( _mm_and_ps( valid, _mm_div_ps( one4, norm ) ), _mm_andnot_ps( valid, one4 ) );
+		_mm_storeu_ps( fx + i, _mm_mul_ps( dx, inv ) );
+		_mm_storeu_ps( fy + i, _mm_mul_ps( dy, inv ) );
+		_mm_storeu_ps( fz + i, _mm_mul_ps( dz, inv ) );
+	}
+#endif
+
+	for( ; i < count; i++ )
+	{
+		float dx = bx[i] - bx[i+1];
+		float dy = by[i] - by[i+1];
+		float dz = bz[i] - bz[i+1];
+		normalize( dx, dy, dz );
+		fx[i] = dx;
+		fy[i] = dy;
+		fz[i] = dz;
+	}
+}
+
+/*
+	Rotates \v by the minimal rotation taking the unit vector a to the unit vector b, given
+	axis = a ^ b and c = a * b: v' = v c + axis ^ v + axis ( axis * v ) / ( 1 + c )
+*/
+inline osg::Vec3 rotateMinimal( const osg::Vec3& v, const osg::Vec3& axis, float c )
+{
+	float onePlusC = 1.0f + c;
+	if( onePlusC < 1e-6f )
+	{
+		// Half turn, the formula is singular: rotate by pi around the normalized axis
+		osg::Vec3 k = axis;
+		k.normalize();
+		return k * ( 2.0f * ( k * v ) ) - v;
+	}
+	return v * c + ( axis ^ v ) + axis * ( ( axis * v ) / onePlusC );
+}
+
+/*
+	Tries to add the point at \position, whose direction to the next point is \forward, the same way
+	TubeSectionBuilder::buildNewPoint does. Returns true if the point was accepted, and then \frame
+	and \frameTangent move to it. \section receives its frame, which is the previous one when the
+	point is culled.
+*/
+inline bool propagateFrame( TubeSection& frame, osg::Vec3& frameTangent, const osg::Vec3& position,
+	const osg::Vec3& forward, float curveTolerance, TubeSection& section )
+{
+	section.position = position;
+	section.normal = frame.normal;
+	section.binormal = frame.binormal;
+
+	osg::Vec3 backward = position - frame.position;
+	backward.normalize();
+	osg::Vec3 tangent = forward - backward;
+	if( tangent.length2() == 0 )
+		return false;
+	tangent.normalize();
+
+	osg::Vec3 rotationAxis = frameTangent ^ tangent;
+	if( rotationAxis.length2() < curveTolerance )
+		return false;
+
+	float c = frameTangent * tangent;
+	section.normal = rotateMinimal( frame.normal, rotationAxis, c );
+	section.normal.normalize();
+	section.binormal = rotateMinimal( frame.binormal, rotationAxis, c );
+	section.binormal.normalize();
+
+	frame = section;
+	frameTangent = tangent;
+	return true;
+}
+
+}
+
+void TubeFrameKernel::buildSections( const TrajectoryView& trajectory, float verticalScale, float curveTolerance,
+	std::vector<TubeSection>& sections )
+{
+	sections.clear();
+	Stream stream( verticalScale, curveTolerance );
+	stream.append( trajectory, sections );
+}
+
+TubeFrameKernel::Stream::Stream( float verticalScale, float curveTolerance )
+{
+	reset( verticalScale, curveTolerance );
+}
+
+void TubeFrameKernel::Stream::reset( float verticalScale, float curveTolerance )
+{
+	_verticalScale = verticalScale;
+	_curveTolerance = curveTolerance;
+	_stage = NO_POINTS;
+	_numPoints = 0;
+	_hasProvisional = false;
+}
+
+void TubeFrameKernel::Stream::append( const TrajectoryView& points, std::vector<TubeSection>& sections )
+{
+	if( points.isDouble )
+		appendT<double>( points, sections );
+	else
+		appendT<float>( points, sections );
+}
+
+void TubeFrameKernel::Stream::addStartPoint( const osg::Vec3& point, std::vector<TubeSection>& sections )
+{
+	if( _stage == NO_POINTS )
+	{
+		_pending = point;
+		_stage = NEED_SECOND_POINT;
+		return;
+	}
+
+	// The first point must be included, its tangent goes towards the first point that differs from it
+	osg::Vec3 tangent = _pending - point;
+	if( tangent.length2() == 0 )
+		return;
+
+	tangent.normalize();
+	_frameTangent = tangent;
+	_frame.position = _pending;
+	_frame.normal = osg::Vec3( -tangent[1] + tangent[2], tangent[0] + tangent[2], -tangent[0] - tangent[1] );
+	if( _frame.normal.length2() == 0 )
+		_frame.normal = osg::Vec3( tangent[1], -tangent[0], 0 ); // tangent is parallel to ( -1, 1, 1 )
+	_frame.normal.normalize();
+	_frame.binormal = tangent ^ _frame.normal;
+	sections.push_back( _frame );
+
+	_previous = _pending;
+	_pending = point;
+	_stage = RUNNING;
+}
+
+template<typename T>
+void TubeFrameKernel::Stream::appendT( const TrajectoryView& points, std::vector<TubeSection>& sections )
+{
+	if( _hasProvisional )
+	{
+		sections.pop_back();
+		_hasProvisional = false;
+	}
+
+	unsigned int numPoints = points.numPoints;
+	// Streams append a few points at a time, an exact reserve each time would copy the sections for every append
+	size_t needed = sections.size() + numPoints + 1;
+	if( needed > sections.capacity() )
+		sections.reserve( std::max( needed, 2 * sections.capacity() ) );
+
+	// Until the first frame is known the points are taken one by one
+	unsigned int i = 0;
+	for( ; i < numPoints && _stage != RUNNING; i++ )
+		addStartPoint( readPoint<T>( points, i, _verticalScale ), sections );
+
+	// Then in blocks whose first point is the pending one, which is interior now that its next point is known
+	float bx[BLOCK_SIZE + 1], by[BLOCK_SIZE + 1], bz[BLOCK_SIZE + 1];
+	float fx[BLOCK_SIZE], fy[BLOCK_SIZE], fz[BLOCK_SIZE];
+	TubeSection section;
+	while( i < numPoints )
+	{
+		unsigned int count = numPoints - i;
+		if( count > BLOCK_SIZE )
+			count = BLOCK_SIZE;
+
+		bx[0] = _pending[0];
+		by[0] = _pending[1];
+		bz[0] = _pending[2];
+		for( unsigned int k = 1; k <= count; k++, i++ )
+		{
+			bx[k] = readComponent<T>( points.x, i, points.strideBytes );
+			by[k] = readComponent<T>( points.y, i, points.strideBytes );
+			bz[k] = readComponent<T>( points.z, i, points.strideBytes ) * _verticalScale;
+		}
+
+		computeForwardDirections( bx, by, bz, count, fx, fy, fz );
+
+		for( unsigned int k = 0; k < count; k++ )
+		{
+			if( propagateFrame( _frame, _frameTangent, osg::Vec3( bx[k], by[k], bz[k] ), osg::Vec3( fx[k], fy[k], fz[k] ),
+				_curveTolerance, section ) )
+				sections.push_back( section );
+		}
+
+		_previous = osg::Vec3( bx[count-1], by[count-1], bz[count-1] );
+		_pending = osg::Vec3( bx[count], by[count], bz[count] );
+	}
+	_numPoints += numPoints;
+
+	if( _stage != RUNNING )
+		return;
+
+	// The last point needs to be included always, its next point is extrapolated from the one before it.
+	// It works on a copy of the frame, the next append goes on from the last accepted one.
+	TubeSection frame = _frame;
+	osg::Vec3 frameTangent = _frameTangent;
+	osg::Vec3 forward = _previous - _pending;
+	forward.normalize();
+	propagateFrame( frame, frameTangent, _pending, forward, _curveTolerance, section );
+	sections.push_back( section );
+	_hasProvisional = true;
+}
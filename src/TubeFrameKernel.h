@@ -0,0 +1,104 @@
+#ifndef _TUBE_FRAME_KERNEL_
+#define _TUBE_FRAME_KERNEL_
+
+#include "TubeSection.h"
+#include "TrajectoryView.h"
+
+#include <vector>
+
+/*
+	Rotation minimizing frame propagation used by TubeGeometryBuilder to compute the sections of a
+	trajectory. Each accepted point rotates the previous frame by the minimal rotation between the
+	previous and the current tangent, the same rotation TubeGeometryBuilder's TubeSectionBuilder builds with
+	acos and osg::Matrix::rotate, but evaluated with the Rodrigues formula from the dot and cross
+	products only, with no trigonometry and no matrix.
+
+	Points are read in blocks into structure of arrays scratch buffers on the stack, where the
+	direction to the next point is computed with AVX or SSE2 when the compiler targets them, and with
+	scalar code otherwise. The path is selected at compile time, defining TUBE_FRAME_KERNEL_SCALAR
+	forces the scalar one. The SIMD lanes do the same IEEE operations ( sub, mul, add, sqrt, div ) as
+	the scalar code, so the paths agree within rounding. They are not bitwise identical: the compiler
+	may contract a mul and an add of the scalar code into one FMA, rounded once.
+
+	The frames are within 1e-3 per component of the same propagation evaluated in double precision,
+	over a million points, 6e-4 measured on a random walk. The TubeSectionBuilder reference, see
+	TubeGeometryBuilder::buildReferenceSections, drifts much more: its float acos loses precision for
+	the small angles just above the tolerance, and the error accumulates with the accepted frames. The
+	two differ by up to 1e-2 per component on a million point helix, 5e-3 measured, and by up to 1e-1
+	on slowly turning curves where most frames are such small angles, 6e-2 measured with 60000 frames
+	of 1/500 radian. Points within rounding of the tolerance, at most one in 1000, may be culled by one
+	and not by the other. tests/frame_kernel_check.cpp enforces these bounds.
+*/
+class TubeFrameKernel
+{
+public:
+	//! Number of points gathered per block.
+	static const unsigned int BLOCK_SIZE = 256;
+
+	//! Name of the SIMD path compiled in: "AVX", "SSE2" or "scalar".
+	static const char* getInstructionSet();
+
+	/*
+		Computes the sections of the trajectory, reading the points in place. Double coordinates are
+		converted to float as they are gathered, and z is multiplied by \verticalScale.
+		\sections is cleared first, and stays empty if the trajectory has less than two distinct points.
+	*/
+	static void buildSections( const TrajectoryView& trajectory, float verticalScale, float curveTolerance,
+		std::vector<TubeSection>& sections );
+
+	/*
+		Resumable frame propagation, for trajectories that grow over time. The last section written to
+		the output is provisional: the last point has no next point yet, so its frame is computed from
+		an extrapolated one. The next append replaces it and goes on from the last accepted frame, so
+		appending is proportional to the number of new points, and gives the same sections as building
+		the whole trajectory at once.
+	*/
+	class Stream
+	{
+	public:
+		Stream( float verticalScale = 1.0f, float curveTolerance = 0.001f );
+
+		//! Starts a new trajectory.
+		void reset( float verticalScale, float curveTolerance );
+
+		/*
+			Appends the sections of \points to \sections, which must hold the sections written by this
+			stream since the last reset. The provisional last section is removed first.
+		*/
+		void append( const TrajectoryView& points, std::vector<TubeSection>& sections );
+
+		//! True if the last section of the output will be replaced by the next append.
+		bool hasProvisionalSection() const { return _hasProvisional; }
+
+		unsigned int getNumPoints() const { return _numPoints; }
+
+	private:
+		template<typename T>
+		void appendT( const TrajectoryView& points, std::vector<TubeSection>& sections );
+
+		void addStartPoint( const osg::Vec3& point, std::vector<TubeSection>& sections );
+
+		enum Stage
+		{
+			NO_POINTS,
+			NEED_SECOND_POINT,
+			RUNNING
+		};
+
+		float _verticalScale;
+		float _curveTolerance;
+		Stage _stage;
+		unsigned int _numPoints;
+		bool _hasProvisional;
+
+		//! Frame of the last accepted point, the next ones are propagated from it.
+		TubeSection _frame;
+		osg::Vec3 _frameTangent;
+
+		//! Last point received, waiting for its next point, and the point before it.
+		osg::Vec3 _pending;
+		osg::Vec3 _previous;
+	};
+};
+
+#endif
@@ -2,37 +2,159 @@
 
 #include <osg/Group>
 #include <osg/LineWidth>
+#include <osg/LOD>
 #include <osg/PatchParameter>
-#include <osgDB/ReadFile>
-#include <osgDB/FileUtils>
-#include <osg/LineWidth>
-
+#include <osg/Timer>
+
+#include "TubeCurve.h"
+#include "TubeFrameKernel.h"
+#include "TubePatchLayout.h"
+#include "TubeSectionCache.h"
+#include "TubeShaders.h"
+#include "TubeStyleTable.h"
+#include "TubeUniform.h"
+#include "TubeWorkerPool.h"
+
+#include <algorithm>
 #include <cassert>
+#include <cfloat>
 #include <iostream>
+#include <stdexcept>
+
+/*
+	Bound of the curve drawn by the patches of a tube geometry, grown by the tube radius so the tube
+	surface is inside it. Each segment between consecutive patch indices adds the control hull of its
+	curve, see TubeCurve::expandBound, as the curve bulges past its sections. The vertices past the
+	patch indices, i.e. the spare capacity or the sections of other chunks, are left out. Compact
+	positions and frames are decoded with the blocks in the StateSet of the geometry.
+
+	The bound of the indices already seen is kept, so a tube grown by appendTrajectory only adds its
+	new patches. It may then still hold the former position of the provisional last section, which
+	only makes it slightly larger.
+*/
+class TubeBoundCallback : public osg::Drawable::ComputeBoundingBoxCallback
+{
+public:
+	TubeBoundCallback( float radius ) : _radius( radius ), _numIndices( 0 ) {}
+
+	void setRadius( float radius ) { _radius = radius; }
+
+	//! The indices from \firstIndex on changed, the bound is computed again from all of them if 0.
+	void dirtyIndices( unsigned int firstIndex )
+	{
+		_numIndices = std::min( _numIndices, firstIndex );
+		if( _numIndices == 0 )
+			_box.init();
+	}
+
+	virtual osg::BoundingBox computeBound( const osg::Drawable& drawable ) const
+	{
+		const osg::Geometry* geometry = drawable.asGeometry();
+		if( !geometry )
+			return osg::BoundingBox();
+
+		const osg::Vec3Array* pos = dynamic_cast<const osg::Vec3Array*>( geometry->getVertexArray() );
+		const osg::Vec3Array* nor = dynamic_cast<const osg::Vec3Array*>( geometry->getVertexAttribArray( 2 ) );
+		const osg::Vec3Array* bin = dynamic_cast<const osg::Vec3Array*>( geometry->getVertexAttribArray( 3 ) );
+		const osg::Vec4sArray* compactPos = dynamic_cast<const osg::Vec4sArray*>( geometry->getVertexArray() );
+		const osg::Vec4sArray* frames = dynamic_cast<const osg::Vec4sArray*>( geometry->getVertexAttribArray( 4 ) );
+		TubeVertexCodec::Blocks blocks;
+		if( pos ? !nor || !bin : !compactPos || !frames || !TubeVertexCodec::Blocks::get( geometry->getStateSet(), blocks ) )
+			return osg::BoundingBox();
+
+		// The indices of every primitive set, one after the other, the segments ending at the first _numIndices are in _box
+		unsigned int firstIndex = 0;
+		for( unsigned int i = 0; i < geometry->getNumPrimitiveSets(); i++ )
+		{
+			const osg::DrawElements* indices = geometry->getPrimitiveSet( i )->getDrawElements();
+			if( !indices )
+				continue;
+			unsigned int numIndices = indices->getNumIndices();
+			unsigned int first = std::max( _numIndices, firstIndex ) - firstIndex;
+			if( first < numIndices )
+			{
+				// Consecutive patches share their end section and the padding repeats the last one, so the
+				// segments across them have no length
+				TubeSection previous = getSection( indices->index( first > 0 ? first - 1 : 0 ), pos, nor, bin,
+					compactPos, frames, blocks );
+				for( unsigned int j = first; j < numIndices; j++ )
+				{
+					TubeSection section = getSection( indices->index( j ), pos, nor, bin, compactPos, frames, blocks );
+					TubeCurve::expandBound( _box, previous, section );
+					previous = section;
+				}
+			}
+			firstIndex += numIndices;
+		}
+		_numIndices = std::max( _numIndices, firstIndex );
+
+		osg::BoundingBox box = _box;
+		if( box.valid() )
+		{
+			box.xMin() -= _radius;
+			box.yMin() -= _radius;
+			box.zMin() -= _radius;
+			box.xMax() += _radius;
+			box.yMax() += _radius;
+			box.zMax() += _radius;
+		}
+		return box;
+	}
 
-static osg::ref_ptr<osg::Program> s_cylProgram;
-static osg::ref_ptr<osg::Program> s_lineProgram;
-static osg::ref_ptr<osg::Shader>  s_cylVertObj;
-static osg::ref_ptr<osg::Shader>  s_lineVertObj;
-static osg::ref_ptr<osg::Shader>  s_cylFragObj;
-static osg::ref_ptr<osg::Shader>  s_lineFragObj;
-static osg::ref_ptr<osg::Shader>  s_cylEvalObj;
-static osg::ref_ptr<osg::Shader>  s_cylControlObj;
-static bool shaderLoaded = false;
+private:
+	// Section of the vertex \index, from either layout
+	static TubeSection getSection( unsigned int index, const osg::Vec3Array* pos, const osg::Vec3Array* nor,
+		const osg::Vec3Array* bin, const osg::Vec4sArray* compactPos, const osg::Vec4sArray* frames,
+		const TubeVertexCodec::Blocks& blocks )
+	{
+		TubeSection section;
+		if( pos )
+		{
+			section.position = ( *pos )[index];
+			section.normal = ( *nor )[index];
+			section.binormal = ( *bin )[index];
+		}
+		else
+		{
+			section.position = TubeVertexCodec::decodePosition( ( *compactPos )[index], blocks );
+			TubeVertexCodec::decodeFrame( ( *frames )[index], section.normal, section.binormal );
+		}
+		return section;
+	}
 
+	float _radius;
+	//! Bound of the curve up to the first _numIndices indices, without the radius.
+	mutable osg::BoundingBox _box;
+	mutable unsigned int _numIndices;
+};
 
-static void
-LoadShaderSource( osg::Shader* shader, const std::string& fileName )
+// Geometry drawing patches over the vertex arrays of \arrays, the indices are added by the caller
+static osg::Geometry* makeChunkGeometry( osg::Geometry* arrays, float radius, TubeVertexSubload* vertexSubload )
 {
-    std::string fqFileName = osgDB::findDataFile(fileName);
-    if( fqFileName.length() != 0 )
-    {
-        shader->loadShaderSourceFromFile( fqFileName.c_str() );
-    }
-    else
-    {
-        osg::notify(osg::WARN) << "File \"" << fileName << "\" not found." << std::endl;
-    }
+	osg::Geometry* geo = new osg::Geometry();
+	// Reads the pooled arrays, see makeCylinderGeometry
+	geo->setDataVariance( osg::Object::DYNAMIC );
+	geo->setUseDisplayList( false );
+	geo->setUseVertexBufferObjects( true );
+	geo->setVertexArray( arrays->getVertexArray() );
+	osg::DrawElementsUInt* patches = new osg::DrawElementsUInt( osg::PrimitiveSet::PATCHES );
+	// Rewritten in place by appendTrajectory
+	patches->setDataVariance( osg::Object::DYNAMIC );
+	geo->addPrimitiveSet( patches );
+	// Normal, binormal, compact frame and distanceTo0, whichever the layout has
+	static const unsigned int attributes[] = { 2, 3, 4, 6 };
+	for( unsigned int i = 0; i < 4; i++ )
+	{
+		if( !arrays->getVertexAttribArray( attributes[i] ) )
+			continue;
+		geo->setVertexAttribArray( attributes[i], arrays->getVertexAttribArray( attributes[i] ) );
+		geo->setVertexAttribBinding( attributes[i], osg::Geometry::BIND_PER_VERTEX );
+	}
+	// The blocks of the compact positions
+	geo->setStateSet( arrays->getStateSet() );
+	geo->setComputeBoundingBoxCallback( new TubeBoundCallback( radius ) );
+	geo->setDrawCallback( vertexSubload );
+	return geo;
 }
 
 static int index1Dfrom2D( int rowSize, int i, int j )
@@ -40,12 +162,20 @@ static int index1Dfrom2D( int rowSize, int i, int j )
 	return i * rowSize + j;
 }
 
-TubeGeometryBuilder::TubeGeometryBuilder()
+TubeGeometryBuilder::TubeGeometryBuilder() :
+	_streamValid( false ), _lodRangeMode( osg::LOD::PIXEL_SIZE_ON_SCREEN ), _lodSwitchValue( 2.0f ),
+	_backend( TESSELLATION_SHADERS ), _patchVertices( 0 ), _chunkPatches( 0 ), _compactVertices( false ),
+	_lighting( true ), _sectionsCached( false ), _cacheKey( 0 )
 {
 }
 
-static void clearTube( osg::Group* tubeGroup )
+void TubeGeometryBuilder::clearTube( osg::Group* tubeGroup )
 {
+	// The CPU mesh arrays are not in the layout of the pool
+	TubeNodeData* data = TubeNodeData::get( tubeGroup );
+	if( data && !data->cpuMesh && data->geometry.valid() )
+		_arrayPool.release( data->geometry.get() );
+
 	tubeGroup->removeChildren( 0, tubeGroup->getNumChildren() );
 	tubeGroup->getOrCreateStateSet()->clear();
 }
@@ -53,166 +183,834 @@ static void clearTube( osg::Group* tubeGroup )
 void TubeGeometryBuilder::createTubeWithLOD( osg::Group* tubeGroup, osg::Camera* cam, float radius, float minRadius, 
 	osg::Vec4 color, osg::Vec4 fluxColor, bool fluxUp, float fluxSpeed, int fluxStep, int numRadialVertices, float lineWidth )
 {
-	if(!shaderLoaded)
+	// A tube built again keeps its row of the flux table
+	TubeNodeData* oldData = TubeNodeData::get( tubeGroup );
+	bool reuseFluxRow = oldData && _fluxTable.valid() && oldData->fluxTable == _fluxTable;
+	unsigned int fluxTableId = reuseFluxRow ? oldData->fluxTableId : 0;
+
+	// And its id in the segment hierarchy
+	bool reuseBVHTube = oldData && _segmentBVH.valid() && oldData->segmentBVH == _segmentBVH;
+	unsigned int segmentBVHId = reuseBVHTube ? oldData->segmentBVHId : 0;
+	if( oldData && oldData->segmentBVH.valid() && !reuseBVHTube )
+		oldData->segmentBVH->removeTube( oldData->segmentBVHId );
+
+	clearTube( tubeGroup );
+
+	osg::Geometry* cylinderGeometry;
+	osg::Geometry* lineGeometry;
+	TubeNodeData* data = new TubeNodeData;
+	data->style = TubeStyle( radius, minRadius, color, fluxColor, fluxUp, fluxSpeed, fluxStep );
+	if( _backend == CPU_MESH )
 	{
-		createShaderStuff();
-		shaderLoaded = true;
+		if( _sections.size() < 1 )
+			throw std::runtime_error( "Trajectory has not been set" );
+
+		data->cpuMesh = true;
+		data->radius = radius;
+		data->meshSettings = _meshSettings;
+		data->meshSettings.radialVertices = numRadialVertices;
+		osg::Timer_t start = osg::Timer::instance()->tick();
+		cylinderGeometry = TubeMeshBuilder::createGeometry( _sections, radius, data->meshSettings );
+		countGeometry( cylinderGeometry, 0, osg::Timer::instance()->delta_m( start, osg::Timer::instance()->tick() ) );
+		lineGeometry = TubeMeshBuilder::createLineGeometry( cylinderGeometry, data->meshSettings );
+		data->geometry = cylinderGeometry;
+		data->lineGeometry = lineGeometry;
 	}
+	else
+	{
+		data->patchVertices = _patchVertices > 0 ? _patchVertices : TubePatchLayout::choosePatchSize( _sections.size() );
+		cylinderGeometry = makeCylinderGeometry( radius, color, numRadialVertices, data->patchVertices, &data->positionBlocks );
+		data->geometry = cylinderGeometry;
+		data->chunks.push_back( cylinderGeometry );
+		data->compact = _compactVertices;
+		data->patchesPerChunk = _chunkPatches;
+		data->radius = radius;
+		data->numVertices = data->capacity = cylinderGeometry->getVertexArray()->getNumElements();
+		data->vertexSubload = new TubeVertexSubload( cylinderGeometry );
+		cylinderGeometry->setDrawCallback( data->vertexSubload.get() );
+
+		// The line reuses the tube vertex arrays
+		lineGeometry = makeLineGeometry( cylinderGeometry );
+		lineGeometry->setDrawCallback( data->vertexSubload.get() );
+		data->draws.push_back( static_cast<osg::DrawArrays*>( lineGeometry->getPrimitiveSet( 0 ) ) );
+	}
+	tubeGroup->setUserData( data );
 
-	clearTube( tubeGroup );
+	if( _segmentBVH.valid() )
+	{
+		data->segmentBVH = _segmentBVH;
+		data->segmentBVHId = reuseBVHTube ? segmentBVHId : _segmentBVH->addTube( _sections, radius );
+		if( reuseBVHTube )
+			_segmentBVH->setTube( segmentBVHId, _sections, radius );
+		_segmentBVH->setTubeGroup( data->segmentBVHId, tubeGroup );
+	}
 
 	osg::Geode* cylinder = new osg::Geode();
-	cylinder->addDrawable( makeCylinderGeometry( radius, color, numRadialVertices ) );
+	cylinder->addDrawable( cylinderGeometry );
+	data->cylinder = cylinder;
+	if( !data->cpuMesh && data->patchesPerChunk > 0 )
+		layoutChunks( data, 0 );
+
+	osg::Geode* line = new osg::Geode();
+	line->addDrawable( lineGeometry );
+	data->line = line;
+
+	bool fluxTable = _fluxTable.valid();
+	setShaderFeatures( tubeGroup, ( data->compact ? TubeShaders::COMPACT : 0 ) | ( fluxTable ? TubeShaders::FLUX_TABLE : 0 ) |
+		( _lighting ? 0 : TubeShaders::NO_LIGHTING ) );
+	line->getOrCreateStateSet()->setAttributeAndModes( new osg::LineWidth( lineWidth ), osg::StateAttribute::ON );
+
+	osg::LOD* lod = new osg::LOD;
+	lod->addChild( cylinder );
+	lod->addChild( line );
+	setLODRanges( lod, data );
+	tubeGroup->addChild( lod );
+
+	// Without a camera the view uniforms come from a TubeCameraUniforms above the tube
+	if( cam )
+	{
+		osg::Uniform* mvpInverseUniform = new osg::Uniform( "MVPinverse", osg::Matrixf() );
+		mvpInverseUniform->setUpdateCallback( new MVPInverseCallback( cam ) );
+		tubeGroup->getOrCreateStateSet()->addUniform( mvpInverseUniform );
+
+		osg::Uniform* screenUniform = new osg::Uniform( "screenWidth", 10000.0f );
+		screenUniform->setUpdateCallback( new ScreenCallback( cam ) );
+		tubeGroup->getOrCreateStateSet()->addUniform( screenUniform );
+	}
+
+	if( fluxTable )
+	{
+		// The colors and the flux are read from the table row of the tube, the uniform never changes
+		if( !reuseFluxRow )
+			fluxTableId = _fluxTable->addTube( data->style );
+		data->fluxTable = _fluxTable;
+		data->fluxTableId = fluxTableId;
+		tubeGroup->getOrCreateStateSet()->addUniform( new osg::Uniform( "tubeTableId", static_cast<int>( fluxTableId ) ) );
+	}
+	applyStyle( tubeGroup, data, data->style );
+
+	// TODO: Needs a global OSG uniform for the lights intead of this!
+	tubeGroup->getOrCreateStateSet()->addUniform( new osg::Uniform( "lightPos", ::osg::Vec3( 10000, 10000, 10000 ) ) );
+
+	if( _backend == CPU_MESH )
+		return;
 
-	tubeGroup->addChild( cylinder );
+	cylinder->getOrCreateStateSet()->setAttribute( new osg::PatchParameter( data->patchVertices ) );
 
-	cylinder->getOrCreateStateSet()->setAttributeAndModes( s_cylProgram, osg::StateAttribute::ON );
+	TubeTessellation::Settings tessellation = _tessellation.forPatch( data->patchVertices );
+	tessellation.maxLevels.x() = static_cast<float>( numRadialVertices );
+	tessellation.apply( cylinder->getOrCreateStateSet() );
+}
 
-	osg::Matrixd m = cam->getViewMatrix();
-	osg::Uniform* mvpInverseUniform = new osg::Uniform( "MVPinverse", osg::Matrixf() );
-	mvpInverseUniform->setUpdateCallback( new MVPInverseCallback( cam ) );
-	tubeGroup->getOrCreateStateSet()->addUniform( mvpInverseUniform );
+bool TubeGeometryBuilder::updateTube( osg::Group* tubeGroup, float radius, float minRadius, osg::Vec4 color,
+	osg::Vec4 fluxColor, bool fluxUp, float fluxSpeed, int fluxStep, int numRadialVertices, float lineWidth )
+{
+	// A tube of another backend, vertex layout or flux table has another subgraph and other programs
+	TubeNodeData* data = TubeNodeData::get( tubeGroup );
+	osg::LOD* lod = tubeGroup->getNumChildren() > 0 ? dynamic_cast<osg::LOD*>( tubeGroup->getChild( 0 ) ) : NULL;
+	if( !data || !lod || _sections.empty() || data->cpuMesh != ( _backend == CPU_MESH ) ||
+		data->fluxTable != _fluxTable || ( !data->cpuMesh && data->compact != _compactVertices ) )
+		return false;
+
+	osg::Timer_t start = osg::Timer::instance()->tick();
+	TubeBuildStats stats;
+	stats.sections = _sections.size();
+
+	if( data->segmentBVH.valid() )
+		data->segmentBVH->setTube( data->segmentBVHId, _sections, radius );
+
+	bool patchChanged = false;
+	if( data->cpuMesh )
+	{
+		data->radius = radius;
+		data->meshSettings = _meshSettings;
+		data->meshSettings.radialVertices = numRadialVertices;
+		TubeMeshBuilder::updateGeometry( data->geometry.get(), data->lineGeometry.get(), _sections, 0, radius,
+			data->meshSettings );
+	}
+	else
+	{
+		osg::StateSet* cylinderSS = data->cylinder->getOrCreateStateSet();
+		unsigned int patchVertices = _patchVertices > 0 ? _patchVertices : TubePatchLayout::choosePatchSize( _sections.size() );
+		if( patchVertices != data->patchVertices )
+		{
+			patchChanged = true;
+			data->patchVertices = patchVertices;
+			cylinderSS->setAttribute( new osg::PatchParameter( patchVertices ) );
+		}
 
-	osg::Uniform* screenUniform = new osg::Uniform( "screenWidth", 10000.0f );
-	screenUniform->setUpdateCallback( new ScreenCallback( cam ) );
-	tubeGroup->getOrCreateStateSet()->addUniform( screenUniform );
+		if( radius != data->radius )
+		{
+			data->radius = radius;
+			for( unsigned int i = 0; i < data->chunks.size(); i++ )
+			{
+				TubeBoundCallback* bound = dynamic_cast<TubeBoundCallback*>( data->chunks[i]->getComputeBoundingBoxCallback() );
+				if( bound )
+					bound->setRadius( radius );
+			}
+		}
 
-	osg::Uniform* timeUpdateUniform = new osg::Uniform( "TimeUpdate", 2.0f );
-	timeUpdateUniform->setUpdateCallback( new TimeUpdate( fluxUp, fluxStep, fluxSpeed ) );
-	tubeGroup->getOrCreateStateSet()->addUniform( timeUpdateUniform );
+		if( data->compact )
+		{
+			data->positionBlocks = TubeVertexCodec::computeBlocks( _sections );
+			data->positionBlocks.apply( data->geometry->getOrCreateStateSet() );
+		}
+		repackVertices( data, 0 );
+		data->patchesPerChunk = _chunkPatches;
+		layoutChunks( data, 0 );
 
-	tubeGroup->getOrCreateStateSet()->addUniform( new osg::Uniform( "fluxStep", static_cast<float>( fluxStep ) ) );
+		TubeTessellation::Settings tessellation = _tessellation.forPatch( data->patchVertices );
+		tessellation.maxLevels.x() = static_cast<float>( numRadialVertices );
+		tessellation.apply( cylinderSS );
+	}
 
-	tubeGroup->getOrCreateStateSet()->addUniform( new osg::Uniform( "color", color ) );
+	// The programs of a new patch size or without the flux are changed, the others are kept
+	unsigned int features = ( data->compact ? TubeShaders::COMPACT : 0 ) | ( data->fluxTable.valid() ? TubeShaders::FLUX_TABLE : 0 ) |
+		( _lighting ? 0 : TubeShaders::NO_LIGHTING );
+	if( features != data->shaderFeatures || patchChanged )
+		setShaderFeatures( tubeGroup, features );
 
-	tubeGroup->getOrCreateStateSet()->addUniform( new osg::Uniform( "radius", radius ) );
+	osg::StateSet* lineSS = data->line->getOrCreateStateSet();
+	osg::LineWidth* width = dynamic_cast<osg::LineWidth*>( lineSS->getAttribute( osg::StateAttribute::LINEWIDTH ) );
+	if( !width || width->getWidth() != lineWidth )
+		lineSS->setAttributeAndModes( new osg::LineWidth( lineWidth ), osg::StateAttribute::ON );
 
-	tubeGroup->getOrCreateStateSet()->addUniform( new osg::Uniform( "minRadius", minRadius ) );
+	setLODRanges( lod, data );
+	applyStyle( tubeGroup, data, TubeStyle( radius, minRadius, color, fluxColor, fluxUp, fluxSpeed, fluxStep ) );
 
-	tubeGroup->getOrCreateStateSet()->addUniform( new osg::Uniform( "fluxColor", fluxColor ) );
+	recordAppendStats( stats, data, start );
+	return true;
+}
 
-	// TODO: Needs a global OSG uniform for the lights intead of this!
-	tubeGroup->getOrCreateStateSet()->addUniform( new osg::Uniform( "lightPos", ::osg::Vec3( 10000, 10000, 10000 ) ) );
+void TubeGeometryBuilder::applyStyle( osg::Group* tubeGroup, TubeNodeData* data, const TubeStyle& style )
+{
+	osg::StateSet* stateSet = tubeGroup->getOrCreateStateSet();
+	if( data->fluxTable.valid() )
+	{
+		// An unchanged row is not uploaded again, the copy is compared as other tubes may be added meanwhile
+		TubeStyle current = data->fluxTable->getTube( data->fluxTableId );
+		if( current != style )
+			data->fluxTable->setTube( data->fluxTableId, style );
+	}
+	else
+	{
+		// The flux animation keeps its phase unless its parameters change
+		bool fluxChanged = style.fluxUp != data->style.fluxUp || style.fluxSpeed != data->style.fluxSpeed ||
+			style.fluxStep != data->style.fluxStep;
+		if( fluxChanged || !stateSet->getUniform( "TimeUpdate" ) )
+		{
+			stateSet->removeUniform( "TimeUpdate" );
+			osg::Uniform* timeUpdateUniform = new osg::Uniform( "TimeUpdate", 2.0f );
+			timeUpdateUniform->setUpdateCallback( new TimeUpdate( style.fluxUp, style.fluxStep, style.fluxSpeed ) );
+			stateSet->addUniform( timeUpdateUniform );
+		}
+
+		updateUniform( stateSet, "fluxStep", static_cast<float>( style.fluxStep ) );
+		updateUniform( stateSet, "color", style.color );
+		updateUniform( stateSet, "fluxColor", style.fluxColor );
+	}
+
+	updateUniform( stateSet, "radius", style.radius );
+	updateUniform( stateSet, "minRadius", style.minRadius );
+	data->style = style;
+}
+
+void TubeGeometryBuilder::setLODRanges( osg::LOD* lod, TubeNodeData* data )
+{
+	lod->setRangeMode( _lodRangeMode );
+	if( _lodRangeMode == osg::LOD::DISTANCE_FROM_EYE_POINT )
+	{
+		lod->setRange( 0, 0.0f, _lodSwitchValue );
+		lod->setRange( 1, _lodSwitchValue, FLT_MAX );
+	}
+	else
+	{
+		// The LOD measures the pixel size of the tube bound, which is as many times larger than the
+		// tube diameter as the bound radius is larger than the tube radius
+		float boundRadius = data->cylinder->getBound().radius();
+		float switchPixels = data->radius > 0 ? _lodSwitchValue * boundRadius / data->radius : 0.0f;
+		lod->setRange( 0, switchPixels, FLT_MAX );
+		lod->setRange( 1, 0.0f, switchPixels );
+	}
+}
 
-	cylinder->getOrCreateStateSet()->setAttribute(new osg::PatchParameter(32));
+void TubeGeometryBuilder::setShaderFeatures( osg::Group* tubeGroup, unsigned int features )
+{
+	TubeNodeData* data = TubeNodeData::get( tubeGroup );
+	if( !data || !data->cylinder.valid() || !data->line.valid() )
+		return;
+
+	data->shaderFeatures = features;
+	osg::Program* cylinderProgram = data->cpuMesh ?
+		TubeShaders::getProgram( TubeShaders::MESH, features & ~TubeShaders::COMPACT ) :
+		TubeShaders::getProgram( TubeShaders::TUBE, features, data->patchVertices );
+	data->cylinder->getOrCreateStateSet()->setAttributeAndModes( cylinderProgram, osg::StateAttribute::ON );
+	data->line->getOrCreateStateSet()->setAttributeAndModes( TubeShaders::getProgram( TubeShaders::LINE, features ),
+		osg::StateAttribute::ON );
 }
 
-void TubeGeometryBuilder::createShaderStuff()
+osg::Program* TubeGeometryBuilder::getTubeProgram( unsigned int patchVertices, bool compact, bool fluxTable )
 {
-	s_cylProgram = new osg::Program;
-	s_cylVertObj = new osg::Shader( osg::Shader::VERTEX );
-	s_cylFragObj = new osg::Shader( osg::Shader::FRAGMENT );
-	s_cylControlObj = new osg::Shader( osg::Shader::TESSCONTROL );
-    s_cylEvalObj = new osg::Shader( osg::Shader::TESSEVALUATION );
-	s_cylProgram->addShader( s_cylFragObj );
-	s_cylProgram->addShader( s_cylVertObj );
-	s_cylProgram->addShader( s_cylControlObj );
-	s_cylProgram->addShader( s_cylEvalObj );
+	return TubeShaders::getProgram( TubeShaders::TUBE, ( compact ? TubeShaders::COMPACT : 0 ) |
+		( fluxTable ? TubeShaders::FLUX_TABLE : 0 ), patchVertices );
+}
 
-	s_cylProgram->addBindAttribLocation( "Normal", 2 );
-	s_cylProgram->addBindAttribLocation( "Binormal", 3 );
-	s_cylProgram->addBindAttribLocation( "distanceTo0", 6 );
+osg::Program* TubeGeometryBuilder::getLineProgram( bool compact, bool fluxTable )
+{
+	return TubeShaders::getProgram( TubeShaders::LINE, ( compact ? TubeShaders::COMPACT : 0 ) |
+		( fluxTable ? TubeShaders::FLUX_TABLE : 0 ) );
+}
 
-	LoadShaderSource( s_cylVertObj, "shaders/tube.vert" );
-	LoadShaderSource( s_cylFragObj, "shaders/tube.frag" );
-	LoadShaderSource( s_cylControlObj, "shaders/tube.control" );
-	LoadShaderSource( s_cylEvalObj, "shaders/tube.eval" );
+osg::Program* TubeGeometryBuilder::getMeshProgram( bool fluxTable )
+{
+	return TubeShaders::getProgram( TubeShaders::MESH, fluxTable ? TubeShaders::FLUX_TABLE : 0 );
 }
 
-void TubeGeometryBuilder::setTrajectory( std::vector<osg::Vec3> trajectory, float verticalScale,
+osg::Program* TubeGeometryBuilder::getBatchProgram( unsigned int patchVertices )
+{
+	return TubeShaders::getProgram( TubeShaders::TUBE, TubeShaders::BATCH, patchVertices );
+}
+
+void TubeGeometryBuilder::setTrajectory( const std::vector<osg::Vec3>& trajectory, float verticalScale,
+						float curveTolerance )
+{
+	setTrajectory( TrajectoryView::fromVector( trajectory ), verticalScale, curveTolerance );
+}
+
+void TubeGeometryBuilder::setTrajectory( const TrajectoryView& trajectory, float verticalScale,
 						float curveTolerance )
 {
 	_sections.clear();
+	osg::Timer_t start = osg::Timer::instance()->tick();
+
+	// A cached trajectory has no frame propagation state to go on from
+	_sectionsCached = false;
+	if( _sectionCache.valid() )
+	{
+		_cacheKey = TubeSectionCache::computeKey( trajectory, verticalScale, curveTolerance );
+		_sectionsCached = _sectionCache->load( _cacheKey, _sections, &_cacheFile );
+	}
+
+	if( _sectionsCached )
+		_streamValid = false;
+	else
+	{
+		_stream.reset( verticalScale, curveTolerance );
+		_stream.append( trajectory, _sections );
+		_streamValid = true;
+
+		if( _sectionCache.valid() )
+			_sectionCache->store( _cacheKey, _sections );
+	}
+
+	TubeBuildStats stats;
+	stats.inputPoints = trajectory.numPoints;
+	stats.sections = _sections.size();
+	stats.frameTime = osg::Timer::instance()->delta_m( start, osg::Timer::instance()->tick() );
+	_lastStats = stats;
+	_totalStats.add( stats );
+}
+
+void TubeGeometryBuilder::countGeometry( osg::Geometry* geometry, unsigned int patchVertices, double packTime )
+{
+	TubeBuildStats stats;
+	stats.packTime = packTime;
+	stats.countGeometry( geometry, patchVertices, _sections.size() );
+	_lastStats.add( stats );
+	_totalStats.add( stats );
+}
+
+void TubeGeometryBuilder::setSectionCache( TubeSectionCache* cache )
+{
+	_sectionCache = cache;
+	_sectionsCached = false;
+	_cacheFile.close();
+}
+
+// Grows \array to \capacity elements, the spare ones repeating the last element, its buffer object is loaded again
+template<class ArrayT>
+static void growArray( ArrayT* array, unsigned int capacity )
+{
+	array->resize( capacity, array->back() );
+	array->dirty();
+}
+
+// Writes \values, but the first \skip ones, over \array from \first on
+template<class ArrayT>
+static void writeArray( ArrayT* array, const ArrayT* values, unsigned int first, unsigned int skip = 0 )
+{
+	std::copy( values->begin() + skip, values->end(), array->begin() + first );
+}
+
+bool TubeGeometryBuilder::appendTrajectory( const TrajectoryView& points, osg::Group* tubeGroup )
+{
+	if( !_streamValid )
+	{
+		osg::notify(osg::WARN) << "appendTrajectory needs a trajectory set by setTrajectory." << std::endl;
+		return false;
+	}
+
+	// The provisional last section is replaced, the ones before it do not change
+	unsigned int firstChangedSection = _stream.hasProvisionalSection() ? _sections.size() - 1 : _sections.size();
+	unsigned int numSections = _sections.size();
+	osg::Timer_t start = osg::Timer::instance()->tick();
+	_stream.append( points, _sections );
+	osg::Timer_t framesDone = osg::Timer::instance()->tick();
+
+	TubeBuildStats stats;
+	stats.inputPoints = points.numPoints;
+	stats.sections = _sections.size() - numSections;
+	stats.frameTime = osg::Timer::instance()->delta_m( start, framesDone );
+
+	TubeNodeData* data = tubeGroup ? TubeNodeData::get( tubeGroup ) : NULL;
+	if( !data || _sections.empty() )
+	{
+		_lastStats = stats;
+		_totalStats.add( stats );
+		return true;
+	}
+
+	if( data->segmentBVH.valid() )
+		data->segmentBVH->updateTube( data->segmentBVHId, _sections, firstChangedSection );
 
-	int numPointsInCurve = trajectory.size();
+	// The pixel size switch depends on the tube bound, which grows with the tube
+	osg::LOD* lod = tubeGroup->getNumChildren() > 0 ? dynamic_cast<osg::LOD*>( tubeGroup->getChild( 0 ) ) : NULL;
+
+	if( data->cpuMesh )
+	{
+		TubeMeshBuilder::updateGeometry( data->geometry.get(), data->lineGeometry.get(), _sections, firstChangedSection,
+			data->radius, data->meshSettings );
+		if( lod )
+			setLODRanges( lod, data );
+		recordAppendStats( stats, data, framesDone );
+		return true;
+	}
+
+	// Sections out of the range of their block encode that block again, the other blocks are kept
+	// unless the tube outgrows its block size
+	unsigned int firstVertex = firstChangedSection;
+	if( data->compact )
+	{
+		firstVertex = TubeVertexCodec::updateBlocks( _sections, firstChangedSection, data->positionBlocks );
+		data->positionBlocks.apply( data->geometry->getOrCreateStateSet() );
+	}
+	repackVertices( data, firstVertex );
+
+	// The patches reaching the changed sections are made again, padding included
+	layoutChunks( data, TubePatchLayout::firstPatchOfSection( firstChangedSection, data->patchVertices ) );
+	if( lod )
+		setLODRanges( lod, data );
+
+	recordAppendStats( stats, data, framesDone );
+	return true;
+}
+
+void TubeGeometryBuilder::repackVertices( TubeNodeData* data, unsigned int firstVertex )
+{
+	osg::Geometry* geo = data->geometry.get();
+	osg::FloatArray* distanceTo0 = static_cast<osg::FloatArray*>( geo->getVertexAttribArray( 6 ) );
+	unsigned int numVertices = _sections.size();
+
+	// Only a tube outgrowing its arrays reallocates their buffer objects, the spare capacity is not drawn
+	bool grown = numVertices > data->capacity;
+	if( grown )
+		data->capacity = std::max( numVertices, data->capacity * 2 );
+
+	// The changed sections are packed apart, their distance going on from the vertex before them,
+	// then written in place, so the vertices before them are not touched
+	osg::ref_ptr<osg::FloatArray> newDistances = new osg::FloatArray;
+	unsigned int skip = firstVertex > 0 ? 1 : 0;
+	if( skip )
+		newDistances->push_back( ( *distanceTo0 )[firstVertex - 1] );
+	if( data->compact )
+	{
+		osg::Vec4sArray* pos = static_cast<osg::Vec4sArray*>( geo->getVertexArray() );
+		osg::Vec4sArray* frames = static_cast<osg::Vec4sArray*>( geo->getVertexAttribArray( 4 ) );
+		osg::ref_ptr<osg::Vec4sArray> newPos = new osg::Vec4sArray;
+		osg::ref_ptr<osg::Vec4sArray> newFrames = new osg::Vec4sArray;
+		packCompactSectionVertices( _sections, data->positionBlocks, newPos.get(), newFrames.get(), newDistances.get(),
+			firstVertex );
+		if( grown )
+		{
+			growArray( pos, data->capacity );
+			growArray( frames, data->capacity );
+		}
+		writeArray( pos, newPos.get(), firstVertex );
+		writeArray( frames, newFrames.get(), firstVertex );
+	}
+	else
+	{
+		osg::Vec3Array* pos = static_cast<osg::Vec3Array*>( geo->getVertexArray() );
+		osg::Vec3Array* nor = static_cast<osg::Vec3Array*>( geo->getVertexAttribArray( 2 ) );
+		osg::Vec3Array* bin = static_cast<osg::Vec3Array*>( geo->getVertexAttribArray( 3 ) );
+
+		osg::ref_ptr<osg::Vec3Array> newPos = new osg::Vec3Array;
+		osg::ref_ptr<osg::Vec3Array> newNor = new osg::Vec3Array;
+		osg::ref_ptr<osg::Vec3Array> newBin = new osg::Vec3Array;
+		packSectionVertices( _sections, newPos.get(), newNor.get(), newBin.get(), newDistances.get(), NULL, 0.0f, firstVertex );
+		if( grown )
+		{
+			growArray( pos, data->capacity );
+			growArray( nor, data->capacity );
+			growArray( bin, data->capacity );
+		}
+		writeArray( pos, newPos.get(), firstVertex );
+		writeArray( nor, newNor.get(), firstVertex );
+		writeArray( bin, newBin.get(), firstVertex );
+	}
+	if( grown )
+		growArray( distanceTo0, data->capacity );
+	writeArray( distanceTo0, newDistances.get(), firstVertex, skip );
+
+	data->numVertices = numVertices;
+	data->vertexSubload->dirtyVertices( firstVertex, numVertices );
+
+	for( unsigned int i = 0; i < data->draws.size(); i++ )
+		data->draws[i]->setCount( data->numVertices );
+}
+
+void TubeGeometryBuilder::layoutChunks( TubeNodeData* data, unsigned int firstPatch )
+{
+	unsigned int numPatches = TubePatchLayout::getNumPatches( _sections.size(), data->patchVertices );
+	// A tube that is not chunked is a single chunk of every patch
+	unsigned int patchesPerChunk = data->patchesPerChunk > 0 ? data->patchesPerChunk : std::max( numPatches, 1u );
+	unsigned int numChunks = std::max( ( numPatches + patchesPerChunk - 1 ) / patchesPerChunk, 1u );
+
+	// The chunks before the one holding firstPatch keep their patches
+	for( unsigned int chunk = std::min( firstPatch / patchesPerChunk, numChunks - 1 ); chunk < numChunks; chunk++ )
+	{
+		if( chunk >= data->chunks.size() )
+		{
+			osg::Geometry* geo = makeChunkGeometry( data->geometry.get(), data->radius, data->vertexSubload.get() );
+			data->chunks.push_back( geo );
+			data->cylinder->addDrawable( geo );
+		}
+
+		unsigned int chunkFirstPatch = chunk * patchesPerChunk;
+		unsigned int firstChanged = std::max( firstPatch, chunkFirstPatch );
+		unsigned int firstChangedIndex = ( firstChanged - chunkFirstPatch ) * data->patchVertices;
+		osg::Geometry* geo = data->chunks[chunk].get();
+		osg::DrawElementsUInt* patches = static_cast<osg::DrawElementsUInt*>( geo->getPrimitiveSet( 0 ) );
+		patches->resize( std::min<size_t>( patches->size(), firstChangedIndex ) );
+		TubePatchLayout::appendIndices( patches, 0, _sections.size(), data->patchVertices, firstChanged,
+			chunkFirstPatch + patchesPerChunk );
+		patches->dirty();
+
+		// The bound only adds the changed patches
+		TubeBoundCallback* bound = dynamic_cast<TubeBoundCallback*>( geo->getComputeBoundingBoxCallback() );
+		if( bound )
+			bound->dirtyIndices( firstChangedIndex );
+		geo->dirtyBound();
+	}
+
+	// A shorter tube, built again by updateTube, needs fewer chunks
+	if( data->chunks.size() > numChunks )
+	{
+		data->cylinder->removeDrawables( numChunks, data->chunks.size() - numChunks );
+		data->chunks.resize( numChunks );
+	}
+}
+
+void TubeGeometryBuilder::recordAppendStats( TubeBuildStats& stats, TubeNodeData* data, osg::Timer_t packStart )
+{
+	stats.packTime = osg::Timer::instance()->delta_m( packStart, osg::Timer::instance()->tick() );
+	_totalStats.add( stats );
+
+	// The geometry counters describe the whole tube, without its spare capacity
+	unsigned int inputPoints = stats.inputPoints;
+	unsigned int sections = stats.sections;
+	stats.countGeometry( data->geometry.get(), data->cpuMesh ? 0 : data->patchVertices, _sections.size() );
+	if( !data->cpuMesh )
+	{
+		// The compact frame is counted as normals
+		osg::Geometry* geo = data->geometry.get();
+		osg::Array* frames = geo->getVertexAttribArray( data->compact ? 4 : 2 );
+		stats.vertices = data->numVertices;
+		stats.positionBytes = geo->getVertexArray()->getElementSize() * data->numVertices;
+		stats.normalBytes = frames->getElementSize() * data->numVertices;
+		stats.binormalBytes = data->compact ? 0 : sizeof( osg::Vec3 ) * data->numVertices;
+		stats.distanceBytes = sizeof( float ) * data->numVertices;
+
+		// The patches are spread over the chunks
+		unsigned int indices = 0;
+		for( unsigned int i = 0; i < data->chunks.size(); i++ )
+			indices += data->chunks[i]->getPrimitiveSet( 0 )->getNumIndices();
+		stats.indices = indices;
+		stats.indexBytes = sizeof( GLuint ) * indices;
+		stats.patches = indices / data->patchVertices;
+		stats.repeatedIndices = indices > _sections.size() ? indices - _sections.size() : 0;
+	}
+	stats.inputPoints = inputPoints;
+	stats.sections = sections;
+	_lastStats = stats;
+}
+
+namespace {
+template<typename TrajectoryT>
+class BulkSectionTask : public TubeWorkerPool::Task
+{
+public:
+	BulkSectionTask( const std::vector<TrajectoryT>& trajectories,
+		std::vector< std::vector<TubeGeometryBuilder::Section> >& sections, float verticalScale, float curveTolerance ) :
+		_trajectories( trajectories ), _sections( sections ), _verticalScale( verticalScale ), _curveTolerance( curveTolerance )
+	{
+	}
+
+	virtual void run( unsigned int index, unsigned int )
+	{
+		TubeGeometryBuilder::buildSections( _trajectories[index], _sections[index], _verticalScale, _curveTolerance );
+	}
+
+private:
+	const std::vector<TrajectoryT>& _trajectories;
+	std::vector< std::vector<TubeGeometryBuilder::Section> >& _sections;
+	float _verticalScale;
+	float _curveTolerance;
+};
+}
+
+void TubeGeometryBuilder::buildSectionsBulk( const std::vector< std::vector<osg::Vec3> >& trajectories,
+	std::vector< std::vector<Section> >& sections, float verticalScale, float curveTolerance, TubeWorkerPool* pool )
+{
+	// Sized before the loop, each task only writes its own entry
+	sections.resize( trajectories.size() );
+
+	BulkSectionTask< std::vector<osg::Vec3> > task( trajectories, sections, verticalScale, curveTolerance );
+	( pool ? pool : TubeWorkerPool::instance() )->parallelFor( trajectories.size(), task );
+}
+
+void TubeGeometryBuilder::buildSectionsBulk( const std::vector<TrajectoryView>& trajectories,
+	std::vector< std::vector<Section> >& sections, float verticalScale, float curveTolerance, TubeWorkerPool* pool )
+{
+	sections.resize( trajectories.size() );
+
+	BulkSectionTask<TrajectoryView> task( trajectories, sections, verticalScale, curveTolerance );
+	( pool ? pool : TubeWorkerPool::instance() )->parallelFor( trajectories.size(), task );
+}
+
+void TubeGeometryBuilder::buildSections( const std::vector<osg::Vec3>& trajectory, std::vector<Section>& sections,
+	float verticalScale, float curveTolerance )
+{
+	TubeFrameKernel::buildSections( TrajectoryView::fromVector( trajectory ), verticalScale, curveTolerance, sections );
+}
+
+void TubeGeometryBuilder::buildSections( const TrajectoryView& trajectory, std::vector<Section>& sections,
+	float verticalScale, float curveTolerance )
+{
+	TubeFrameKernel::buildSections( trajectory, verticalScale, curveTolerance, sections );
+}
+
+void TubeGeometryBuilder::buildReferenceSections( const std::vector<osg::Vec3>& trajectory, std::vector<Section>& sections,
+	float verticalScale, float curveTolerance )
+{
+	sections.clear();
 
-	// Scales vertically the original trajectory
 	std::vector<osg::Vec3> scaledTraj;
-	scaledTraj.reserve( numPointsInCurve );
-	for( int i = 0; i < numPointsInCurve; i++ )
+	scaledTraj.reserve( trajectory.size() );
+	for( size_t i = 0; i < trajectory.size(); i++ )
 		scaledTraj.push_back( osg::Vec3( trajectory[i].x(), trajectory[i].y(), trajectory[i].z() * verticalScale ) );
 
-	// The first point must be included
-	osg::Vec3 tangent = scaledTraj[0] - scaledTraj[1];
-	int secondPointIndex = 1;
-	for(; tangent.length2() == 0; secondPointIndex++ )
-		tangent = scaledTraj[0] - scaledTraj[secondPointIndex];
-	TubeSectionBuilder firstPointBuilder = TubeSectionBuilder::getFirstPoint( scaledTraj[0], 
-																			  scaledTraj[secondPointIndex] );
-	
-	_sections.push_back( firstPointBuilder.getSection() );
+	// The first point must be included, its tangent goes towards the first point that differs from it
+	unsigned int secondPointIndex = 1;
+	while( secondPointIndex < scaledTraj.size() && ( scaledTraj[0] - scaledTraj[secondPointIndex] ).length2() == 0 )
+		secondPointIndex++;
+	if( secondPointIndex >= scaledTraj.size() )
+		return;
 
-	TubeSectionBuilder previousPoint = firstPointBuilder;
+	TubeSectionBuilder previousPoint = TubeSectionBuilder::getFirstPoint( scaledTraj[0], scaledTraj[secondPointIndex] );
+	sections.push_back( previousPoint.getSection() );
 
-	for( int i = secondPointIndex; i < numPointsInCurve-1; i++ ) // Do not operate on the first or the last point
+	for( unsigned int i = secondPointIndex; i + 1 < scaledTraj.size(); i++ ) // Do not operate on the first or the last point
 	{
 		TubeSectionBuilder currPointBuilder( scaledTraj[i], scaledTraj[i+1] );
-
 		if( currPointBuilder.buildNewPoint( previousPoint, curveTolerance ) )
-		{	
-			_sections.push_back( currPointBuilder.getSection() );
-
-			// reset the previousPoint
+		{
+			sections.push_back( currPointBuilder.getSection() );
 			previousPoint = currPointBuilder;
 		}
 	}
+
 	// last point needs to be included always
-	osg::Vec3 last = scaledTraj[numPointsInCurve-1];
-	osg::Vec3 beforeLast = scaledTraj[numPointsInCurve-2];
-	osg::Vec3 afterLast = last + last - beforeLast;
-	TubeSectionBuilder lastPointBuilder( last, afterLast );
+	osg::Vec3 last = scaledTraj.back();
+	osg::Vec3 beforeLast = scaledTraj[scaledTraj.size() - 2];
+	TubeSectionBuilder lastPointBuilder( last, last + last - beforeLast );
 	lastPointBuilder.buildNewPoint( previousPoint, curveTolerance );
-	_sections.push_back( lastPointBuilder.getSection() );
+	sections.push_back( lastPointBuilder.getSection() );
 }
 
-osg::Geometry* TubeGeometryBuilder::makeCylinderGeometry( double radius, osg::Vec4 color, int numRadialVertices )
+void TubeGeometryBuilder::packSectionVertices( const std::vector<Section>& sections, osg::Vec3Array* pos, osg::Vec3Array* nor,
+	osg::Vec3Array* bin, osg::FloatArray* distanceTo0, osg::FloatArray* tubeIds, float tubeId, unsigned int firstSection )
 {
-	if( _sections.size() < 1 )
-		throw std::exception( "Trajectory has not been set" );
-	
-	osg::Vec3Array* pos = new osg::Vec3Array;
-	osg::Vec3Array* nor = new osg::Vec3Array;
-	osg::Vec3Array* bin = new osg::Vec3Array;
+	if( firstSection >= sections.size() )
+		return;
 
-	osg::FloatArray* distanceTo0 = new osg::FloatArray;
-	float uIncrement = 1.0f / numRadialVertices;
 	float currentDistanceTo0 = 0;
-	osg::Vec3 lastPosition = _sections[0].position;
+	osg::Vec3 lastPosition = sections[0].position;
+	if( firstSection > 0 )
+	{
+		currentDistanceTo0 = distanceTo0->back();
+		lastPosition = sections[firstSection - 1].position;
+	}
 
-	int numSections = 0;
-	for( int i = 0; i < _sections.size(); i++ )
+	for( unsigned int i = firstSection; i < sections.size(); i++ )
 	{
-		Section& section = _sections[i];
+		const Section& section = sections[i];
+
+		// Calculate current section's distance to first point and save it for flux animation
+		osg::Vec3 lastSegment = section.position - lastPosition;
+		currentDistanceTo0 += lastSegment.length();
+		lastPosition = section.position;
+
 		pos->push_back( section.position );
 		nor->push_back( section.normal );
 		bin->push_back( section.binormal );
+		distanceTo0->push_back( currentDistanceTo0 );
+		if( tubeIds )
+			tubeIds->push_back( tubeId );
+	}
+}
 
-		numSections++;
+void TubeGeometryBuilder::packCompactSectionVertices( const std::vector<Section>& sections, const TubeVertexCodec::Blocks& blocks,
+	osg::Vec4sArray* pos, osg::Vec4sArray* frames, osg::FloatArray* distanceTo0, unsigned int firstSection )
+{
+	if( firstSection >= sections.size() )
+		return;
 
-		if( numSections > 0 && numSections % 32 == 0 )
-		{
-			pos->push_back( section.position );
-			nor->push_back( section.normal );
-			bin->push_back( section.binormal );
-			numSections++;
-		}
+	float currentDistanceTo0 = 0;
+	osg::Vec3 lastPosition = sections[0].position;
+	if( firstSection > 0 )
+	{
+		currentDistanceTo0 = distanceTo0->back();
+		lastPosition = sections[firstSection - 1].position;
+	}
 
-		// Calculate current section's distance to first point and save it for flux animation
+	for( unsigned int i = firstSection; i < sections.size(); i++ )
+	{
+		const Section& section = sections[i];
+
+		// The distance is measured on the exact positions, as in packSectionVertices
 		osg::Vec3 lastSegment = section.position - lastPosition;
 		currentDistanceTo0 += lastSegment.length();
-		distanceTo0->push_back( currentDistanceTo0 );
 		lastPosition = section.position;
+
+		unsigned int block = blocks.getBlock( i );
+		pos->push_back( TubeVertexCodec::encodePosition( section.position, blocks.ranges[block], block ) );
+		frames->push_back( TubeVertexCodec::encodeFrame( section.normal, section.binormal ) );
+		distanceTo0->push_back( currentDistanceTo0 );
+	}
+}
+
+osg::Geometry* TubeGeometryBuilder::makeCylinderGeometry( double radius, osg::Vec4 color, int numRadialVertices,
+	unsigned int patchVertices, TubeVertexCodec::Blocks* positionBlocks )
+{
+	if( _sections.size() < 1 )
+		throw std::runtime_error( "Trajectory has not been set" );
+	
+	osg::Timer_t start = osg::Timer::instance()->tick();
+
+	// The arrays of a replaced tube are filled again, keeping their memory and buffer objects
+	TubeArrayPool::Arrays arrays;
+	if( !_arrayPool.acquire( _compactVertices, _sections.size(), arrays ) )
+	{
+		arrays.compact = _compactVertices;
+		arrays.distanceTo0 = new osg::FloatArray;
+		if( _compactVertices )
+		{
+			arrays.position = new osg::Vec4sArray;
+			arrays.frame = new osg::Vec4sArray;
+		}
+		else
+		{
+			arrays.position = new osg::Vec3Array;
+			arrays.normal = new osg::Vec3Array;
+			arrays.binormal = new osg::Vec3Array;
+		}
 	}
+	osg::FloatArray* distanceTo0 = arrays.distanceTo0.get();
+	distanceTo0->dirty();
+
+	osg::DrawElementsUInt* patches = new osg::DrawElementsUInt( osg::PrimitiveSet::PATCHES );
+	patches->setDataVariance( osg::Object::DYNAMIC );
+	TubePatchLayout::appendIndices( patches, 0, _sections.size(), patchVertices );
 
 	osg::Geometry* geo = new osg::Geometry();
-	geo->setVertexArray(pos);
-	geo->addPrimitiveSet(new osg::DrawArrays(osg::PrimitiveSet::PATCHES,0,numSections));
-	geo->setVertexAttribArray( 2, nor ); 
-	geo->setVertexAttribBinding( 2, osg::Geometry::BIND_PER_VERTEX );
-	geo->setVertexAttribArray( 3, bin ); 
-	geo->setVertexAttribBinding( 3, osg::Geometry::BIND_PER_VERTEX );
+	geo->setUseDisplayList( false );
+	geo->setUseVertexBufferObjects( true );
+	geo->addPrimitiveSet( patches );
+	if( _compactVertices )
+	{
+		osg::Vec4sArray* pos = static_cast<osg::Vec4sArray*>( arrays.position.get() );
+		osg::Vec4sArray* frames = arrays.frame.get();
+		pos->dirty();
+		frames->dirty();
+		TubeVertexCodec::Blocks blocks = TubeVertexCodec::computeBlocks( _sections );
+		packCompactSectionVertices( _sections, blocks, pos, frames, distanceTo0 );
+		blocks.apply( geo->getOrCreateStateSet() );
+		if( positionBlocks )
+			*positionBlocks = blocks;
+
+		geo->setVertexArray( pos );
+		geo->setVertexAttribArray( 4, frames );
+		geo->setVertexAttribBinding( 4, osg::Geometry::BIND_PER_VERTEX );
+	}
+	else
+	{
+		osg::Vec3Array* pos = static_cast<osg::Vec3Array*>( arrays.position.get() );
+		osg::Vec3Array* nor = arrays.normal.get();
+		osg::Vec3Array* bin = arrays.binormal.get();
+		pos->dirty();
+		nor->dirty();
+		bin->dirty();
+		// The cache file holds the vertex arrays of its sections, they are copied without being packed again
+		if( !_sectionsCached || !TubeSectionCache::loadArrays( _cacheFile, _cacheKey, pos, nor, bin, distanceTo0 ) )
+			packSectionVertices( _sections, pos, nor, bin, distanceTo0 );
+
+		geo->setVertexArray(pos);
+		geo->setVertexAttribArray( 2, nor ); 
+		geo->setVertexAttribBinding( 2, osg::Geometry::BIND_PER_VERTEX );
+		geo->setVertexAttribArray( 3, bin ); 
+		geo->setVertexAttribBinding( 3, osg::Geometry::BIND_PER_VERTEX );
+	}
 	geo->setVertexAttribArray( 6, distanceTo0 ); 
 	geo->setVertexAttribBinding( 6, osg::Geometry::BIND_PER_VERTEX );
+
+	// The arrays go back to the pool when the tube is built again, and the next tube refills them at
+	// once, appendTrajectory writes them in place. With DrawThreadPerContext the draw of the previous
+	// frame may still read them, a DYNAMIC geometry holds the next frame until it is drawn. Every
+	// geometry reading the arrays must be DYNAMIC.
+	geo->setDataVariance( osg::Object::DYNAMIC );
+	geo->getVertexArray()->setDataVariance( osg::Object::DYNAMIC );
+	static const unsigned int attributes[] = { 2, 3, 4, 6 };
+	for( unsigned int i = 0; i < 4; i++ )
+	{
+		if( geo->getVertexAttribArray( attributes[i] ) )
+			geo->getVertexAttribArray( attributes[i] )->setDataVariance( osg::Object::DYNAMIC );
+	}
+
+	geo->setComputeBoundingBoxCallback( new TubeBoundCallback( radius ) );
+
+	countGeometry( geo, patchVertices, osg::Timer::instance()->delta_m( start, osg::Timer::instance()->tick() ) );
 	return geo;
 }
 
+osg::Geometry* TubeGeometryBuilder::makeLineGeometry( osg::Geometry* cylinderGeometry )
+{
+	osg::Geometry* geo = new osg::Geometry();
+	// Reads the pooled arrays, see makeCylinderGeometry
+	geo->setDataVariance( osg::Object::DYNAMIC );
+	geo->setUseDisplayList( false );
+	geo->setUseVertexBufferObjects( true );
+
+	// One vertex per section, the patches are made by indices
+	geo->setVertexArray( cylinderGeometry->getVertexArray() );
+	osg::DrawArrays* strip = new osg::DrawArrays( osg::PrimitiveSet::LINE_STRIP, 0,
+		cylinderGeometry->getVertexArray()->getNumElements() );
+	// Its count follows the tube as it grows
+	strip->setDataVariance( osg::Object::DYNAMIC );
+	geo->addPrimitiveSet( strip );
+	geo->setVertexAttribArray( 6, cylinderGeometry->getVertexAttribArray( 6 ) );
+	geo->setVertexAttribBinding( 6, osg::Geometry::BIND_PER_VERTEX );
+	// The blocks of the compact positions
+	geo->setStateSet( cylinderGeometry->getStateSet() );
+	return geo;
+}
\ No newline at end of file
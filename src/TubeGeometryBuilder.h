@@ -6,15 +6,36 @@
 #include <osg/Group>
 #include <osg/Geode>
 #include <osg/Geometry>
+#include <osg/LOD>
+#include <osg/Program>
+#include <osg/Timer>
+
+#include "MappedFile.h"
+#include "TrajectoryView.h"
+#include "TubeSection.h"
+#include "TubeArrayPool.h"
+#include "TubeBuildStats.h"
+#include "TubeFrameKernel.h"
+#include "TubeMeshBuilder.h"
+#include "TubePatchLayout.h"
+#include "TubeSectionCache.h"
+#include "TubeSegmentBVH.h"
+#include "TubeShaders.h"
+#include "TubeStyleTable.h"
+#include "TubeTessellation.h"
+#include "TubeVertexCodec.h"
+#include "TubeVertexSubload.h"
 
 #include <cassert>
 #include <iostream>
+#include <vector>
 
 namespace co {
 typedef int int32;
 }
 
 class Section;
+class TubeWorkerPool;
 
 class TimeUpdate: public osg::Uniform::Callback
 {
@@ -44,6 +65,16 @@ private:
 	float _updateSpeed;
 };
 
+// Feeds the animation time in seconds to the batched tubes, which compute their flux offset in the shader.
+class FluxTimeCallback: public osg::Uniform::Callback
+{
+    public:
+        virtual void operator() ( osg::Uniform* uniform, osg::NodeVisitor* nv )
+        {
+			uniform->set( static_cast<float>( nv->getFrameStamp()->getReferenceTime() ) );
+        }
+};
+
 class MVPInverseCallback: public osg::Uniform::Callback
 {
     public:
@@ -81,6 +112,64 @@ private:
 	::osg::Camera* _cam;
 };
 
+/*
+	Attached as user data to the groups built by createTubeWithLOD, so the tube can be updated later
+	without being rebuilt. The vertex arrays are kept \capacity vertices long, the tail past
+	\numVertices is not drawn, so growing the tube does not resize the buffer objects.
+*/
+class TubeNodeData : public osg::Referenced
+{
+public:
+	TubeNodeData() : compact( false ), patchesPerChunk( 0 ), patchVertices( TubePatchLayout::DEFAULT_PATCH_VERTICES ), numVertices( 0 ), capacity( 0 ),
+		cpuMesh( false ), radius( 0.0f ), fluxTableId( 0 ), shaderFeatures( 0 ), segmentBVHId( 0 ) {}
+
+	static TubeNodeData* get( osg::Node* tubeGroup ) { return dynamic_cast<TubeNodeData*>( tubeGroup->getUserData() ); }
+
+	//! Owner of the vertex arrays, which are shared by every chunk.
+	osg::ref_ptr<osg::Geometry> geometry;
+	//! Set when the arrays use the TubeVertexCodec layout, its blocks are in the StateSet of geometry too.
+	bool compact;
+	TubeVertexCodec::Blocks positionBlocks;
+	/*
+		Drawables of the tube, each one with the patch indices of a chunk, see TubePatchLayout.
+		The first one is geometry. Tubes that are not chunked have a single chunk.
+	*/
+	std::vector< osg::ref_ptr<osg::Geometry> > chunks;
+	//! Patches per chunk, 0 when the tube is not chunked.
+	unsigned int patchesPerChunk;
+	//! Geode of the chunks, appends add the new chunks to it.
+	osg::ref_ptr<osg::Geode> cylinder;
+	//! Geode of the line drawn when the tube is small on screen.
+	osg::ref_ptr<osg::Geode> line;
+	unsigned int patchVertices;
+	//! Draws over the tube vertices, their count follows numVertices.
+	std::vector< osg::ref_ptr<osg::DrawArrays> > draws;
+	unsigned int numVertices;
+	unsigned int capacity;
+	//! Draw callback of the chunks and the line, uploading the vertices written in place.
+	osg::ref_ptr<TubeVertexSubload> vertexSubload;
+
+	//! Set when the tube was made by the CPU mesh backend, whose arrays are updated by TubeMeshBuilder.
+	bool cpuMesh;
+	osg::ref_ptr<osg::Geometry> lineGeometry;
+	float radius;
+	TubeMeshBuilder::Settings meshSettings;
+
+	//! Table holding the colors and the flux of the tube in its row \fluxTableId, NULL for uniforms.
+	osg::ref_ptr<TubeStyleTable> fluxTable;
+	unsigned int fluxTableId;
+
+	//! TubeShaders::Feature flags of the programs of the tube.
+	unsigned int shaderFeatures;
+
+	//! Style given to createTubeWithLOD or updateTube, with the flux of the last enableOrChangeFlux or disableFlux.
+	TubeStyle style;
+
+	//! Hierarchy holding the segments of the tube as its tube \segmentBVHId, NULL if none.
+	osg::ref_ptr<TubeSegmentBVH> segmentBVH;
+	unsigned int segmentBVHId;
+};
+
 /*
 	This class gets a list of points and creates a proper tube/line geometry from it.
 	Additionaly, it may cull points from the trajectory if they are colinear.
@@ -88,6 +177,14 @@ private:
 class TubeGeometryBuilder
 {
 public:
+	enum Backend
+	{
+		//! Patches tessellated by the tube.control and tube.eval shaders, needs OpenGL 4.
+		TESSELLATION_SHADERS,
+		//! Triangle strips made on the CPU by TubeMeshBuilder.
+		CPU_MESH
+	};
+
 	/*
 		The instance of this class will reuse the same shaders for every tube built
 	*/
@@ -99,29 +196,136 @@ public:
 		how much rotation is accepted to have between 2 points. if set to a high value,
 		only the first and the last point will be used.
 	*/
-	void setTrajectory( std::vector<osg::Vec3> trajectory, float verticalScale = 1.0f, 
+	void setTrajectory( const std::vector<osg::Vec3>& trajectory, float verticalScale = 1.0f, 
 		float curveTolerance = 0.001f );
 
+	/*
+		Same as above, but the points are read in place from the caller memory, as float or double and
+		with any stride, and vertically scaled as they are read. Nothing is copied but the sections.
+	*/
+	void setTrajectory( const TrajectoryView& trajectory, float verticalScale = 1.0f, 
+		float curveTolerance = 0.001f );
+
+	/*
+		Appends points to the trajectory given to setTrajectory. Only the sections from the last accepted
+		frame on are computed. If \tubeGroup was created by createTubeWithLOD from this trajectory, its
+		vertex arrays are grown in place: only the vertices from the first changed section on are
+		rewritten and uploaded, see TubeVertexSubload, and the arrays keep spare capacity so their buffer
+		objects are not reallocated. The bound only adds the new patches. The patch indices of the last
+		chunk are uploaded again, chunk the tubes that grow, see setChunkPatches, to bound that cost.
+		Returns false if the sections were not computed by setTrajectory, e.g. set with setSections.
+
+		The arrays and the patch indices are written while the tube is in the scene. It relies on the
+		tube geometries, their arrays and their primitive sets being DYNAMIC, so with DrawThreadPerContext
+		the next frame waits for the draw of the previous one: call it between frames, e.g. from an update
+		callback, not from another thread while the viewer draws.
+	*/
+	bool appendTrajectory( const TrajectoryView& points, osg::Group* tubeGroup = NULL );
+
+	bool appendTrajectory( const std::vector<osg::Vec3>& points, osg::Group* tubeGroup = NULL )
+	{
+		return appendTrajectory( TrajectoryView::fromVector( points ), tubeGroup );
+	}
+
 	/*
 		This function creates a LOD node with a cylinder for close view and a line for far view.
 		\fluxColor is the color that of the "flowing" segments.
 		\fluxSpeed is how many times faster than 1 update per second the flux should be.
-		\numRadialVertices is the amount of vertices per section of the tube.
+		\numRadialVertices is the maximum amount of vertices per section of the tube, the tessellation
+		uses less of them when the tube is small on screen, see setTessellation.
+		\cam may be NULL when a TubeCameraUniforms installed above the tube provides the view uniforms,
+		which is much cheaper than per tube callbacks when there are many tubes or views.
 	*/
 	void createTubeWithLOD( osg::Group* tubeGroup, osg::Camera* cam, float radius, float minRadius,
 		osg::Vec4 color = osg::Vec4( 1,0,0,1 ), osg::Vec4 fluxColor = osg::Vec4( 1,1,1,1 ), bool fluxUp = true, 
 		float fluxSpeed = 20.0f, int fluxStep = 8, int numRadialVertices = 10, float lineWidth = 4.0f );
 
+	/*
+		Builds \tubeGroup, made by createTubeWithLOD, again from the current sections and the given style,
+		keeping its subgraph: the vertex arrays are rewritten in place and keep their capacity, so their
+		buffer objects are reused, the chunks are laid out again and only the uniforms whose value changed
+		are set. Editing the vertical scale, the tolerance or the radius of many tubes this way allocates
+		nothing once their arrays are large enough. The flux is enabled again, as createTubeWithLOD does.
+		Returns false without touching the tube if it was not made with the current backend, vertex layout
+		and flux table, createTubeWithLOD must build it then.
+	*/
+	bool updateTube( osg::Group* tubeGroup, float radius, float minRadius,
+		osg::Vec4 color = osg::Vec4( 1,0,0,1 ), osg::Vec4 fluxColor = osg::Vec4( 1,1,1,1 ), bool fluxUp = true,
+		float fluxSpeed = 20.0f, int fluxStep = 8, int numRadialVertices = 10, float lineWidth = 4.0f );
+
+	/*
+		Sets when the tubes made by createTubeWithLOD are replaced by lines. With
+		osg::LOD::DISTANCE_FROM_EYE_POINT the line is used beyond \switchValue world units from the eye.
+		With osg::LOD::PIXEL_SIZE_ON_SCREEN, the default, it is used when the tube diameter would be
+		less than \switchValue pixels, estimated from the pixel size of the tube bound. Default is 2 pixels.
+	*/
+	void setLODSwitch( osg::LOD::RangeMode rangeMode, float switchValue )
+	{
+		_lodRangeMode = rangeMode;
+		_lodSwitchValue = switchValue;
+	}
+
+	/*
+		Sets how finely createTubeWithLOD tubes are tessellated depending on their size on screen. The
+		maximum radial level is always the numRadialVertices given to createTubeWithLOD.
+	*/
+	void setTessellation( const TubeTessellation::Settings& settings )
+	{
+		_tessellation = settings;
+	}
+
+	/*
+		Sets how createTubeWithLOD makes the tube surface. With CPU_MESH, \meshSettings gives the
+		section stride, the radial vertices are the numRadialVertices given to createTubeWithLOD.
+	*/
+	void setBackend( Backend backend, const TubeMeshBuilder::Settings& meshSettings = TubeMeshBuilder::Settings() )
+	{
+		_backend = backend;
+		_meshSettings = meshSettings;
+	}
+
+	/*
+		Draws the tube in its color only. A tube whose flux is in a table, see setFluxTable, only has its
+		table row changed, so turning the flux of many tubes off touches no StateSet.
+	*/
 	static void disableFlux( osg::Group* lod )
 	{
+		TubeNodeData* data = TubeNodeData::get( lod );
+		if( data )
+			data->style.fluxEnabled = false;
+		if( data && data->fluxTable.valid() )
+		{
+			data->fluxTable->setFluxEnabled( data->fluxTableId, false );
+			return;
+		}
+
 		lod->getOrCreateStateSet()->removeUniform( "TimeUpdate" );
 		osg::Vec4 colorVec;
 		lod->getOrCreateStateSet()->getUniform( "color" )->get( colorVec );
 		lod->getOrCreateStateSet()->getUniform( "fluxColor" )->set( colorVec );
+
+		// The programs without the flux do not compute it per fragment
+		if( data )
+			setShaderFeatures( lod, data->shaderFeatures | TubeShaders::NO_FLUX );
 	}
 
 	static void enableOrChangeFlux( osg::Group* lod, bool fluxUp, float fluxSpeed, int fluxStep, ::osg::Vec4 color )
 	{
+		TubeNodeData* data = TubeNodeData::get( lod );
+		if( data )
+		{
+			data->style.fluxUp = fluxUp;
+			data->style.fluxSpeed = fluxSpeed;
+			data->style.fluxStep = fluxStep;
+			data->style.fluxColor = color;
+			data->style.fluxEnabled = true;
+		}
+		if( data && data->fluxTable.valid() )
+		{
+			data->fluxTable->setFlux( data->fluxTableId, fluxUp, fluxSpeed, fluxStep, color );
+			return;
+		}
+
 		osg::StateSet* lodSS = lod->getOrCreateStateSet();
 
 		osg::Uniform* oldUniform = lodSS->getUniform( "TimeUpdate" );
@@ -133,30 +337,223 @@ public:
 		lodSS->addUniform( timeUpdateUniform );
 		lodSS->getUniform( "fluxColor" )->set( color );
 		lodSS->getUniform( "fluxStep" )->set( static_cast<float>( fluxStep ) );
+
+		if( data )
+			setShaderFeatures( lod, data->shaderFeatures & ~TubeShaders::NO_FLUX );
 	}
 
-	osg::Geometry* makeCylinderGeometry( double radius, osg::Vec4 color, int numRadialVertices = 10 );
+	/*
+		Gives the tube \tubeGroup made by createTubeWithLOD the programs of the TubeShaders variant with
+		\features. The flags the tube layout needs, COMPACT and FLUX_TABLE, must be kept.
+	*/
+	static void setShaderFeatures( osg::Group* tubeGroup, unsigned int features );
 
-private:
+	//! Lights the tubes made by createTubeWithLOD, default is true. Unlit tubes use the cheaper programs.
+	void setLighting( bool lighting ) { _lighting = lighting; }
 
-	void createShaderStuff();
+	//! \positionBlocks receives the blocks of the compact layout, see setCompactVertices.
+	osg::Geometry* makeCylinderGeometry( double radius, osg::Vec4 color, int numRadialVertices = 10,
+		unsigned int patchVertices = TubePatchLayout::DEFAULT_PATCH_VERTICES, TubeVertexCodec::Blocks* positionBlocks = NULL );
 
-	struct Section
-	{
-		osg::Vec3 position;
-		osg::Vec3 normal;
-		osg::Vec3 binormal;
-	}; 
+	/*
+		Sets the patch size of the tubes made by createTubeWithLOD, 0 chooses it per tube with
+		TubePatchLayout::choosePatchSize. The shaders are compiled for the size in use.
+	*/
+	void setPatchVertices( unsigned int patchVertices ) { _patchVertices = patchVertices; }
+
+	/*
+		Splits the tubes made by createTubeWithLOD in chunks of \patchesPerChunk patches, each one a drawable
+		with its own bound, so the cull traversal skips the chunks out of the view and, with small feature
+		culling, the ones too small on screen. 0 keeps a single drawable per tube. The chunks share the vertex
+		arrays, so the flux goes on across them. Ignored by the CPU_MESH backend.
+	*/
+	void setChunkPatches( unsigned int patchesPerChunk ) { _chunkPatches = patchesPerChunk; }
+
+	/*
+		Makes the tubes of createTubeWithLOD and makeCylinderGeometry with the compact vertex layout of
+		TubeVertexCodec, 20 bytes per vertex instead of 40, at the cost of quantizing the positions to the
+		box of their block of sections. Ignored by the CPU_MESH backend.
+	*/
+	void setCompactVertices( bool compact ) { _compactVertices = compact; }
+
+	/*
+		Puts the colors and the flux of the tubes made by createTubeWithLOD in a row of \table instead of
+		per tube uniforms and callbacks. The flux is then animated by the single fluxTime uniform, and
+		disableFlux and enableOrChangeFlux only update the table. The table must be applied, see
+		TubeStyleTable::apply, to a StateSet above the tubes. NULL goes back to the uniforms.
+	*/
+	void setFluxTable( TubeStyleTable* table ) { _fluxTable = table; }
+
+	/*
+		Makes setTrajectory read the sections from \cache when it holds them, and store them otherwise.
+		makeCylinderGeometry then reads the vertex arrays of the cached sections straight from the file.
+		A trajectory read from the cache can not be continued by appendTrajectory. NULL disables it.
+	*/
+	void setSectionCache( TubeSectionCache* cache );
+
+	/*
+		Adds the tubes made by createTubeWithLOD to \bvh, for picking and proximity queries. A tube built
+		again keeps its id, appendTrajectory and updateTube refit it. NULL disables it.
+	*/
+	void setSegmentBVH( TubeSegmentBVH* bvh ) { _segmentBVH = bvh; }
+
+	TubeSegmentBVH* getSegmentBVH() { return _segmentBVH.get(); }
+
+	/*
+		Arrays of the tubes replaced by createTubeWithLOD, filled again by makeCylinderGeometry. See
+		TubeArrayPool::setMaxBytes to bound it, 0 disables it.
+	*/
+	TubeArrayPool& getArrayPool() { return _arrayPool; }
+
+	//! Counters of the last build, see TubeBuildStats.
+	const TubeBuildStats& getLastBuildStats() const { return _lastStats; }
+
+	//! Counters summed over every build since the builder was created or resetBuildStats was called.
+	const TubeBuildStats& getTotalBuildStats() const { return _totalStats; }
+
+	void resetBuildStats() { _lastStats.reset(); _totalStats.reset(); }
+
+	//! Line strip drawn with the tube_line shaders, sharing the vertex arrays of \cylinderGeometry.
+	static osg::Geometry* makeLineGeometry( osg::Geometry* cylinderGeometry );
+
+	typedef TubeSection Section;
+
+	//! Sections computed by the last setTrajectory call.
+	const std::vector<Section>& getSections() const { return _sections; }
+
+	//! Uses sections computed elsewhere, e.g. by buildSectionsBulk, instead of calling setTrajectory.
+	void setSections( const std::vector<Section>& sections ) { _sections = sections; _streamValid = false; _sectionsCached = false; }
+
+	/*
+		Computes the sections of a trajectory into \sections, the same way setTrajectory does.
+		It does not touch any builder state, so it can be called from any thread.
+	*/
+	static void buildSections( const std::vector<osg::Vec3>& trajectory, std::vector<Section>& sections,
+		float verticalScale = 1.0f, float curveTolerance = 0.001f );
+
+	static void buildSections( const TrajectoryView& trajectory, std::vector<Section>& sections,
+		float verticalScale = 1.0f, float curveTolerance = 0.001f );
+
+	/*
+		Computes the sections as setTrajectory did before TubeFrameKernel, with TubeSectionBuilder: acos
+		and a rotation matrix per accepted point. It is much slower, and kept to check the kernel
+		against it, see TubeFrameKernel for how far they differ.
+	*/
+	static void buildReferenceSections( const std::vector<osg::Vec3>& trajectory, std::vector<Section>& sections,
+		float verticalScale = 1.0f, float curveTolerance = 0.001f );
+
+	/*
+		Computes the sections of every trajectory in parallel. \sections[i] receives the sections of
+		\trajectories[i], and each result is exactly what buildSections gives for that trajectory,
+		whatever the number of threads. If \pool is NULL the shared TubeWorkerPool is used.
+	*/
+	static void buildSectionsBulk( const std::vector< std::vector<osg::Vec3> >& trajectories,
+		std::vector< std::vector<Section> >& sections, float verticalScale = 1.0f, float curveTolerance = 0.001f,
+		TubeWorkerPool* pool = NULL );
+
+	static void buildSectionsBulk( const std::vector<TrajectoryView>& trajectories,
+		std::vector< std::vector<Section> >& sections, float verticalScale = 1.0f, float curveTolerance = 0.001f,
+		TubeWorkerPool* pool = NULL );
+
+	/*
+		Appends one vertex per section to the arrays, the patches are made by TubePatchLayout indices.
+		\tubeIds, if not NULL, receives \tubeId once per appended vertex.
+		A \firstSection greater than 0 continues a tube whose arrays hold the vertices of the sections before it.
+	*/
+	static void packSectionVertices( const std::vector<Section>& sections, osg::Vec3Array* pos, osg::Vec3Array* nor,
+		osg::Vec3Array* bin, osg::FloatArray* distanceTo0,
+		osg::FloatArray* tubeIds = NULL, float tubeId = 0.0f, unsigned int firstSection = 0 );
+
+	/*
+		Appends one vertex per section to the arrays in the compact layout of TubeVertexCodec, the positions
+		encoded in the range of their block of \blocks. \firstSection works as in packSectionVertices.
+	*/
+	static void packCompactSectionVertices( const std::vector<Section>& sections, const TubeVertexCodec::Blocks& blocks,
+		osg::Vec4sArray* pos, osg::Vec4sArray* frames, osg::FloatArray* distanceTo0, unsigned int firstSection = 0 );
+
+	/*
+		Program of the tubes made by createTubeWithLOD, for patches of \patchVertices vertices.
+		\compact selects the variant reading the TubeVertexCodec layout, \fluxTable the one reading
+		the colors and the flux from a TubeStyleTable.
+	*/
+	static osg::Program* getTubeProgram( unsigned int patchVertices, bool compact = false, bool fluxTable = false );
+
+	//! Program of the lines drawn when the tubes are small on screen, the variants are as above.
+	static osg::Program* getLineProgram( bool compact = false, bool fluxTable = false );
+
+	//! Program of the tubes made by the CPU_MESH backend.
+	static osg::Program* getMeshProgram( bool fluxTable = false );
+
+	//! Program shared by every tube batch, tube attributes are read from a TubeStyleTable.
+	static osg::Program* getBatchProgram( unsigned int patchVertices = TubePatchLayout::DEFAULT_PATCH_VERTICES );
+
+private:
 
 	std::vector<Section> _sections;
 
+	//! Frame propagation state of the trajectory, appendTrajectory resumes from it.
+	TubeFrameKernel::Stream _stream;
+	bool _streamValid;
+
+	osg::LOD::RangeMode _lodRangeMode;
+	float _lodSwitchValue;
+
+	TubeTessellation::Settings _tessellation;
+
+	Backend _backend;
+	unsigned int _patchVertices;
+	unsigned int _chunkPatches;
+	bool _compactVertices;
+	bool _lighting;
+
+	osg::ref_ptr<TubeSectionCache> _sectionCache;
+	//! Set when _sections were read from _sectionCache for _cacheKey and not changed since.
+	bool _sectionsCached;
+	uint64_t _cacheKey;
+	//! Mapping of the file of the last hit, makeCylinderGeometry copies its arrays.
+	MappedFile _cacheFile;
+	osg::ref_ptr<TubeStyleTable> _fluxTable;
+	osg::ref_ptr<TubeSegmentBVH> _segmentBVH;
+	TubeArrayPool _arrayPool;
+
+	/*
+		Makes the patch indices of the chunks of \data from patch \firstPatch on, adding chunks as needed
+		and removing the ones past the last patch.
+	*/
+	void layoutChunks( TubeNodeData* data, unsigned int firstPatch );
+
+	/*
+		Packs the sections from \firstVertex on into the arrays of \data in place, whose compact blocks must
+		hold them, and has them uploaded. The capacity only grows, geometrically.
+	*/
+	void repackVertices( TubeNodeData* data, unsigned int firstVertex );
+
+	//! Removes the subgraph and the state of \tubeGroup, its arrays go to the pool.
+	void clearTube( osg::Group* tubeGroup );
+
+	//! Sets the uniforms of the style of \data, or its row of the flux table, where they changed.
+	void applyStyle( osg::Group* tubeGroup, TubeNodeData* data, const TubeStyle& style );
+
+	//! Sets the ranges of the tube and line children of \lod from the LOD settings and the tube bound.
+	void setLODRanges( osg::LOD* lod, TubeNodeData* data );
+
+	//! Adds a geometry made from the current sections to the stats.
+	void countGeometry( osg::Geometry* geometry, unsigned int patchVertices, double packTime );
+
+	void recordAppendStats( TubeBuildStats& stats, TubeNodeData* data, osg::Timer_t packStart );
+
+	TubeBuildStats _lastStats;
+	TubeBuildStats _totalStats;
+	TubeMeshBuilder::Settings _meshSettings;
+
 	
 private:
 	/*!
 	\brief This class is a builder for the every possible point of a streamline. It calculates the necessary
 	data for the streamline rendering algorithm: tangent, normal and binormal. It also calculates how
 	colinear the point is if compared to adjascent points. This colinearity is used to decide if the
-	point will be used of culled from the final streamline geometry
+	point will be used of culled from the final streamline geometry.
+	It is kept as the reference for TubeFrameKernel, which computes the same frames without trigonometry.
 	*/
 	class TubeSectionBuilder
 	{
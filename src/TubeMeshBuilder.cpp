@@ -0,0 +1,246 @@
+#include "TubeMeshBuilder.h"
+
+#include "TubeCurve.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Strip around every band between two rings. A band ends on the first vertex of its second ring, where
+// the next band starts, and has an even count, so the bands join with degenerated triangles only.
+template<typename T>
+void fillStrip( std::vector<T>& indices, unsigned int numRings, unsigned int radialVertices )
+{
+	indices.resize( numRings > 1 ? ( numRings - 1 ) * 2 * ( radialVertices + 1 ) : 0 );
+	unsigned int n = 0;
+	for( unsigned int ring = 0; ring + 1 < numRings; ring++ )
+	{
+		unsigned int first = ring * radialVertices;
+		for( unsigned int k = 0; k <= radialVertices; k++ )
+		{
+			unsigned int vertex = first + ( k < radialVertices ? k : 0 );
+			indices[n++] = static_cast<T>( vertex );
+			indices[n++] = static_cast<T>( vertex + radialVertices );
+		}
+	}
+}
+
+template<typename T>
+void fillLineStrip( std::vector<T>& indices, unsigned int numRings, unsigned int radialVertices )
+{
+	indices.resize( numRings );
+	for( unsigned int ring = 0; ring < numRings; ring++ )
+		indices[ring] = static_cast<T>( ring * radialVertices );
+}
+
+// Short indices while every vertex fits in them
+bool needsUIntIndices( unsigned int numRings, unsigned int radialVertices )
+{
+	return numRings * radialVertices > 65536;
+}
+
+}
+
+unsigned int TubeMeshBuilder::getNumRings( unsigned int numSections, const Settings& settings )
+{
+	if( numSections == 0 )
+		return 0;
+
+	// Sections 0, stride, 2 stride... and the last one
+	unsigned int stride = std::max( settings.sectionStride, 1u );
+	unsigned int numSectionRings = ( numSections - 1 ) / stride + 1;
+	if( ( numSections - 1 ) % stride != 0 )
+		numSectionRings++;
+	return ( numSectionRings - 1 ) * std::max( settings.subdivisions, 1u ) + 1;
+}
+
+unsigned int TubeMeshBuilder::sectionOfRing( unsigned int ring, unsigned int numSections, const Settings& settings )
+{
+	unsigned int sectionRing = ring / std::max( settings.subdivisions, 1u );
+	return std::min( sectionRing * std::max( settings.sectionStride, 1u ), numSections - 1 );
+}
+
+void TubeMeshBuilder::buildRings( const std::vector<TubeSection>& sections, unsigned int firstRing, float radius,
+	const Settings& settings, osg::Vec3Array* pos, osg::Vec3Array* nor, osg::FloatArray* distanceTo0 )
+{
+	unsigned int radialVertices = std::max( settings.radialVertices, 3u );
+	unsigned int subdivisions = std::max( settings.subdivisions, 1u );
+	unsigned int stride = std::max( settings.sectionStride, 1u );
+	unsigned int numSections = sections.size();
+	unsigned int numRings = getNumRings( numSections, settings );
+	firstRing = std::min( firstRing, numRings );
+
+	// The distance goes on from the last kept ring made from a section
+	float distance = 0.0f;
+	unsigned int distanceSection = 0;
+	if( firstRing > 0 )
+	{
+		unsigned int sectionRing = ( firstRing - 1 ) / subdivisions * subdivisions;
+		distance = ( *distanceTo0 )[sectionRing * radialVertices];
+		distanceSection = sectionOfRing( sectionRing, numSections, settings );
+	}
+
+	pos->resize( numRings * radialVertices );
+	nor->resize( numRings * radialVertices );
+	distanceTo0->resize( numRings * radialVertices );
+
+	// Same angles as tube.eval for a radial level of radialVertices, u = k / radialVertices
+	std::vector<float> sinTable( radialVertices ), cosTable( radialVertices );
+	for( unsigned int k = 0; k < radialVertices; k++ )
+	{
+		double theta = 6.283185307179586 * k / radialVertices;
+		sinTable[k] = static_cast<float>( sin( theta ) );
+		cosTable[k] = static_cast<float>( cos( theta ) );
+	}
+
+	for( unsigned int ring = firstRing; ring < numRings; ring++ )
+	{
+		unsigned int s = sectionOfRing( ring, numSections, settings );
+		for( ; distanceSection < s; distanceSection++ )
+			distance += ( sections[distanceSection + 1].position - sections[distanceSection].position ).length();
+
+		// A ring between two sections is on their curve, its distance is blended as tube.eval does
+		TubeSection section = sections[s];
+		float ringDistanceTo0 = distance;
+		unsigned int step = ring % subdivisions;
+		if( step > 0 )
+		{
+			unsigned int next = std::min( s + stride, numSections - 1 );
+			float segmentDistance = 0.0f;
+			for( unsigned int i = s; i < next; i++ )
+				segmentDistance += ( sections[i + 1].position - sections[i].position ).length();
+
+			float t = static_cast<float>( step ) / subdivisions;
+			section = TubeCurve::evaluate( sections[s], sections[next], t );
+			ringDistanceTo0 += segmentDistance * t;
+		}
+
+		const osg::Vec3& p = section.position;
+		const osg::Vec3& n = section.normal;
+		const osg::Vec3& b = section.binormal;
+		osg::Vec3* ringPos = &( *pos )[ring * radialVertices];
+		osg::Vec3* ringNor = &( *nor )[ring * radialVertices];
+		float* ringDistance = &( *distanceTo0 )[ring * radialVertices];
+
+		// No data dependency between the vertices of a ring, the compiler vectorizes this loop
+		for( unsigned int k = 0; k < radialVertices; k++ )
+		{
+			float sk = sinTable[k];
+			float ck = cosTable[k];
+			float nx = n.x() * sk + b.x() * ck;
+			float ny = n.y() * sk + b.y() * ck;
+			float nz = n.z() * sk + b.z() * ck;
+			ringNor[k].set( nx, ny, nz );
+			ringPos[k].set( p.x() + nx * radius, p.y() + ny * radius, p.z() + nz * radius );
+			ringDistance[k] = ringDistanceTo0;
+		}
+	}
+}
+
+osg::DrawElements* TubeMeshBuilder::createStrip( unsigned int numRings, unsigned int radialVertices )
+{
+	if( needsUIntIndices( numRings, radialVertices ) )
+	{
+		osg::DrawElementsUInt* strip = new osg::DrawElementsUInt( osg::PrimitiveSet::TRIANGLE_STRIP );
+		fillStrip( *strip, numRings, radialVertices );
+		return strip;
+	}
+
+	osg::DrawElementsUShort* strip = new osg::DrawElementsUShort( osg::PrimitiveSet::TRIANGLE_STRIP );
+	fillStrip( *strip, numRings, radialVertices );
+	return strip;
+}
+
+osg::DrawElements* TubeMeshBuilder::createLineStrip( unsigned int numRings, unsigned int radialVertices )
+{
+	if( needsUIntIndices( numRings, radialVertices ) )
+	{
+		osg::DrawElementsUInt* strip = new osg::DrawElementsUInt( osg::PrimitiveSet::LINE_STRIP );
+		fillLineStrip( *strip, numRings, radialVertices );
+		return strip;
+	}
+
+	osg::DrawElementsUShort* strip = new osg::DrawElementsUShort( osg::PrimitiveSet::LINE_STRIP );
+	fillLineStrip( *strip, numRings, radialVertices );
+	return strip;
+}
+
+osg::Geometry* TubeMeshBuilder::createGeometry( const std::vector<TubeSection>& sections, float radius, const Settings& settings )
+{
+	osg::Vec3Array* pos = new osg::Vec3Array;
+	osg::Vec3Array* nor = new osg::Vec3Array;
+	osg::FloatArray* distanceTo0 = new osg::FloatArray;
+	buildRings( sections, 0, radius, settings, pos, nor, distanceTo0 );
+
+	osg::Geometry* geo = new osg::Geometry();
+	geo->setUseDisplayList( false );
+	geo->setUseVertexBufferObjects( true );
+	geo->setVertexArray( pos );
+	geo->setVertexAttribArray( 2, nor );
+	geo->setVertexAttribBinding( 2, osg::Geometry::BIND_PER_VERTEX );
+	geo->setVertexAttribArray( 6, distanceTo0 );
+	geo->setVertexAttribBinding( 6, osg::Geometry::BIND_PER_VERTEX );
+	geo->addPrimitiveSet( createStrip( getNumRings( sections.size(), settings ), std::max( settings.radialVertices, 3u ) ) );
+	return geo;
+}
+
+osg::Geometry* TubeMeshBuilder::createLineGeometry( osg::Geometry* meshGeometry, const Settings& settings )
+{
+	unsigned int radialVertices = std::max( settings.radialVertices, 3u );
+	unsigned int numRings = meshGeometry->getVertexArray()->getNumElements() / radialVertices;
+
+	osg::Geometry* geo = new osg::Geometry();
+	geo->setUseDisplayList( false );
+	geo->setUseVertexBufferObjects( true );
+	geo->setVertexArray( meshGeometry->getVertexArray() );
+	geo->setVertexAttribArray( 6, meshGeometry->getVertexAttribArray( 6 ) );
+	geo->setVertexAttribBinding( 6, osg::Geometry::BIND_PER_VERTEX );
+	geo->addPrimitiveSet( createLineStrip( numRings, radialVertices ) );
+	return geo;
+}
+
+void TubeMeshBuilder::updateGeometry( osg::Geometry* meshGeometry, osg::Geometry* lineGeometry,
+	const std::vector<TubeSection>& sections, unsigned int firstSection, float radius, const Settings& settings )
+{
+	osg::Vec3Array* pos = static_cast<osg::Vec3Array*>( meshGeometry->getVertexArray() );
+	osg::Vec3Array* nor = static_cast<osg::Vec3Array*>( meshGeometry->getVertexAttribArray( 2 ) );
+	osg::FloatArray* distanceTo0 = static_cast<osg::FloatArray*>( meshGeometry->getVertexAttribArray( 6 ) );
+
+	// The rings made from sections before firstSection are kept, except the last one, which is always
+	// made from the last section and may have moved. The rings subdividing a segment depend on both
+	// its sections, only the ones ending before firstSection are kept.
+	unsigned int radialVertices = std::max( settings.radialVertices, 3u );
+	unsigned int stride = std::max( settings.sectionStride, 1u );
+	unsigned int subdivisions = std::max( settings.subdivisions, 1u );
+	unsigned int oldNumRings = pos->size() / radialVertices;
+	unsigned int oldSectionRings = oldNumRings > 0 ? ( oldNumRings - 1 ) / subdivisions + 1 : 0;
+	unsigned int keptSectionRings = std::min( ( firstSection + stride - 1 ) / stride, oldSectionRings > 0 ? oldSectionRings - 1 : 0 );
+	unsigned int keptRings = keptSectionRings > 0 ? ( keptSectionRings - 1 ) * subdivisions + 1 : 0;
+	buildRings( sections, keptRings, radius, settings, pos, nor, distanceTo0 );
+
+	// The indices only depend on the ring count, they are rebuilt unless the index type changes
+	unsigned int numRings = getNumRings( sections.size(), settings );
+	osg::DrawElementsUInt* uintStrip = dynamic_cast<osg::DrawElementsUInt*>( meshGeometry->getPrimitiveSet( 0 ) );
+	osg::DrawElementsUShort* ushortStrip = dynamic_cast<osg::DrawElementsUShort*>( meshGeometry->getPrimitiveSet( 0 ) );
+	if( needsUIntIndices( numRings, radialVertices ) ? uintStrip != NULL : ushortStrip != NULL )
+	{
+		if( uintStrip )
+			fillStrip( *uintStrip, numRings, radialVertices );
+		else
+			fillStrip( *ushortStrip, numRings, radialVertices );
+		meshGeometry->getPrimitiveSet( 0 )->dirty();
+	}
+	else
+		meshGeometry->setPrimitiveSet( 0, createStrip( numRings, radialVertices ) );
+
+	if( lineGeometry )
+		lineGeometry->setPrimitiveSet( 0, createLineStrip( numRings, radialVertices ) );
+
+	pos->dirty();
+	nor->dirty();
+	distanceTo0->dirty();
+	meshGeometry->dirtyBound();
+	if( lineGeometry )
+		lineGeometry->dirtyBound();
+}
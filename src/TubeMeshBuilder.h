@@ -0,0 +1,72 @@
+#ifndef _TUBE_MESH_BUILDER_
+#define _TUBE_MESH_BUILDER_
+
+#include <osg/Array>
+#include <osg/Geometry>
+
+#include "TubeSection.h"
+
+#include <vector>
+
+/*
+	Builds the tube surface on the CPU as an indexed triangle strip, for GL contexts without
+	tessellation shaders and for exporting or intersecting the tubes.
+
+	Every ring is a section of the tube with Settings::radialVertices vertices, shared by the two bands
+	of triangles around it. The rings are placed the same way tube.eval places the tessellated vertices:
+	with a radial level equal to radialVertices and every section used, both give the same surface.
+	Settings::subdivisions adds rings between the sections on the TubeCurve, as the lengthwise levels
+	of tube.eval past the section count do.
+	The screen space minimum radius of tube.eval needs the view, the mesh always uses the radius.
+
+	The arrays follow tube.eval outputs: the vertex array holds the positions, attribute 2 the normals
+	and attribute 6 the distance to the first section, so tube_mesh.vert can feed tube.frag.
+*/
+class TubeMeshBuilder
+{
+public:
+	struct Settings
+	{
+		Settings() : radialVertices( 10 ), sectionStride( 1 ), subdivisions( 1 ) {}
+
+		//! Vertices per ring, at least 3.
+		unsigned int radialVertices;
+		//! A ring is made every sectionStride sections, the last section always gets one.
+		unsigned int sectionStride;
+		//! Rings per segment between the sections of two consecutive rings, 1 makes no ring in between.
+		unsigned int subdivisions;
+	};
+
+	static unsigned int getNumRings( unsigned int numSections, const Settings& settings );
+
+	//! Section of the tube ring \ring is made from, or the one before it for a ring made by subdivision.
+	static unsigned int sectionOfRing( unsigned int ring, unsigned int numSections, const Settings& settings );
+
+	static osg::Geometry* createGeometry( const std::vector<TubeSection>& sections, float radius, const Settings& settings );
+
+	/*
+		Line strip through the first vertex of every ring of \meshGeometry, sharing its arrays. It is
+		off the tube axis by the radius, which is not visible at the distances lines are used.
+	*/
+	static osg::Geometry* createLineGeometry( osg::Geometry* meshGeometry, const Settings& settings );
+
+	/*
+		Updates a geometry made by createGeometry for \sections, which only changed from \firstSection on.
+		The rings before it are kept. \lineGeometry, if not NULL, was made by createLineGeometry on it.
+	*/
+	static void updateGeometry( osg::Geometry* meshGeometry, osg::Geometry* lineGeometry,
+		const std::vector<TubeSection>& sections, unsigned int firstSection, float radius, const Settings& settings );
+
+	/*
+		Writes the rings of \sections from \firstRing on, the arrays are resized to all the rings.
+		The distance of the rings before \firstRing is continued.
+	*/
+	static void buildRings( const std::vector<TubeSection>& sections, unsigned int firstRing, float radius,
+		const Settings& settings, osg::Vec3Array* pos, osg::Vec3Array* nor, osg::FloatArray* distanceTo0 );
+
+private:
+	static osg::DrawElements* createStrip( unsigned int numRings, unsigned int radialVertices );
+	static osg::DrawElements* createLineStrip( unsigned int numRings, unsigned int radialVertices );
+};
+
+#endif
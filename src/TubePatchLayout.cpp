@@ -0,0 +1,95 @@
+#include "TubePatchLayout.h"
+
+#include <osg/GL>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+
+#include <algorithm>
+#include <sstream>
+
+#ifndef GL_MAX_PATCH_VERTICES
+	#define GL_MAX_PATCH_VERTICES 0x8E7D
+#endif
+
+static unsigned int s_maxPatchVertices = 0;
+static OpenThreads::Mutex s_maxPatchVerticesMutex;
+
+// Setup cost of a patch in vertices, from the control shader invocation and the primitive generator
+static const unsigned int PATCH_SETUP_COST = 64;
+
+unsigned int TubePatchLayout::getNumPatches( unsigned int numSections, unsigned int patchVertices )
+{
+	if( numSections <= 1 )
+		return numSections;
+	return ( numSections - 2 ) / ( patchVertices - 1 ) + 1;
+}
+
+void TubePatchLayout::appendIndices( osg::DrawElementsUInt* indices, unsigned int baseVertex, unsigned int numSections,
+	unsigned int patchVertices, unsigned int firstPatch, unsigned int endPatch )
+{
+	unsigned int numPatches = std::min( getNumPatches( numSections, patchVertices ), endPatch );
+	// Batches append many tubes, an exact reserve each time would copy the indices for every tube
+	size_t needed = indices->size() + ( numPatches - std::min( firstPatch, numPatches ) ) * patchVertices;
+	if( needed > indices->capacity() )
+		indices->reserve( std::max( needed, 2 * indices->capacity() ) );
+	for( unsigned int patch = firstPatch; patch < numPatches; patch++ )
+	{
+		unsigned int first = patch * ( patchVertices - 1 );
+		for( unsigned int i = 0; i < patchVertices; i++ )
+			indices->push_back( baseVertex + std::min( first + i, numSections - 1 ) );
+	}
+}
+
+unsigned int TubePatchLayout::firstPatchOfSection( unsigned int section, unsigned int patchVertices )
+{
+	// Patch k reaches section k ( n - 1 ) + n - 1, padding included
+	return section > 0 ? ( section - 1 ) / ( patchVertices - 1 ) : 0;
+}
+
+unsigned int TubePatchLayout::choosePatchSize( unsigned int numSections )
+{
+	unsigned int maxPatchVertices = getMaxPatchVertices();
+	unsigned int best = 8;
+	unsigned int bestCost = 0;
+	for( unsigned int patchVertices = 8; patchVertices <= 64 && patchVertices <= maxPatchVertices; patchVertices *= 2 )
+	{
+		unsigned int cost = getNumPatches( std::max( numSections, 2u ), patchVertices ) * ( PATCH_SETUP_COST + patchVertices );
+		if( patchVertices == 8 || cost < bestCost )
+		{
+			best = patchVertices;
+			bestCost = cost;
+		}
+	}
+	return best;
+}
+
+std::string TubePatchLayout::getShaderDefines( unsigned int patchVertices )
+{
+	std::ostringstream defines;
+	defines << "#define TUBE_PATCH_VERTICES " << patchVertices << "\n";
+	return defines.str();
+}
+
+unsigned int TubePatchLayout::getMaxPatchVertices()
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock( s_maxPatchVerticesMutex );
+	return s_maxPatchVertices > 0 ? s_maxPatchVertices : DEFAULT_PATCH_VERTICES;
+}
+
+void TubePatchLayout::setMaxPatchVertices( unsigned int maxPatchVertices )
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock( s_maxPatchVerticesMutex );
+	s_maxPatchVertices = maxPatchVertices;
+}
+
+void TubePatchLayout::QueryOperation::operator()( osg::GraphicsContext* )
+{
+	GLint maxPatchVertices = 0;
+	glGetIntegerv( GL_MAX_PATCH_VERTICES, &maxPatchVertices );
+	if( maxPatchVertices <= 0 )
+		return;
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock( s_maxPatchVerticesMutex );
+	if( s_maxPatchVertices == 0 || static_cast<unsigned int>( maxPatchVertices ) < s_maxPatchVertices )
+		s_maxPatchVertices = maxPatchVertices;
+}
@@ -0,0 +1,65 @@
+#ifndef _TUBE_PATCH_LAYOUT_
+#define _TUBE_PATCH_LAYOUT_
+
+#include <osg/GraphicsThread>
+#include <osg/PrimitiveSet>
+
+#include <climits>
+#include <string>
+
+/*
+	Layout of the tube sections in tessellation patches. Each section is stored once and the patches
+	are made by an index buffer: patch k of a tube uses the sections k ( n - 1 ) to k ( n - 1 ) + n - 1,
+	n being the patch size, so consecutive patches share their boundary section. The tail of the last
+	patch repeats the last section, which only makes degenerated segments.
+
+	The patch size is one of 8, 16, 32 or 64 vertices, up to GL_MAX_PATCH_VERTICES. The shaders are
+	compiled for a patch size with the defines of getShaderDefines, see TubeGeometryBuilder.
+*/
+class TubePatchLayout
+{
+public:
+	//! GL_MAX_PATCH_VERTICES is at least 32 in every implementation.
+	static const unsigned int DEFAULT_PATCH_VERTICES = 32;
+
+	static unsigned int getNumPatches( unsigned int numSections, unsigned int patchVertices );
+
+	/*
+		Appends to \indices the patches of a tube of \numSections sections whose first vertex is \baseVertex,
+		from patch \firstPatch up to, not including, patch \endPatch. A tube drawn by a single DrawElements
+		needs the indices of the patches before \firstPatch to be there already; chunked tubes give every
+		chunk its own range of patches.
+	*/
+	static void appendIndices( osg::DrawElementsUInt* indices, unsigned int baseVertex, unsigned int numSections,
+		unsigned int patchVertices, unsigned int firstPatch = 0, unsigned int endPatch = UINT_MAX );
+
+	//! First patch whose indices change when the sections from \section on change.
+	static unsigned int firstPatchOfSection( unsigned int section, unsigned int patchVertices );
+
+	/*
+		Patch size with the lowest cost for tubes of \numSections sections. The cost of a patch is a fixed
+		setup cost plus its vertices, including the padding of the last patch: small patches pay the setup
+		more often, large ones waste more padding on short tubes.
+	*/
+	static unsigned int choosePatchSize( unsigned int numSections );
+
+	static std::string getShaderDefines( unsigned int patchVertices );
+
+	//! GL_MAX_PATCH_VERTICES of the contexts in use, DEFAULT_PATCH_VERTICES until it is queried.
+	static unsigned int getMaxPatchVertices();
+	static void setMaxPatchVertices( unsigned int maxPatchVertices );
+
+	/*
+		Reads GL_MAX_PATCH_VERTICES, e.g. as the realize operation of the viewer. With several contexts the
+		smallest value is kept. Tubes built before it runs use at most DEFAULT_PATCH_VERTICES.
+	*/
+	class QueryOperation : public osg::GraphicsOperation
+	{
+	public:
+		QueryOperation() : osg::GraphicsOperation( "TubePatchLayout::QueryOperation", false ) {}
+
+		virtual void operator()( osg::GraphicsContext* context );
+	};
+};
+
+#endif
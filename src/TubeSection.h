@@ -0,0 +1,14 @@
+#ifndef _TUBE_SECTION_
+#define _TUBE_SECTION_
+
+#include <osg/Vec3>
+
+//! Position and frame of a tube section, the normal and binormal span the plane of its circle.
+struct TubeSection
+{
+	osg::Vec3 position;
+	osg::Vec3 normal;
+	osg::Vec3 binormal;
+};
+
+#endif
@@ -0,0 +1,256 @@
+#include "TubeSectionCache.h"
+
+#include <osg/Notify>
+#include <osgDB/FileUtils>
+
+#include "MappedFile.h"
+#include "TubeFrameKernel.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+namespace {
+
+const char MAGIC[8] = { 'T', 'U', 'B', 'E', 'S', 'E', 'C', 'T' };
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+// The arrays start at multiples of this, so they can be read with aligned loads
+const uint64_t ARRAY_ALIGNMENT = 16;
+
+struct CacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint64_t key;
+	uint32_t numSections;
+	uint32_t reserved;
+	//! Positions, normals, binormals and distances to the first section.
+	uint64_t offsets[4];
+};
+
+inline uint64_t hashValue( uint64_t hash, uint64_t value )
+{
+	return ( hash ^ value ) * FNV_PRIME;
+}
+
+inline uint64_t hashFloat( uint64_t hash, float value )
+{
+	uint32_t bits;
+	memcpy( &bits, &value, sizeof( bits ) );
+	return hashValue( hash, bits );
+}
+
+template<typename T>
+uint64_t hashComponents( uint64_t hash, const TrajectoryView& trajectory )
+{
+	for( unsigned int i = 0; i < trajectory.numPoints; i++ )
+	{
+		size_t offset = static_cast<size_t>( i ) * trajectory.strideBytes;
+		const void* components[3] = { trajectory.x, trajectory.y, trajectory.z };
+		for( int c = 0; c < 3; c++ )
+		{
+			T value;
+			memcpy( &value, static_cast<const char*>( components[c] ) + offset, sizeof( T ) );
+			if( sizeof( T ) == sizeof( uint64_t ) )
+			{
+				uint64_t bits;
+				memcpy( &bits, &value, sizeof( bits ) );
+				hash = hashValue( hash, bits );
+			}
+			else
+			{
+				uint32_t bits;
+				memcpy( &bits, &value, sizeof( bits ) );
+				hash = hashValue( hash, bits );
+			}
+		}
+	}
+	return hash;
+}
+
+uint64_t alignOffset( uint64_t offset )
+{
+	return ( offset + ARRAY_ALIGNMENT - 1 ) / ARRAY_ALIGNMENT * ARRAY_ALIGNMENT;
+}
+
+// Returns the header of a mapped file if it is valid for \key
+const CacheHeader* validHeader( const MappedFile& file, uint64_t key )
+{
+	if( file.getSize() < sizeof( CacheHeader ) )
+		return NULL;
+
+	const CacheHeader* header = reinterpret_cast<const CacheHeader*>( file.getData() );
+	if( memcmp( header->magic, MAGIC, sizeof( MAGIC ) ) != 0 || header->version != TubeSectionCache::VERSION ||
+		header->byteOrder != BYTE_ORDER_MARK || header->key != key )
+		return NULL;
+
+	uint64_t vec3Bytes = static_cast<uint64_t>( header->numSections ) * 3 * sizeof( float );
+	uint64_t floatBytes = static_cast<uint64_t>( header->numSections ) * sizeof( float );
+	for( int i = 0; i < 4; i++ )
+	{
+		if( header->offsets[i] + ( i < 3 ? vec3Bytes : floatBytes ) > file.getSize() )
+			return NULL;
+	}
+	return header;
+}
+
+}
+
+TubeSectionCache::TubeSectionCache( const std::string& directory ) :
+	_directory( directory )
+{
+	if( !osgDB::fileExists( _directory ) )
+		osgDB::makeDirectory( _directory );
+}
+
+uint64_t TubeSectionCache::computeKey( const TrajectoryView& trajectory, float verticalScale, float curveTolerance )
+{
+	// FNV-1a over whole values instead of bytes, the points are the bulk of the input
+	uint64_t hash = FNV_OFFSET_BASIS;
+	hash = hashValue( hash, VERSION );
+	hash = hashValue( hash, trajectory.numPoints );
+	hash = hashValue( hash, trajectory.isDouble ? 1 : 0 );
+	hash = hashFloat( hash, verticalScale );
+	hash = hashFloat( hash, curveTolerance );
+	if( trajectory.isDouble )
+		return hashComponents<double>( hash, trajectory );
+	return hashComponents<float>( hash, trajectory );
+}
+
+std::string TubeSectionCache::getFileName( uint64_t key ) const
+{
+	char name[32];
+	sprintf( name, "%08x%08x.tsc", static_cast<unsigned int>( key >> 32 ), static_cast<unsigned int>( key ) );
+	return _directory + "/" + name;
+}
+
+bool TubeSectionCache::load( uint64_t key, std::vector<TubeSection>& sections, MappedFile* mapping ) const
+{
+	MappedFile localFile;
+	MappedFile& file = mapping ? *mapping : localFile;
+	if( !file.open( getFileName( key ) ) )
+		return false;
+
+	const CacheHeader* header = validHeader( file, key );
+	if( !header )
+	{
+		file.close();
+		return false;
+	}
+
+	const float* arrays[3];
+	for( int i = 0; i < 3; i++ )
+		arrays[i] = reinterpret_cast<const float*>( file.getData() + header->offsets[i] );
+
+	sections.resize( header->numSections );
+	for( unsigned int s = 0; s < header->numSections; s++ )
+	{
+		sections[s].position.set( arrays[0][3*s], arrays[0][3*s+1], arrays[0][3*s+2] );
+		sections[s].normal.set( arrays[1][3*s], arrays[1][3*s+1], arrays[1][3*s+2] );
+		sections[s].binormal.set( arrays[2][3*s], arrays[2][3*s+1], arrays[2][3*s+2] );
+	}
+	return true;
+}
+
+bool TubeSectionCache::loadArrays( const MappedFile& file, uint64_t key, osg::Vec3Array* pos, osg::Vec3Array* nor,
+	osg::Vec3Array* bin, osg::FloatArray* distanceTo0 )
+{
+	// Only checks the header, the file is already mapped
+	const CacheHeader* header = validHeader( file, key );
+	if( !header )
+		return false;
+
+	// The arrays are stored as packed floats, the same layout as osg::Vec3Array and osg::FloatArray
+	osg::Vec3Array* vec3Arrays[3] = { pos, nor, bin };
+	for( int i = 0; i < 3; i++ )
+	{
+		const osg::Vec3* first = reinterpret_cast<const osg::Vec3*>( file.getData() + header->offsets[i] );
+		vec3Arrays[i]->assign( first, first + header->numSections );
+	}
+	const float* distances = reinterpret_cast<const float*>( file.getData() + header->offsets[3] );
+	distanceTo0->assign( distances, distances + header->numSections );
+	return true;
+}
+
+bool TubeSectionCache::store( uint64_t key, const std::vector<TubeSection>& sections ) const
+{
+	unsigned int numSections = sections.size();
+	uint64_t vec3Bytes = static_cast<uint64_t>( numSections ) * 3 * sizeof( float );
+
+	CacheHeader header;
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, MAGIC, sizeof( MAGIC ) );
+	header.version = VERSION;
+	header.byteOrder = BYTE_ORDER_MARK;
+	header.key = key;
+	header.numSections = numSections;
+	header.offsets[0] = alignOffset( sizeof( CacheHeader ) );
+	for( int i = 1; i < 4; i++ )
+		header.offsets[i] = alignOffset( header.offsets[i-1] + vec3Bytes );
+
+	std::vector<float> positions( 3 * numSections ), normals( 3 * numSections ), binormals( 3 * numSections );
+	std::vector<float> distances( numSections );
+	float distance = 0.0f;
+	for( unsigned int s = 0; s < numSections; s++ )
+	{
+		// Same distances as TubeGeometryBuilder::packSectionVertices
+		if( s > 0 )
+			distance += ( sections[s].position - sections[s-1].position ).length();
+		distances[s] = distance;
+		for( int c = 0; c < 3; c++ )
+		{
+			positions[3*s+c] = sections[s].position[c];
+			normals[3*s+c] = sections[s].normal[c];
+			binormals[3*s+c] = sections[s].binormal[c];
+		}
+	}
+
+	// Written aside and renamed, so a reader never maps a half written file
+	std::string fileName = getFileName( key );
+	std::string tempName = fileName + ".tmp";
+	{
+		std::ofstream out( tempName.c_str(), std::ios::binary | std::ios::trunc );
+		if( !out )
+		{
+			osg::notify( osg::WARN ) << "Can not write the section cache file \"" << tempName << "\"." << std::endl;
+			return false;
+		}
+
+		const std::vector<float>* arrays[4] = { &positions, &normals, &binormals, &distances };
+		out.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+		uint64_t written = sizeof( header );
+		for( int i = 0; i < 4; i++ )
+		{
+			static const char padding[ARRAY_ALIGNMENT] = { 0 };
+			out.write( padding, static_cast<std::streamsize>( header.offsets[i] - written ) );
+			if( !arrays[i]->empty() )
+				out.write( reinterpret_cast<const char*>( &( *arrays[i] )[0] ), arrays[i]->size() * sizeof( float ) );
+			written = header.offsets[i] + arrays[i]->size() * sizeof( float );
+		}
+		if( !out )
+		{
+			out.close();
+			remove( tempName.c_str() );
+			return false;
+		}
+	}
+
+	remove( fileName.c_str() );
+	return rename( tempName.c_str(), fileName.c_str() ) == 0;
+}
+
+bool TubeSectionCache::loadOrBuild( const TrajectoryView& trajectory, float verticalScale, float curveTolerance,
+	std::vector<TubeSection>& sections ) const
+{
+	uint64_t key = computeKey( trajectory, verticalScale, curveTolerance );
+	if( load( key, sections ) )
+		return true;
+
+	TubeFrameKernel::buildSections( trajectory, verticalScale, curveTolerance, sections );
+	store( key, sections );
+	return false;
+}
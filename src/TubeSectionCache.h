@@ -0,0 +1,70 @@
+#ifndef _TUBE_SECTION_CACHE_
+#define _TUBE_SECTION_CACHE_
+
+#include <osg/Array>
+#include <osg/Referenced>
+
+#include "TrajectoryView.h"
+#include "TubeSection.h"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+class MappedFile;
+
+/*
+	On disk cache of the sections computed from trajectories, one file per trajectory in a directory.
+
+	A file is found by the key of its input: a FNV-1a hash of the trajectory points, the vertical scale
+	and the curve tolerance. It starts with a versioned header followed by the positions, normals,
+	binormals and distances to the first section, each one a packed array laid out as the vertex arrays
+	TubeGeometryBuilder::packSectionVertices fills. The file is memory mapped, so loading is copying
+	those arrays and is bounded by the disk bandwidth. Files of another version or byte order, or whose
+	header does not match the key, are ignored and rebuilt.
+
+	One file per trajectory suits scenes of thousands of trajectories. With millions, opening the files
+	and the size of the directory dominate, the entries of a scene would need to be packed in one file
+	indexed by key.
+*/
+class TubeSectionCache : public osg::Referenced
+{
+public:
+	static const uint32_t VERSION = 1;
+
+	//! The files are kept in \directory, which is created if it does not exist.
+	explicit TubeSectionCache( const std::string& directory );
+
+	static uint64_t computeKey( const TrajectoryView& trajectory, float verticalScale, float curveTolerance );
+
+	std::string getFileName( uint64_t key ) const;
+
+	/*
+		Reads the sections stored for \key, returns false when there is no valid file for it. If \file is
+		not NULL, the mapping is left open in it for loadArrays, so a hit maps and checks the file once.
+	*/
+	bool load( uint64_t key, std::vector<TubeSection>& sections, MappedFile* file = NULL ) const;
+
+	/*
+		Reads the stored arrays of \file, mapped by load for \key, directly into vertex arrays, replacing
+		their contents, as TubeGeometryBuilder::makeCylinderGeometry does on a hit.
+	*/
+	static bool loadArrays( const MappedFile& file, uint64_t key, osg::Vec3Array* pos, osg::Vec3Array* nor,
+		osg::Vec3Array* bin, osg::FloatArray* distanceTo0 );
+
+	//! Writes the sections for \key, returns false if the file could not be written.
+	bool store( uint64_t key, const std::vector<TubeSection>& sections ) const;
+
+	/*
+		Loads the sections of \trajectory, or builds them with TubeFrameKernel and stores them when they
+		are not cached yet. Returns true on a cache hit.
+	*/
+	bool loadOrBuild( const TrajectoryView& trajectory, float verticalScale, float curveTolerance,
+		std::vector<TubeSection>& sections ) const;
+
+private:
+	std::string _directory;
+};
+
+#endif
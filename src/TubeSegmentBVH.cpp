@@ -0,0 +1,611 @@
+#include "TubeSegmentBVH.h"
+
+#include "TubeCurve.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Polyline of TubeSegmentBVH::CURVE_SEGMENTS segments along the curve from \a to \b
+void sampleSegment( const TubeSection& a, const TubeSection& b, osg::Vec3* points )
+{
+	const unsigned int numSegments = TubeSegmentBVH::CURVE_SEGMENTS;
+	points[0] = a.position;
+	for( unsigned int i = 1; i < numSegments; i++ )
+		points[i] = TubeCurve::evaluate( a, b, static_cast<float>( i ) / numSegments ).position;
+	points[numSegments] = b.position;
+}
+
+// Distance from \p to the segment from \a to \b, \s receives the parameter of the closest point
+float distanceToSegment( const osg::Vec3& p, const osg::Vec3& a, const osg::Vec3& b, float& s )
+{
+	osg::Vec3 ab = b - a;
+	osg::Vec3 ap = p - a;
+	float length2 = ab.length2();
+	s = length2 > 0.0f ? std::min( std::max( ( ap * ab ) / length2, 0.0f ), 1.0f ) : 0.0f;
+	return ( ap - ab * s ).length();
+}
+
+// Distance from \p to \box, 0 inside
+float distanceToBox( const osg::Vec3& p, const osg::BoundingBox& box )
+{
+	float distance2 = 0.0f;
+	for( int k = 0; k < 3; k++ )
+	{
+		float d = std::max( std::max( box._min[k] - p[k], p[k] - box._max[k] ), 0.0f );
+		distance2 += d * d;
+	}
+	return sqrtf( distance2 );
+}
+
+// Distance along the unit direction \dir at which the ray from \origin enters \box grown by \padding
+bool intersectBox( const osg::Vec3& origin, const osg::Vec3& dir, const osg::BoundingBox& box, float padding,
+	float maxDistance, float& enter )
+{
+	float t0 = 0.0f;
+	float t1 = maxDistance;
+	for( int k = 0; k < 3; k++ )
+	{
+		float boxMin = box._min[k] - padding;
+		float boxMax = box._max[k] + padding;
+		if( fabsf( dir[k] ) < 1e-12f )
+		{
+			if( origin[k] < boxMin || origin[k] > boxMax )
+				return false;
+			continue;
+		}
+		float tNear = ( boxMin - origin[k] ) / dir[k];
+		float tFar = ( boxMax - origin[k] ) / dir[k];
+		if( tNear > tFar )
+			std::swap( tNear, tFar );
+		t0 = std::max( t0, tNear );
+		t1 = std::min( t1, tFar );
+		if( t0 > t1 )
+			return false;
+	}
+	enter = t0;
+	return true;
+}
+
+// First distance, if any, at which the ray from \origin along the unit \dir reaches the sphere
+bool intersectSphere( const osg::Vec3& origin, const osg::Vec3& dir, const osg::Vec3& center, float radius, float& t )
+{
+	osg::Vec3 oc = origin - center;
+	float b = oc * dir;
+	float c = oc.length2() - radius * radius;
+	float h = b * b - c;
+	if( h < 0.0f )
+		return false;
+	t = -b - sqrtf( h );
+	return t >= 0.0f;
+}
+
+/*
+	First distance at which the ray from \origin along the unit \dir reaches the capsule of \radius
+	around the segment from \a to \b, 0 if it starts inside.
+*/
+bool intersectCapsule( const osg::Vec3& origin, const osg::Vec3& dir, const osg::Vec3& a, const osg::Vec3& b,
+	float radius, float& t )
+{
+	float s;
+	if( distanceToSegment( origin, a, b, s ) <= radius )
+	{
+		t = 0.0f;
+		return true;
+	}
+
+	// The capsule is the cylinder around the segment and the spheres at its ends
+	bool hit = false;
+	t = FLT_MAX;
+	osg::Vec3 ba = b - a;
+	osg::Vec3 oa = origin - a;
+	float baba = ba.length2();
+	float bard = ba * dir;
+	float baoa = ba * oa;
+	float qa = baba - bard * bard;
+	if( qa > 1e-12f * baba )
+	{
+		float qb = baba * ( dir * oa ) - baoa * bard;
+		float qc = baba * oa.length2() - baoa * baoa - radius * radius * baba;
+		float h = qb * qb - qa * qc;
+		if( h >= 0.0f )
+		{
+			float tc = ( -qb - sqrtf( h ) ) / qa;
+			float y = baoa + tc * bard;
+			if( tc >= 0.0f && y > 0.0f && y < baba )
+			{
+				t = tc;
+				hit = true;
+			}
+		}
+	}
+
+	float ts;
+	if( intersectSphere( origin, dir, a, radius, ts ) && ts < t )
+	{
+		t = ts;
+		hit = true;
+	}
+	if( intersectSphere( origin, dir, b, radius, ts ) && ts < t )
+	{
+		t = ts;
+		hit = true;
+	}
+	return hit;
+}
+
+// Hit at the parameter \s of the polyline segment \k of segment \segment of a tube
+void setHitSegment( TubeSegmentBVH::Hit& hit, unsigned int segment, unsigned int k, float s,
+	const std::vector<float>& distances )
+{
+	hit.segment = segment;
+	hit.t = ( static_cast<float>( k ) + s ) / TubeSegmentBVH::CURVE_SEGMENTS;
+	unsigned int next = std::min<size_t>( segment + 1, distances.size() - 1 );
+	hit.distanceTo0 = distances[segment] * ( 1.0f - hit.t ) + distances[next] * hit.t;
+}
+
+struct CenterLess
+{
+	CenterLess( const std::vector<osg::Vec3>& centers_, int axis_ ) : centers( centers_ ), axis( axis_ ) {}
+
+	bool operator()( unsigned int a, unsigned int b ) const { return centers[a][axis] < centers[b][axis]; }
+
+	const std::vector<osg::Vec3>& centers;
+	int axis;
+};
+
+}
+
+TubeSegmentBVH::TubeSegmentBVH() : _rebuild( false ), _refit( false )
+{
+}
+
+unsigned int TubeSegmentBVH::addTube( const std::vector<TubeSection>& sections, float radius )
+{
+	unsigned int tubeId = _tubes.size();
+	setTube( tubeId, sections, radius );
+	return tubeId;
+}
+
+void TubeSegmentBVH::setTube( unsigned int tubeId, const std::vector<TubeSection>& sections, float radius )
+{
+	if( tubeId >= _tubes.size() )
+		_tubes.resize( tubeId + 1 );
+
+	Tube& tube = _tubes[tubeId];
+	bool wasEmpty = tube.sections.empty();
+	tube.sections = sections;
+	tube.radius = radius;
+	tube.removed = false;
+	refit( tube, 0 );
+
+	// A tube that appears or disappears changes the hierarchy, a moved one only its bounds
+	if( wasEmpty != tube.sections.empty() )
+		_rebuild = true;
+	else
+		_refit = true;
+}
+
+void TubeSegmentBVH::updateTube( unsigned int tubeId, const std::vector<TubeSection>& sections,
+	unsigned int firstChangedSection )
+{
+	if( tubeId >= _tubes.size() || _tubes[tubeId].removed )
+		return;
+
+	Tube& tube = _tubes[tubeId];
+	bool wasEmpty = tube.sections.empty();
+	unsigned int first = std::min<size_t>( firstChangedSection, std::min( tube.sections.size(), sections.size() ) );
+	tube.sections.resize( sections.size() );
+	std::copy( sections.begin() + first, sections.end(), tube.sections.begin() + first );
+	refit( tube, first );
+
+	if( wasEmpty != tube.sections.empty() )
+		_rebuild = true;
+	else
+		_refit = true;
+}
+
+void TubeSegmentBVH::setTubeRadius( unsigned int tubeId, float radius )
+{
+	if( tubeId >= _tubes.size() || _tubes[tubeId].radius == radius )
+		return;
+
+	_tubes[tubeId].radius = radius;
+	refit( _tubes[tubeId], 0 );
+	_refit = true;
+}
+
+void TubeSegmentBVH::removeTube( unsigned int tubeId )
+{
+	if( tubeId >= _tubes.size() )
+		return;
+
+	Tube& tube = _tubes[tubeId];
+	if( !tube.sections.empty() )
+		_rebuild = true;
+	tube = Tube();
+	tube.removed = true;
+}
+
+void TubeSegmentBVH::setTubeGroup( unsigned int tubeId, osg::Group* group )
+{
+	if( tubeId < _tubes.size() )
+		_tubes[tubeId].group = group;
+}
+
+osg::Group* TubeSegmentBVH::getTubeGroup( unsigned int tubeId ) const
+{
+	return tubeId < _tubes.size() ? _tubes[tubeId].group.get() : NULL;
+}
+
+void TubeSegmentBVH::clear()
+{
+	_tubes.clear();
+	_nodes.clear();
+	_tubeOrder.clear();
+	_rebuild = false;
+	_refit = false;
+}
+
+void TubeSegmentBVH::refit( Tube& tube, unsigned int firstSection )
+{
+	const std::vector<TubeSection>& sections = tube.sections;
+	unsigned int numSections = sections.size();
+	firstSection = std::min( firstSection, numSections );
+
+	// Measured on the exact positions, as packSectionVertices does
+	tube.distances.resize( numSections );
+	if( firstSection == 0 && numSections > 0 )
+		tube.distances[0] = 0.0f;
+	for( unsigned int i = std::max( firstSection, 1u ); i < numSections; i++ )
+		tube.distances[i] = tube.distances[i - 1] + ( sections[i].position - sections[i - 1].position ).length();
+
+	unsigned int numSegments = tube.getNumSegments();
+	if( numSegments == 0 )
+	{
+		tube.levels.clear();
+		return;
+	}
+
+	// The segment ending at the first changed section changes too
+	unsigned int firstSegment = std::min( firstSection > 0 ? firstSection - 1 : 0, numSegments - 1 );
+	unsigned int numLevels = 1;
+	for( unsigned int size = ( numSegments + LEAF_SEGMENTS - 1 ) / LEAF_SEGMENTS; size > 1; size = ( size + 1 ) / 2 )
+		numLevels++;
+	tube.levels.resize( numLevels );
+
+	osg::Vec3 grow( tube.radius, tube.radius, tube.radius );
+	unsigned int first = firstSegment / LEAF_SEGMENTS;
+	unsigned int size = ( numSegments + LEAF_SEGMENTS - 1 ) / LEAF_SEGMENTS;
+	for( unsigned int level = 0; level < numLevels; level++ )
+	{
+		// A level that was shorter has its new nodes computed too
+		std::vector<osg::BoundingBox>& boxes = tube.levels[level];
+		unsigned int begin = std::min<size_t>( first, boxes.size() );
+		boxes.resize( size );
+		for( unsigned int i = begin; i < size; i++ )
+		{
+			osg::BoundingBox& box = boxes[i];
+			box.init();
+			if( level == 0 )
+			{
+				unsigned int end = std::min( ( i + 1 ) * LEAF_SEGMENTS, numSegments );
+				for( unsigned int segment = i * LEAF_SEGMENTS; segment < end; segment++ )
+					TubeCurve::expandBound( box, sections[segment], sections[std::min( segment + 1, numSections - 1 )] );
+				box._min -= grow;
+				box._max += grow;
+			}
+			else
+			{
+				const std::vector<osg::BoundingBox>& children = tube.levels[level - 1];
+				box.expandBy( children[2 * i] );
+				if( 2 * i + 1 < children.size() )
+					box.expandBy( children[2 * i + 1] );
+			}
+		}
+		first /= 2;
+		size = ( size + 1 ) / 2;
+	}
+}
+
+void TubeSegmentBVH::prepare()
+{
+	if( _rebuild )
+	{
+		_tubeOrder.clear();
+		std::vector<osg::Vec3> centers( _tubes.size() );
+		for( unsigned int i = 0; i < _tubes.size(); i++ )
+		{
+			if( _tubes[i].sections.empty() )
+				continue;
+			_tubeOrder.push_back( i );
+			centers[i] = _tubes[i].levels.back()[0].center();
+		}
+
+		_nodes.clear();
+		if( !_tubeOrder.empty() )
+			buildNode( 0, _tubeOrder.size(), centers );
+	}
+	else if( _refit )
+	{
+		// The children follow their parent, so they are refit first backwards
+		for( size_t i = _nodes.size(); i-- > 0; )
+		{
+			Node& node = _nodes[i];
+			node.box.init();
+			if( node.count == 0 )
+			{
+				node.box.expandBy( _nodes[i + 1].box );
+				node.box.expandBy( _nodes[node.right].box );
+				continue;
+			}
+			for( unsigned int j = node.first; j < node.first + node.count; j++ )
+				node.box.expandBy( _tubes[_tubeOrder[j]].levels.back()[0] );
+		}
+	}
+	_rebuild = false;
+	_refit = false;
+}
+
+unsigned int TubeSegmentBVH::buildNode( unsigned int first, unsigned int count, std::vector<osg::Vec3>& centers )
+{
+	unsigned int index = _nodes.size();
+	Node node;
+	node.first = first;
+	node.count = count;
+	node.right = 0;
+
+	osg::BoundingBox centerBox;
+	for( unsigned int i = first; i < first + count; i++ )
+	{
+		node.box.expandBy( _tubes[_tubeOrder[i]].levels.back()[0] );
+		centerBox.expandBy( centers[_tubeOrder[i]] );
+	}
+	_nodes.push_back( node );
+	if( count <= 2 )
+		return index;
+
+	// Median split on the longest axis of the tube centers
+	osg::Vec3 extent = centerBox._max - centerBox._min;
+	int axis = extent.x() > extent.y() ? ( extent.x() > extent.z() ? 0 : 2 ) : ( extent.y() > extent.z() ? 1 : 2 );
+	unsigned int half = count / 2;
+	std::nth_element( _tubeOrder.begin() + first, _tubeOrder.begin() + first + half, _tubeOrder.begin() + first + count,
+		CenterLess( centers, axis ) );
+
+	buildNode( first, half, centers );
+	unsigned int right = buildNode( first + half, count - half, centers );
+	_nodes[index].count = 0;
+	_nodes[index].right = right;
+	return index;
+}
+
+bool TubeSegmentBVH::pick( const osg::Vec3& start, const osg::Vec3& end, Hit& hit, float padding )
+{
+	prepare();
+	osg::Vec3 dir = end - start;
+	float length = dir.length();
+	if( _nodes.empty() || length <= 0.0f )
+		return false;
+	dir /= length;
+
+	// The nearer child is visited first, so the farther one is often cut by the hit found meanwhile
+	bool found = false;
+	float best = length;
+	std::vector<unsigned int> stack( 1, 0 );
+	while( !stack.empty() )
+	{
+		const Node& node = _nodes[stack.back()];
+		stack.pop_back();
+		float enter;
+		if( !intersectBox( start, dir, node.box, padding, best, enter ) )
+			continue;
+
+		if( node.count > 0 )
+		{
+			for( unsigned int i = node.first; i < node.first + node.count; i++ )
+				found |= pickTube( _tubeOrder[i], start, dir, padding, best, hit );
+			continue;
+		}
+
+		unsigned int left = &node - &_nodes[0] + 1;
+		unsigned int right = node.right;
+		float leftEnter = FLT_MAX;
+		float rightEnter = FLT_MAX;
+		intersectBox( start, dir, _nodes[left].box, padding, best, leftEnter );
+		intersectBox( start, dir, _nodes[right].box, padding, best, rightEnter );
+		stack.push_back( leftEnter < rightEnter ? right : left );
+		stack.push_back( leftEnter < rightEnter ? left : right );
+	}
+	return found;
+}
+
+bool TubeSegmentBVH::pickTube( unsigned int tubeId, const osg::Vec3& start, const osg::Vec3& dir, float padding,
+	float& best, Hit& hit ) const
+{
+	const Tube& tube = _tubes[tubeId];
+	const unsigned int numSegments = tube.getNumSegments();
+	const unsigned int numSections = tube.sections.size();
+	const float radius = tube.radius + padding;
+	osg::Vec3 points[CURVE_SEGMENTS + 1];
+	bool found = false;
+
+	// ( level, index ) pairs
+	std::vector< std::pair<unsigned int, unsigned int> > stack( 1, std::make_pair( tube.levels.size() - 1, 0u ) );
+	while( !stack.empty() )
+	{
+		unsigned int level = stack.back().first;
+		unsigned int index = stack.back().second;
+		stack.pop_back();
+		float enter;
+		if( !intersectBox( start, dir, tube.levels[level][index], padding, best, enter ) )
+			continue;
+
+		if( level > 0 )
+		{
+			const std::vector<osg::BoundingBox>& children = tube.levels[level - 1];
+			float leftEnter = FLT_MAX;
+			float rightEnter = FLT_MAX;
+			bool hasRight = 2 * index + 1 < children.size();
+			intersectBox( start, dir, children[2 * index], padding, best, leftEnter );
+			if( hasRight )
+				intersectBox( start, dir, children[2 * index + 1], padding, best, rightEnter );
+			bool rightFirst = hasRight && rightEnter < leftEnter;
+			if( hasRight )
+				stack.push_back( std::make_pair( level - 1, rightFirst ? 2 * index : 2 * index + 1 ) );
+			stack.push_back( std::make_pair( level - 1, rightFirst ? 2 * index + 1 : 2 * index ) );
+			continue;
+		}
+
+		unsigned int end = std::min( ( index + 1 ) * LEAF_SEGMENTS, numSegments );
+		for( unsigned int segment = index * LEAF_SEGMENTS; segment < end; segment++ )
+		{
+			sampleSegment( tube.sections[segment], tube.sections[std::min( segment + 1, numSections - 1 )], points );
+			for( unsigned int k = 0; k < CURVE_SEGMENTS; k++ )
+			{
+				float t;
+				if( !intersectCapsule( start, dir, points[k], points[k + 1], radius, t ) || t >= best )
+					continue;
+
+				best = t;
+				found = true;
+				hit.tubeId = tubeId;
+				hit.point = start + dir * t;
+				hit.distance = t;
+				float s;
+				distanceToSegment( hit.point, points[k], points[k + 1], s );
+				setHitSegment( hit, segment, k, s, tube.distances );
+			}
+		}
+	}
+	return found;
+}
+
+bool TubeSegmentBVH::nearest( const osg::Vec3& point, Hit& hit, float maxDistance )
+{
+	prepare();
+	if( _nodes.empty() )
+		return false;
+
+	// The distance to the surface is negative inside a tube, the tube whose axis is the closest wins
+	bool found = false;
+	float best = maxDistance;
+	std::vector<unsigned int> stack( 1, 0 );
+	while( !stack.empty() )
+	{
+		const Node& node = _nodes[stack.back()];
+		stack.pop_back();
+		if( distanceToBox( point, node.box ) > std::max( best, 0.0f ) )
+			continue;
+
+		if( node.count > 0 )
+		{
+			for( unsigned int i = node.first; i < node.first + node.count; i++ )
+				found |= nearestInTube( _tubeOrder[i], point, best, hit );
+			continue;
+		}
+
+		unsigned int left = &node - &_nodes[0] + 1;
+		unsigned int right = node.right;
+		bool leftFirst = distanceToBox( point, _nodes[left].box ) < distanceToBox( point, _nodes[right].box );
+		stack.push_back( leftFirst ? right : left );
+		stack.push_back( leftFirst ? left : right );
+	}
+	if( found )
+		hit.distance = std::max( hit.distance, 0.0f );
+	return found;
+}
+
+unsigned int TubeSegmentBVH::queryRadius( const osg::Vec3& center, float radius, std::vector<Hit>& hits )
+{
+	prepare();
+	if( _nodes.empty() )
+		return 0;
+
+	unsigned int numHits = 0;
+	std::vector<unsigned int> stack( 1, 0 );
+	while( !stack.empty() )
+	{
+		const Node& node = _nodes[stack.back()];
+		stack.pop_back();
+		if( distanceToBox( center, node.box ) > radius )
+			continue;
+
+		if( node.count == 0 )
+		{
+			stack.push_back( &node - &_nodes[0] + 1 );
+			stack.push_back( node.right );
+			continue;
+		}
+
+		for( unsigned int i = node.first; i < node.first + node.count; i++ )
+		{
+			float best = radius;
+			Hit hit;
+			if( !nearestInTube( _tubeOrder[i], center, best, hit ) )
+				continue;
+			hit.distance = std::max( hit.distance, 0.0f );
+			hits.push_back( hit );
+			numHits++;
+		}
+	}
+	return numHits;
+}
+
+bool TubeSegmentBVH::nearestInTube( unsigned int tubeId, const osg::Vec3& point, float& best, Hit& hit ) const
+{
+	const Tube& tube = _tubes[tubeId];
+	const unsigned int numSegments = tube.getNumSegments();
+	const unsigned int numSections = tube.sections.size();
+	osg::Vec3 points[CURVE_SEGMENTS + 1];
+	bool found = false;
+
+	std::vector< std::pair<unsigned int, unsigned int> > stack( 1, std::make_pair( tube.levels.size() - 1, 0u ) );
+	while( !stack.empty() )
+	{
+		unsigned int level = stack.back().first;
+		unsigned int index = stack.back().second;
+		stack.pop_back();
+		if( distanceToBox( point, tube.levels[level][index] ) > std::max( best, 0.0f ) )
+			continue;
+
+		if( level > 0 )
+		{
+			const std::vector<osg::BoundingBox>& children = tube.levels[level - 1];
+			if( 2 * index + 1 < children.size() &&
+				distanceToBox( point, children[2 * index + 1] ) < distanceToBox( point, children[2 * index] ) )
+			{
+				stack.push_back( std::make_pair( level - 1, 2 * index ) );
+				stack.push_back( std::make_pair( level - 1, 2 * index + 1 ) );
+			}
+			else
+			{
+				if( 2 * index + 1 < children.size() )
+					stack.push_back( std::make_pair( level - 1, 2 * index + 1 ) );
+				stack.push_back( std::make_pair( level - 1, 2 * index ) );
+			}
+			continue;
+		}
+
+		unsigned int end = std::min( ( index + 1 ) * LEAF_SEGMENTS, numSegments );
+		for( unsigned int segment = index * LEAF_SEGMENTS; segment < end; segment++ )
+		{
+			sampleSegment( tube.sections[segment], tube.sections[std::min( segment + 1, numSections - 1 )], points );
+			for( unsigned int k = 0; k < CURVE_SEGMENTS; k++ )
+			{
+				float s;
+				float distance = distanceToSegment( point, points[k], points[k + 1], s ) - tube.radius;
+				if( distance >= best )
+					continue;
+
+				best = distance;
+				found = true;
+				hit.tubeId = tubeId;
+				hit.point = points[k] + ( points[k + 1] - points[k] ) * s;
+				hit.distance = distance;
+				setHitSegment( hit, segment, k, s, tube.distances );
+			}
+		}
+	}
+	return found;
+}
@@ -0,0 +1,154 @@
+#ifndef _TUBE_SEGMENT_BVH_
+#define _TUBE_SEGMENT_BVH_
+
+#include <osg/BoundingBox>
+#include <osg/Group>
+#include <osg/Referenced>
+#include <osg/Vec3>
+#include <osg/observer_ptr>
+
+#include "TubeSection.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+/*
+	Bounding volume hierarchy over the segments of many tubes, for picking and proximity queries. The
+	tubes are drawn as patches, which osgUtil::LineSegmentIntersector does not see, and scanning the
+	sections of every tube is too slow for large scenes.
+
+	Each segment is a capsule of the tube radius around the TubeCurve axis between two sections. The
+	sections of a tube are grouped by LEAF_SEGMENTS consecutive segments, which are close along a
+	trajectory, and the groups are bounded by a binary tree refit from the first changed section when
+	the tube is appended to. The tubes are bounded by a second hierarchy, built again when tubes are
+	added or removed and refit when they change, both lazily by the next query.
+
+	Everything is in the space of the sections, i.e. the local space of the tubes: the vertical scale
+	is applied, the transforms above the tubes are not. A hit gives the tube id, the segment, from
+	section \segment to the next one, and the distance along the tube, as distanceTo0.
+
+	The queries are not thread safe, they update the hierarchy.
+*/
+class TubeSegmentBVH : public osg::Referenced
+{
+public:
+	//! Segments bounded together, the leaves of the tree of a tube.
+	static const unsigned int LEAF_SEGMENTS = 8;
+
+	//! Polyline segments approximating the curve of a segment in the exact tests.
+	static const unsigned int CURVE_SEGMENTS = 4;
+
+	struct Hit
+	{
+		Hit() : tubeId( 0 ), segment( 0 ), t( 0.0f ), distanceTo0( 0.0f ), distance( 0.0f ) {}
+
+		unsigned int tubeId;
+		//! First section of the segment hit.
+		unsigned int segment;
+		//! Position along the segment, from 0 at its first section to 1 at the next one.
+		float t;
+		//! Distance from the first section of the tube along its axis.
+		float distanceTo0;
+		//! Surface point hit by pick, closest axis point for nearest and queryRadius.
+		osg::Vec3 point;
+		//! From the ray start for pick, to the tube surface for nearest and queryRadius, 0 inside the tube.
+		float distance;
+	};
+
+	TubeSegmentBVH();
+
+	//! Adds a tube of \radius around \sections, returns its id.
+	unsigned int addTube( const std::vector<TubeSection>& sections, float radius );
+
+	//! Replaces the tube \tubeId, adding it with this id if needed, e.g. to use the ids of a TubeBatchBuilder.
+	void setTube( unsigned int tubeId, const std::vector<TubeSection>& sections, float radius );
+
+	/*
+		Follows the tube \tubeId, whose sections are now \sections, the ones before \firstChangedSection
+		being unchanged, as TubeGeometryBuilder::appendTrajectory does. Only the changed leaves and the
+		tree above them are refit.
+	*/
+	void updateTube( unsigned int tubeId, const std::vector<TubeSection>& sections, unsigned int firstChangedSection );
+
+	//! Changes the radius of the capsules of the tube \tubeId.
+	void setTubeRadius( unsigned int tubeId, float radius );
+
+	//! The tube is not hit anymore, its id is not given again.
+	void removeTube( unsigned int tubeId );
+
+	//! Group drawing the tube, set by TubeGeometryBuilder and TubeBatchBuilder, NULL once deleted.
+	void setTubeGroup( unsigned int tubeId, osg::Group* group );
+
+	osg::Group* getTubeGroup( unsigned int tubeId ) const;
+
+	//! Tube ids given so far, including the removed tubes.
+	unsigned int getNumTubes() const { return _tubes.size(); }
+
+	/*
+		Finds the first tube surface along the segment from \start to \end. The tubes are grown by
+		\padding, e.g. the size of a few pixels at the tubes, so thin tubes can be picked.
+	*/
+	bool pick( const osg::Vec3& start, const osg::Vec3& end, Hit& hit, float padding = 0.0f );
+
+	//! Finds the tube surface closest to \point, if closer than \maxDistance.
+	bool nearest( const osg::Vec3& point, Hit& hit, float maxDistance = FLT_MAX );
+
+	/*
+		Appends to \hits the closest segment of every tube whose surface is closer than \radius to
+		\center, in no particular order. Returns the number of hits added.
+	*/
+	unsigned int queryRadius( const osg::Vec3& center, float radius, std::vector<Hit>& hits );
+
+	void clear();
+
+private:
+	struct Tube
+	{
+		Tube() : radius( 0.0f ), removed( false ) {}
+
+		std::vector<TubeSection> sections;
+		//! Distance of every section to the first one along the polyline, as TubeGeometryBuilder packs it.
+		std::vector<float> distances;
+		//! Leaf bounds first, then every level of the tree up to the root, all grown by the radius.
+		std::vector< std::vector<osg::BoundingBox> > levels;
+		float radius;
+		bool removed;
+		osg::observer_ptr<osg::Group> group;
+
+		unsigned int getNumSegments() const { return sections.empty() ? 0 : std::max<size_t>( sections.size() - 1, 1 ); }
+	};
+
+	//! Node of the tube hierarchy, in depth first order: the left child follows its parent.
+	struct Node
+	{
+		osg::BoundingBox box;
+		//! Range of _tubeOrder for a leaf, count is 0 for an inner node.
+		unsigned int first;
+		unsigned int count;
+		unsigned int right;
+	};
+
+	//! Computes the distances and the bounds of \tube from section \firstSection on.
+	void refit( Tube& tube, unsigned int firstSection );
+
+	//! Builds the tube hierarchy again or refits it, as the changes since the last query need.
+	void prepare();
+
+	unsigned int buildNode( unsigned int first, unsigned int count, std::vector<osg::Vec3>& centers );
+
+	//! Updates \hit if the ray from \start along the unit \dir hits the tube closer than \best.
+	bool pickTube( unsigned int tubeId, const osg::Vec3& start, const osg::Vec3& dir, float padding, float& best, Hit& hit ) const;
+
+	//! Updates \hit if the tube surface is closer to \point than \best, negative inside.
+	bool nearestInTube( unsigned int tubeId, const osg::Vec3& point, float& best, Hit& hit ) const;
+
+	std::vector<Tube> _tubes;
+	std::vector<Node> _nodes;
+	//! Ids of the tubes with sections, ordered by the leaves of the hierarchy.
+	std::vector<unsigned int> _tubeOrder;
+	bool _rebuild;
+	bool _refit;
+};
+
+#endif
@@ -0,0 +1,167 @@
+#include "TubeShaders.h"
+
+#include <osg/Notify>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+
+#include "TubePatchLayout.h"
+#include "TubeStyleTable.h"
+#include "TubeVertexCodec.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+namespace {
+
+struct ProgramKey
+{
+	TubeShaders::Kind kind;
+	unsigned int features;
+	unsigned int patchVertices;
+
+	bool operator<( const ProgramKey& other ) const
+	{
+		if( kind != other.kind )
+			return kind < other.kind;
+		if( features != other.features )
+			return features < other.features;
+		return patchVertices < other.patchVertices;
+	}
+};
+
+std::map< ProgramKey, osg::ref_ptr<osg::Program> > s_programs;
+// Guards the programs, tubes can be built on several threads, see TubeBuildService
+OpenThreads::Mutex s_programMutex;
+
+// Inserts the defines right after the #version line, which must stay the first statement of the shader
+std::string insertDefines( const std::string& source, const std::string& defines )
+{
+	std::string::size_type versionPos = source.find( "#version" );
+	if( versionPos == std::string::npos )
+		return defines + source;
+
+	std::string::size_type lineEnd = source.find( '\n', versionPos );
+	if( lineEnd == std::string::npos )
+		return source + "\n" + defines;
+
+	return source.substr( 0, lineEnd + 1 ) + defines + source.substr( lineEnd + 1 );
+}
+
+osg::Shader* createShader( osg::Shader::Type type, const std::string& name, const std::string& defines )
+{
+	osg::Shader* shader = new osg::Shader( type );
+	shader->setName( name );
+	shader->setShaderSource( insertDefines( TubeShaders::getSource( name ), defines ) );
+	return shader;
+}
+
+osg::Program* createProgram( TubeShaders::Kind kind, unsigned int features, unsigned int patchVertices )
+{
+	std::string defines = TubeShaders::getDefines( kind, features, patchVertices );
+
+	osg::Program* program = new osg::Program;
+	program->addBindAttribLocation( "distanceTo0", 6 );
+	if( kind == TubeShaders::TUBE )
+	{
+		program->addShader( createShader( osg::Shader::VERTEX, "tube.vert", defines ) );
+		program->addShader( createShader( osg::Shader::TESSCONTROL, "tube.control", defines ) );
+		program->addShader( createShader( osg::Shader::TESSEVALUATION, "tube.eval", defines ) );
+		program->addShader( createShader( osg::Shader::FRAGMENT, "tube.frag", defines ) );
+		program->addBindAttribLocation( "Normal", 2 );
+		program->addBindAttribLocation( "Binormal", 3 );
+		program->addBindAttribLocation( "Frame", 4 );
+		program->addBindAttribLocation( "tubeId", 7 );
+	}
+	else if( kind == TubeShaders::LINE )
+	{
+		program->addShader( createShader( osg::Shader::VERTEX, "tube_line.vert", defines ) );
+		program->addShader( createShader( osg::Shader::FRAGMENT, "tube_line.frag", defines ) );
+	}
+	else
+	{
+		program->addShader( createShader( osg::Shader::VERTEX, "tube_mesh.vert", defines ) );
+		program->addShader( createShader( osg::Shader::FRAGMENT, "tube.frag", defines ) );
+		program->addBindAttribLocation( "Normal", 2 );
+	}
+	return program;
+}
+
+}
+
+osg::Program* TubeShaders::getProgram( Kind kind, unsigned int features, unsigned int patchVertices )
+{
+	ProgramKey key;
+	key.kind = kind;
+	key.features = features;
+	key.patchVertices = kind == TUBE ? patchVertices : 0;
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock( s_programMutex );
+	osg::ref_ptr<osg::Program>& program = s_programs[key];
+	if( !program.valid() )
+		program = createProgram( kind, features, key.patchVertices );
+	return program.get();
+}
+
+std::string TubeShaders::getDefines( Kind kind, unsigned int features, unsigned int patchVertices )
+{
+	std::ostringstream defines;
+	if( features & COMPACT )
+	{
+		defines << "#define TUBE_COMPACT\n";
+		defines << "#define TUBE_POSITION_BLOCKS " << TubeVertexCodec::MAX_BLOCKS << "\n";
+	}
+	if( features & FLUX_TABLE )
+		defines << "#define TUBE_FLUX_TABLE\n";
+	if( features & BATCH )
+		defines << "#define TUBE_BATCH\n";
+	if( features & ( FLUX_TABLE | BATCH ) )
+		defines << "#define TUBE_TABLE_ROW_TUBES " << TubeStyleTable::TUBES_PER_ROW << "\n";
+	if( features & NO_FLUX )
+		defines << "#define TUBE_NO_FLUX\n";
+	if( features & NO_LIGHTING )
+		defines << "#define TUBE_NO_LIGHTING\n";
+	if( kind == TUBE )
+		defines << TubePatchLayout::getShaderDefines( patchVertices );
+	return defines.str();
+}
+
+std::string TubeShaders::getSource( const std::string& name )
+{
+	const char* shaderDir = getenv( "TUBE_SHADER_DIR" );
+	if( shaderDir && *shaderDir )
+	{
+		std::ifstream file( ( std::string( shaderDir ) + "/" + name ).c_str(), std::ios::in | std::ios::binary );
+		if( file )
+		{
+			std::ostringstream source;
+			source << file.rdbuf();
+			return source.str();
+		}
+		osg::notify(osg::WARN) << "Shader \"" << name << "\" not found in " << shaderDir << ", using the embedded one." << std::endl;
+	}
+
+	const char* embedded = getEmbeddedSource( name );
+	if( embedded )
+		return embedded;
+
+	osg::notify(osg::WARN) << "Shader \"" << name << "\" is not embedded." << std::endl;
+	return std::string();
+}
+
+const char* TubeShaders::getEmbeddedSource( const std::string& name )
+{
+	for( const EmbeddedSource* source = s_embeddedSources; source->name; source++ )
+	{
+		if( name == source->name )
+			return source->source;
+	}
+	return NULL;
+}
+
+unsigned int TubeShaders::getNumPrograms()
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock( s_programMutex );
+	return s_programs.size();
+}
@@ -0,0 +1,79 @@
+#ifndef _TUBE_SHADERS_
+#define _TUBE_SHADERS_
+
+#include <osg/Program>
+
+#include <string>
+
+/*
+	Shader sources and programs of the tubes.
+
+	The files of the shaders directory are embedded in the binary at build time by
+	cmake/EmbedShaders.cmake, so making a program reads no file. While working on the shaders, setting
+	the TUBE_SHADER_DIR environment variable to that directory makes the programs read the files instead.
+
+	A program is made once per variant and shared by every tube, it can be asked for from any thread.
+	The variants are specialized at compile time by the defines of getDefines: a disabled feature is
+	not in the shader at all instead of being skipped per fragment.
+*/
+class TubeShaders
+{
+public:
+	enum Kind
+	{
+		//! Patches tessellated by tube.control and tube.eval, shaded by tube.frag.
+		TUBE,
+		//! Line strip of the far tubes, tube_line.vert and tube_line.frag.
+		LINE,
+		//! Triangle strips of TubeMeshBuilder, tube_mesh.vert and tube.frag.
+		MESH
+	};
+
+	//! Features of a variant, a combination of these flags.
+	enum Feature
+	{
+		//! Vertices in the TubeVertexCodec layout, TUBE and LINE only.
+		COMPACT = 1 << 0,
+		//! Colors and flux read from the row of a TubeStyleTable given by the tubeTableId uniform.
+		FLUX_TABLE = 1 << 1,
+		//! Tubes of a TubeBatchBuilder, every parameter read from its TubeStyleTable. TUBE only.
+		BATCH = 1 << 2,
+		//! Drawn in their color, without the flux.
+		NO_FLUX = 1 << 3,
+		//! Without the lighting, the color is written as is.
+		NO_LIGHTING = 1 << 4
+	};
+
+	/*
+		Program of \kind with the \features flags. \patchVertices is the patch size of TUBE programs,
+		see TubePatchLayout, it is ignored by the other kinds.
+	*/
+	static osg::Program* getProgram( Kind kind, unsigned int features = 0, unsigned int patchVertices = 0 );
+
+	//! Defines inserted after the #version line of every shader of the variant.
+	static std::string getDefines( Kind kind, unsigned int features, unsigned int patchVertices );
+
+	/*
+		Source of the shader file \name, e.g. "tube.frag", from TUBE_SHADER_DIR when it is set, else
+		the embedded one. Empty and warned about when there is none.
+	*/
+	static std::string getSource( const std::string& name );
+
+	//! Embedded source of \name, NULL if it was not embedded.
+	static const char* getEmbeddedSource( const std::string& name );
+
+	//! Programs made so far.
+	static unsigned int getNumPrograms();
+
+	struct EmbeddedSource
+	{
+		const char* name;
+		const char* source;
+	};
+
+private:
+	//! Generated by cmake/EmbedShaders.cmake, terminated by a NULL name.
+	static const EmbeddedSource s_embeddedSources[];
+};
+
+#endif
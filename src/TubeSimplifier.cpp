@@ -0,0 +1,141 @@
+#include "TubeSimplifier.h"
+
+#include <osg/Timer>
+
+#include "TubeCurve.h"
+
+#include <algorithm>
+#include <cfloat>
+
+namespace {
+
+// Distance from \p to the segment from \a to \b
+float distanceToSegment( const osg::Vec3& p, const osg::Vec3& a, const osg::Vec3& b )
+{
+	osg::Vec3 ab = b - a;
+	osg::Vec3 ap = p - a;
+	float length2 = ab.length2();
+	if( length2 == 0.0f )
+		return ap.length();
+
+	float t = std::min( std::max( ( ap * ab ) / length2, 0.0f ), 1.0f );
+	return ( ap - ab * t ).length();
+}
+
+// Segments the curve of a span is measured on
+const unsigned int CURVE_SEGMENTS = 16;
+
+struct Span
+{
+	unsigned int first;
+	unsigned int last;
+	//! Importance of the section that split the span.
+	float parentImportance;
+};
+
+}
+
+TubeSimplifier::TubeSimplifier() :
+	_axis( LINEAR ), _buildTime( 0.0 )
+{
+}
+
+void TubeSimplifier::build( const std::vector<TubeSection>& sections )
+{
+	osg::Timer_t start = osg::Timer::instance()->tick();
+
+	_sections = sections;
+	unsigned int numSections = sections.size();
+	_importance.assign( numSections, 0.0f );
+	if( numSections > 0 )
+	{
+		_importance.front() = FLT_MAX;
+		_importance.back() = FLT_MAX;
+	}
+
+	// Douglas-Peucker with an explicit stack, long trajectories would overflow a recursive one
+	std::vector<Span> stack;
+	if( numSections > 2 )
+	{
+		Span whole = { 0, numSections - 1, FLT_MAX };
+		stack.push_back( whole );
+	}
+
+	// Curve of the span, sampled once for all its sections
+	std::vector<osg::Vec3> curve;
+
+	while( !stack.empty() )
+	{
+		Span span = stack.back();
+		stack.pop_back();
+
+		if( _axis == CURVE )
+			TubeCurve::sample( sections[span.first], sections[span.last], CURVE_SEGMENTS, curve );
+
+		const osg::Vec3& a = sections[span.first].position;
+		const osg::Vec3& b = sections[span.last].position;
+		unsigned int split = span.first + 1;
+		float maxDistance = -1.0f;
+		for( unsigned int i = span.first + 1; i < span.last; i++ )
+		{
+			float distance = _axis == CURVE ? TubeCurve::distanceToPolyline( sections[i].position, curve ) :
+				distanceToSegment( sections[i].position, a, b );
+			if( distance > maxDistance )
+			{
+				maxDistance = distance;
+				split = i;
+			}
+		}
+
+		// Clamped by the parent so that keeping a section implies keeping the one that split its span
+		float importance = std::min( maxDistance, span.parentImportance );
+		_importance[split] = importance;
+
+		if( split - span.first > 1 )
+		{
+			Span left = { span.first, split, importance };
+			stack.push_back( left );
+		}
+		if( span.last - split > 1 )
+		{
+			Span right = { split, span.last, importance };
+			stack.push_back( right );
+		}
+	}
+
+	_sortedImportance = _importance;
+	std::sort( _sortedImportance.begin(), _sortedImportance.end() );
+
+	_buildTime = osg::Timer::instance()->delta_m( start, osg::Timer::instance()->tick() );
+}
+
+unsigned int TubeSimplifier::getNumSections( float tolerance ) const
+{
+	return _sortedImportance.end() - std::upper_bound( _sortedImportance.begin(), _sortedImportance.end(), tolerance );
+}
+
+void TubeSimplifier::extract( float tolerance, std::vector<TubeSection>& simplified ) const
+{
+	simplified.clear();
+	simplified.reserve( getNumSections( tolerance ) );
+	for( unsigned int i = 0; i < _sections.size(); i++ )
+	{
+		if( _importance[i] > tolerance )
+			simplified.push_back( _sections[i] );
+	}
+}
+
+void TubeSimplifier::report( const std::vector<float>& tolerances, std::vector<LevelReport>& levels ) const
+{
+	levels.resize( tolerances.size() );
+	std::vector<TubeSection> simplified;
+	for( unsigned int i = 0; i < tolerances.size(); i++ )
+	{
+		osg::Timer_t start = osg::Timer::instance()->tick();
+		extract( tolerances[i], simplified );
+		levels[i].extractTime = osg::Timer::instance()->delta_m( start, osg::Timer::instance()->tick() );
+		levels[i].tolerance = tolerances[i];
+		levels[i].keptSections = simplified.size();
+		levels[i].droppedSections = _sections.size() - simplified.size();
+	}
+}
@@ -0,0 +1,83 @@
+#ifndef _TUBE_SIMPLIFIER_
+#define _TUBE_SIMPLIFIER_
+
+#include <osg/Referenced>
+
+#include "TubeSection.h"
+
+#include <vector>
+
+/*
+	Error bounded simplification of the sections of a tube, with every detail level computed at once.
+
+	build runs Douglas-Peucker over the sections and gives each one an importance: the largest
+	tolerance that still keeps it. The importance of a section is never more than the one of the
+	section that split its span, so the sections kept for a tolerance are those whose importance is
+	above it, and every dropped section is at most that tolerance away from the simplified tube axis.
+	A level is then a single pass over the importances, the frames are the ones of the full tube.
+
+	With the CURVE axis the deviation is measured to the TubeCurve between the span ends instead of the
+	segment, which is the axis tube.eval draws. The curve between two sections only depends on them,
+	so the bound holds the same way, and smooth trajectories keep far fewer sections for a tolerance.
+
+	Use it with no culling in the frame propagation, i.e. a curve tolerance of 0, as the culling has no
+	deviation bound. The tolerance is in world units; a tolerance relative to the tube radius is just
+	that fraction of the radius.
+*/
+class TubeSimplifier : public osg::Referenced
+{
+public:
+	struct LevelReport
+	{
+		float tolerance;
+		unsigned int keptSections;
+		unsigned int droppedSections;
+		//! Time to extract the level, in milliseconds.
+		double extractTime;
+	};
+
+	enum Axis
+	{
+		//! Straight segments between the kept sections.
+		LINEAR,
+		//! Hermite curve between the kept sections, see TubeCurve.
+		CURVE
+	};
+
+	TubeSimplifier();
+
+	//! Axis the dropped sections are measured to, used by the next build. Default is LINEAR.
+	void setAxis( Axis axis ) { _axis = axis; }
+
+	Axis getAxis() const { return _axis; }
+
+	//! Computes the importance of every section, the sections are kept by the simplifier.
+	void build( const std::vector<TubeSection>& sections );
+
+	const std::vector<TubeSection>& getSections() const { return _sections; }
+
+	//! The first and last sections are always kept, they have an infinite importance.
+	float getImportance( unsigned int section ) const { return _importance[section]; }
+
+	//! Number of sections kept for \tolerance, without extracting them.
+	unsigned int getNumSections( float tolerance ) const;
+
+	//! Writes to \simplified the sections whose distance to the full tube axis is at most \tolerance.
+	void extract( float tolerance, std::vector<TubeSection>& simplified ) const;
+
+	//! Extracts every level of \tolerances, reporting their size and extraction time.
+	void report( const std::vector<float>& tolerances, std::vector<LevelReport>& levels ) const;
+
+	//! Time the last build took, in milliseconds.
+	double getBuildTime() const { return _buildTime; }
+
+private:
+	Axis _axis;
+	std::vector<TubeSection> _sections;
+	std::vector<float> _importance;
+	//! Importances in increasing order, for getNumSections.
+	std::vector<float> _sortedImportance;
+	double _buildTime;
+};
+
+#endif
@@ -0,0 +1,218 @@
+#include "TubeStyleTable.h"
+
+#include <osg/State>
+#include <OpenThreads/ScopedLock>
+
+#include "TubeGeometryBuilder.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+static osg::Uniform* createFluxTimeUniform()
+{
+	osg::Uniform* fluxTimeUniform = new osg::Uniform( "fluxTime", 0.0f );
+	fluxTimeUniform->setUpdateCallback( new FluxTimeCallback );
+	return fluxTimeUniform;
+}
+
+// Created before main, so the threads building tubes never race for it
+static osg::ref_ptr<osg::Uniform> s_fluxTimeUniform = createFluxTimeUniform();
+
+/*
+	Uploads the table itself instead of letting the texture upload an image, which would send the whole
+	table again for any change. The table outlives the callback, it owns the texture holding it.
+*/
+class TubeStyleTable::Subload : public osg::Texture2D::SubloadCallback
+{
+public:
+	Subload( TubeStyleTable* table ) : _table( table ) {}
+
+	virtual void load( const osg::Texture2D&, osg::State& state ) const
+	{
+		_table->load( state.getContextID() );
+	}
+
+	virtual void subload( const osg::Texture2D&, osg::State& state ) const
+	{
+		_table->subload( state.getContextID() );
+	}
+
+private:
+	TubeStyleTable* _table;
+};
+
+TubeStyleTable::TubeStyleTable()
+{
+	_image = new osg::Image;
+	_image->allocateImage( TUBES_PER_ROW * TEXELS_PER_TUBE, 1, 1, GL_RGBA, GL_FLOAT );
+	_image->setInternalTextureFormat( GL_RGBA32F_ARB );
+
+	_texture = new osg::Texture2D;
+	_texture->setTextureSize( _image->s(), _image->t() );
+	_texture->setInternalFormat( GL_RGBA32F_ARB );
+	_texture->setSourceFormat( GL_RGBA );
+	_texture->setSourceType( GL_FLOAT );
+	_texture->setSubloadCallback( new Subload( this ) );
+	_texture->setFilter( osg::Texture::MIN_FILTER, osg::Texture::NEAREST );
+	_texture->setFilter( osg::Texture::MAG_FILTER, osg::Texture::NEAREST );
+	_texture->setWrap( osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE );
+	_texture->setWrap( osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE );
+	_texture->setResizeNonPowerOfTwoHint( false );
+}
+
+unsigned int TubeStyleTable::addTube( const TubeStyle& style )
+{
+	ScopedLock lock( _mutex );
+	unsigned int tubeId = _styles.size();
+	_styles.push_back( style );
+
+	// Grows the image one row at a time, keeping the texels already written. The contexts see the
+	// new size and specify the texture again.
+	int numRows = tubeId / TUBES_PER_ROW + 1;
+	if( numRows > _image->t() )
+	{
+		osg::ref_ptr<osg::Image> oldImage = _image;
+		_image = new osg::Image;
+		_image->allocateImage( TUBES_PER_ROW * TEXELS_PER_TUBE, numRows, 1, GL_RGBA, GL_FLOAT );
+		_image->setInternalTextureFormat( GL_RGBA32F_ARB );
+		memcpy( _image->data(), oldImage->data(), oldImage->getRowSizeInBytes() * oldImage->t() );
+		_texture->setTextureSize( _image->s(), _image->t() );
+	}
+
+	writeTexels( tubeId );
+	return tubeId;
+}
+
+void TubeStyleTable::setTube( unsigned int tubeId, const TubeStyle& style )
+{
+	ScopedLock lock( _mutex );
+	assert( tubeId < _styles.size() );
+	_styles[tubeId] = style;
+	writeTexels( tubeId );
+}
+
+TubeStyle TubeStyleTable::getTube( unsigned int tubeId ) const
+{
+	ScopedLock lock( _mutex );
+	assert( tubeId < _styles.size() );
+	return _styles[tubeId];
+}
+
+unsigned int TubeStyleTable::getNumTubes() const
+{
+	ScopedLock lock( _mutex );
+	return _styles.size();
+}
+
+void TubeStyleTable::setFluxEnabled( unsigned int tubeId, bool enabled )
+{
+	ScopedLock lock( _mutex );
+	assert( tubeId < _styles.size() );
+	if( _styles[tubeId].fluxEnabled == enabled )
+		return;
+	_styles[tubeId].fluxEnabled = enabled;
+	writeTexels( tubeId );
+}
+
+void TubeStyleTable::setFlux( unsigned int tubeId, bool fluxUp, float fluxSpeed, int fluxStep, const osg::Vec4& fluxColor )
+{
+	ScopedLock lock( _mutex );
+	assert( tubeId < _styles.size() );
+	TubeStyle& style = _styles[tubeId];
+	style.fluxUp = fluxUp;
+	style.fluxSpeed = fluxSpeed;
+	style.fluxStep = fluxStep;
+	style.fluxColor = fluxColor;
+	style.fluxEnabled = true;
+	writeTexels( tubeId );
+}
+
+void TubeStyleTable::apply( osg::StateSet* stateSet, unsigned int unit )
+{
+	stateSet->setTextureAttribute( unit, _texture.get() );
+	stateSet->addUniform( new osg::Uniform( "tubeTable", static_cast<int>( unit ) ) );
+	stateSet->addUniform( getFluxTimeUniform() );
+}
+
+osg::Uniform* TubeStyleTable::getFluxTimeUniform()
+{
+	return s_fluxTimeUniform.get();
+}
+
+void TubeStyleTable::writeTexels( unsigned int tubeId )
+{
+	const TubeStyle& style = _styles[tubeId];
+	osg::Vec4* texels = reinterpret_cast<osg::Vec4*>(
+		_image->data( ( tubeId % TUBES_PER_ROW ) * TEXELS_PER_TUBE, tubeId / TUBES_PER_ROW ) );
+
+	// Without flux both colors are the same, as disableFlux does for a single tube
+	float signedSpeed = style.fluxUp ? style.fluxSpeed : -style.fluxSpeed;
+	texels[0] = style.color;
+	texels[1] = style.fluxEnabled ? style.fluxColor : style.color;
+	texels[2] = osg::Vec4( style.radius, style.minRadius, static_cast<float>( style.fluxStep ), signedSpeed );
+
+	for( size_t i = 0; i < _contexts.size(); i++ )
+	{
+		ContextTable& context = _contexts[i];
+		if( context.rows == 0 )
+			continue;
+		if( context.dirtyBegin == context.dirtyEnd )
+		{
+			context.dirtyBegin = tubeId;
+			context.dirtyEnd = tubeId + 1;
+		}
+		else
+		{
+			context.dirtyBegin = std::min( context.dirtyBegin, tubeId );
+			context.dirtyEnd = std::max( context.dirtyEnd, tubeId + 1 );
+		}
+	}
+}
+
+void TubeStyleTable::load( unsigned int contextID )
+{
+	ScopedLock lock( _mutex );
+	if( contextID >= _contexts.size() )
+		_contexts.resize( contextID + 1 );
+
+	ContextTable& context = _contexts[contextID];
+	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, _image->s(), _image->t(), 0, GL_RGBA, GL_FLOAT, _image->data() );
+	context.rows = _image->t();
+	context.dirtyBegin = context.dirtyEnd = 0;
+}
+
+void TubeStyleTable::subload( unsigned int contextID )
+{
+	ScopedLock lock( _mutex );
+	if( contextID >= _contexts.size() )
+		_contexts.resize( contextID + 1 );
+
+	ContextTable& context = _contexts[contextID];
+	if( context.rows != _image->t() )
+	{
+		// The table grew, the texture is specified again with its new size
+		glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, _image->s(), _image->t(), 0, GL_RGBA, GL_FLOAT, _image->data() );
+		context.rows = _image->t();
+	}
+	else if( context.dirtyBegin != context.dirtyEnd )
+	{
+		int firstRow = context.dirtyBegin / TUBES_PER_ROW;
+		int lastRow = ( context.dirtyEnd - 1 ) / TUBES_PER_ROW;
+		if( firstRow == lastRow )
+		{
+			int firstTexel = ( context.dirtyBegin % TUBES_PER_ROW ) * TEXELS_PER_TUBE;
+			glTexSubImage2D( GL_TEXTURE_2D, 0, firstTexel, firstRow, ( context.dirtyEnd - context.dirtyBegin ) * TEXELS_PER_TUBE,
+				1, GL_RGBA, GL_FLOAT, _image->data( firstTexel, firstRow ) );
+		}
+		else
+		{
+			// Whole rows, a partial first and last row would need as many uploads
+			glTexSubImage2D( GL_TEXTURE_2D, 0, 0, firstRow, _image->s(), lastRow - firstRow + 1, GL_RGBA, GL_FLOAT,
+				_image->data( 0, firstRow ) );
+		}
+	}
+	context.dirtyBegin = context.dirtyEnd = 0;
+}
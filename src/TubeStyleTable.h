@@ -0,0 +1,119 @@
+#ifndef _TUBE_STYLE_TABLE_
+#define _TUBE_STYLE_TABLE_
+
+#include <osg/Vec4>
+#include <osg/Image>
+#include <osg/StateSet>
+#include <osg/Texture2D>
+#include <osg/Uniform>
+
+#include <OpenThreads/Mutex>
+
+#include <vector>
+
+/*
+	Appearance of a single tube, the same parameters createTubeWithLOD receives as arguments.
+*/
+struct TubeStyle
+{
+	TubeStyle( float radius_ = 0.4f, float minRadius_ = 4.0f, osg::Vec4 color_ = osg::Vec4( 1,0,0,1 ),
+		osg::Vec4 fluxColor_ = osg::Vec4( 1,1,1,1 ), bool fluxUp_ = true, float fluxSpeed_ = 20.0f, int fluxStep_ = 8,
+		bool fluxEnabled_ = true ) :
+		radius( radius_ ), minRadius( minRadius_ ), color( color_ ), fluxColor( fluxColor_ ),
+		fluxUp( fluxUp_ ), fluxSpeed( fluxSpeed_ ), fluxStep( fluxStep_ ), fluxEnabled( fluxEnabled_ )
+	{
+	}
+
+	float radius;
+	float minRadius;
+	osg::Vec4 color;
+	osg::Vec4 fluxColor;
+	bool fluxUp;
+	float fluxSpeed;
+	int fluxStep;
+	//! A tube without flux is drawn in its color only, the other flux parameters are kept.
+	bool fluxEnabled;
+
+	bool operator==( const TubeStyle& other ) const
+	{
+		return radius == other.radius && minRadius == other.minRadius && color == other.color &&
+			fluxColor == other.fluxColor && fluxUp == other.fluxUp && fluxSpeed == other.fluxSpeed &&
+			fluxStep == other.fluxStep && fluxEnabled == other.fluxEnabled;
+	}
+
+	bool operator!=( const TubeStyle& other ) const { return !( *this == other ); }
+};
+
+/*
+	Lookup table with the style of every tube of a batch, indexed by tube id. It is stored in a float
+	texture so all the tubes can be drawn with the same StateSet. Each tube uses TEXELS_PER_TUBE texels:
+	color, flux color and ( radius, minRadius, fluxStep, signed fluxSpeed ). The sign of the speed holds
+	the flux direction, and a tube whose flux is disabled gets its color as flux color.
+
+	Changing tubes only uploads the texels between the first and the last changed tube, once per
+	graphics context, so editing the flux of thousands of tubes touches no StateSet. The flux is
+	animated by the fluxTime uniform, shared by every table.
+*/
+class TubeStyleTable : public osg::Referenced
+{
+public:
+	static const int TUBES_PER_ROW = 1024;
+	static const int TEXELS_PER_TUBE = 3;
+
+	TubeStyleTable();
+
+	//! Returns the id of the new tube.
+	unsigned int addTube( const TubeStyle& style );
+
+	void setTube( unsigned int tubeId, const TubeStyle& style );
+
+	//! Turns the flux of a tube on or off, keeping the rest of its style.
+	void setFluxEnabled( unsigned int tubeId, bool enabled );
+
+	//! Changes the flux of a tube and enables it.
+	void setFlux( unsigned int tubeId, bool fluxUp, float fluxSpeed, int fluxStep, const osg::Vec4& fluxColor );
+
+	//! Copy of the style of a tube, taken under the lock since addTube may grow the styles meanwhile.
+	TubeStyle getTube( unsigned int tubeId ) const;
+
+	unsigned int getNumTubes() const;
+
+	//! Texture holding the table, it is updated whenever a tube style changes.
+	osg::Texture2D* getTexture() { return _texture.get(); }
+
+	//! Binds the table as the tubeTable sampler on texture \unit and adds the fluxTime uniform to \stateSet.
+	void apply( osg::StateSet* stateSet, unsigned int unit = 0 );
+
+	//! Animation time in seconds of every tube flux, updated once per frame.
+	static osg::Uniform* getFluxTimeUniform();
+
+private:
+	class Subload;
+
+	//! What a graphics context holds of the table.
+	struct ContextTable
+	{
+		ContextTable() : rows( 0 ), dirtyBegin( 0 ), dirtyEnd( 0 ) {}
+
+		//! Rows of the texture allocated in the context, 0 before it is loaded.
+		int rows;
+		//! Tubes changed since the last upload.
+		unsigned int dirtyBegin;
+		unsigned int dirtyEnd;
+	};
+
+	void writeTexels( unsigned int tubeId );
+
+	void load( unsigned int contextID );
+	void subload( unsigned int contextID );
+
+	std::vector<TubeStyle> _styles;
+	osg::ref_ptr<osg::Image> _image;
+	osg::ref_ptr<osg::Texture2D> _texture;
+
+	//! Guards the styles, the image and the contexts, the draw threads upload while the tubes change.
+	mutable OpenThreads::Mutex _mutex;
+	std::vector<ContextTable> _contexts;
+};
+
+#endif
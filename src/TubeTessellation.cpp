@@ -0,0 +1,84 @@
+#include "TubeTessellation.h"
+
+#include <osg/Uniform>
+#include <osg/Vec4>
+
+#include "TubeUniform.h"
+
+#include <algorithm>
+#include <cmath>
+
+void TubeTessellation::Settings::apply( osg::StateSet* stateSet ) const
+{
+	updateUniform( stateSet, "tessQuality", quality );
+	updateUniform( stateSet, "tessPixelsPerEdge", pixelsPerEdge );
+	updateUniform( stateSet, "tessMinLevels", minLevels );
+	updateUniform( stateSet, "tessMaxLevels", maxLevels );
+}
+
+TubeTessellation::Settings TubeTessellation::Settings::forPatch( unsigned int patchVertices ) const
+{
+	Settings settings = *this;
+	float segments = static_cast<float>( patchVertices > 1 ? patchVertices - 1 : 1 );
+	settings.maxLevels.y() = std::min( maxLevels.y(), segments * std::max( segmentSubdivisions, 1u ) );
+	return settings;
+}
+
+static float clampLevel( float level, float minLevel, float maxLevel )
+{
+	return std::min( std::max( level, minLevel ), maxLevel );
+}
+
+// Same as radialLevel in tube.control
+static float radialLevel( const osg::Vec4& clip, float radius, float minRadius, float projectionScale, float screenWidth,
+	const TubeTessellation::Settings& settings )
+{
+	float radiusPixels = std::max( radius * projectionScale * screenWidth * 0.5f / std::max( clip.w(), 1e-6f ), minRadius );
+	return clampLevel( settings.quality * 6.283185307179586f * radiusPixels / settings.pixelsPerEdge,
+		settings.minLevels.x(), settings.maxLevels.x() );
+}
+
+TubeTessellation::Levels TubeTessellation::computeLevels( const osg::Vec3* patchPositions, unsigned int numPatchVertices,
+	float radius, float minRadius, const osg::Matrix& modelViewProjection, float projectionScale, float screenWidth,
+	const Settings& settings )
+{
+	static const int numSamples = 5;
+
+	// The patch is measured on 5 of its vertices, including the first and the last ones
+	osg::Vec4 clip[numSamples];
+	bool behindEye = false;
+	for( int i = 0; i < numSamples; i++ )
+	{
+		const osg::Vec3& p = patchPositions[i * ( numPatchVertices - 1 ) / ( numSamples - 1 )];
+		clip[i] = osg::Vec4( p, 1.0f ) * modelViewProjection;
+		behindEye = behindEye || clip[i].w() <= 0.0f;
+	}
+
+	float lengthPixels = 0.0f;
+	for( int i = 1; i < numSamples; i++ )
+	{
+		float dx = ( clip[i].x() / clip[i].w() - clip[i-1].x() / clip[i-1].w() ) * screenWidth * 0.5f;
+		float dy = ( clip[i].y() / clip[i].w() - clip[i-1].y() / clip[i-1].w() ) * screenWidth * 0.5f;
+		lengthPixels += sqrtf( dx * dx + dy * dy );
+	}
+
+	float firstRing = radialLevel( clip[0], radius, minRadius, projectionScale, screenWidth, settings );
+	float lastRing = radialLevel( clip[numSamples - 1], radius, minRadius, projectionScale, screenWidth, settings );
+	float middle = radialLevel( clip[numSamples / 2], radius, minRadius, projectionScale, screenWidth, settings );
+
+	// Patches crossing the eye plane have no meaningful projection, they get the finest inner levels.
+	// The rings keep their own level, as the neighbour patch sharing them computes it, radialLevel
+	// gives the finest one behind the eye.
+	float lengthwise = behindEye ? settings.maxLevels.y() :
+		clampLevel( settings.quality * lengthPixels / settings.pixelsPerEdge, settings.minLevels.y(), settings.maxLevels.y() );
+	float radial = behindEye ? settings.maxLevels.x() : std::max( std::max( firstRing, lastRing ), middle );
+
+	Levels levels;
+	levels.inner[0] = radial;
+	levels.inner[1] = lengthwise;
+	levels.outer[0] = lengthwise;
+	levels.outer[1] = firstRing;
+	levels.outer[2] = lengthwise;
+	levels.outer[3] = lastRing;
+	return levels;
+}
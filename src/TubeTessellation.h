@@ -0,0 +1,65 @@
+#ifndef _TUBE_TESSELLATION_
+#define _TUBE_TESSELLATION_
+
+#include <osg/Matrix>
+#include <osg/StateSet>
+#include <osg/Vec2>
+#include <osg/Vec3>
+
+/*
+	Screen space selection of the tessellation levels of a tube patch. tube.control does this on the
+	GPU, computeLevels is the same computation on the CPU, so the selection can be tested and tuned
+	without a GL context. Keep both in sync.
+
+	The radial level is the projected circumference divided by the target edge length in pixels, the
+	lengthwise level is the projected length of the patch divided by the same length. Both are scaled
+	by the quality and clamped. The radius is never less than minRadius pixels, as in tube.eval.
+	The rings shared by consecutive patches get a level computed from that ring only, so adjacent
+	patches agree on it and no cracks appear between them.
+*/
+class TubeTessellation
+{
+public:
+	struct Settings
+	{
+		Settings() : quality( 1.0f ), pixelsPerEdge( 8.0f ), minLevels( 3.0f, 1.0f ), maxLevels( 10.0f, 64.0f ),
+			segmentSubdivisions( 4 ) {}
+
+		//! Scales every level, e.g. 0.5 halves the triangle count of each patch.
+		float quality;
+		//! Target length in pixels of the edges of the tessellated tube.
+		float pixelsPerEdge;
+		//! Clamps, x is the radial level and y the lengthwise level.
+		osg::Vec2 minLevels;
+		osg::Vec2 maxLevels;
+		/*
+			Lengthwise level per segment between two sections at most. tube.eval interpolates the sections
+			with TubeCurve, so more than 1 keeps a tube with few sections smooth when it is close.
+		*/
+		unsigned int segmentSubdivisions;
+
+		//! Copy whose lengthwise level is at most segmentSubdivisions per segment of a \patchVertices patch.
+		Settings forPatch( unsigned int patchVertices ) const;
+
+		//! Sets the uniforms read by tube.control, where they changed.
+		void apply( osg::StateSet* stateSet ) const;
+	};
+
+	struct Levels
+	{
+		//! gl_TessLevelInner: radial, lengthwise.
+		float inner[2];
+		//! gl_TessLevelOuter: seam, first ring, seam, last ring.
+		float outer[4];
+	};
+
+	/*
+		Levels of the patch with \numPatchVertices positions. \modelViewProjection transforms a position
+		to clip space, \projectionScale is the ( 0, 0 ) element of the projection matrix.
+	*/
+	static Levels computeLevels( const osg::Vec3* patchPositions, unsigned int numPatchVertices, float radius,
+		float minRadius, const osg::Matrix& modelViewProjection, float projectionScale, float screenWidth,
+		const Settings& settings );
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _TUBE_UNIFORM_
+#define _TUBE_UNIFORM_
+
+#include <osg/StateSet>
+#include <osg/Uniform>
+
+#include <string>
+
+/*
+	Sets the uniform \name of \stateSet to \value, adding it when the StateSet does not have it. A uniform
+	already holding \value is left alone: setting it would make every program using it upload it again.
+	Returns true if the StateSet changed.
+*/
+template<typename T>
+inline bool updateUniform( osg::StateSet* stateSet, const std::string& name, const T& value )
+{
+	osg::Uniform* uniform = stateSet->getUniform( name );
+	if( !uniform )
+	{
+		stateSet->addUniform( new osg::Uniform( name.c_str(), value ) );
+		return true;
+	}
+
+	T current;
+	if( uniform->get( current ) && !( current != value ) )
+		return false;
+	uniform->set( value );
+	return true;
+}
+
+#endif
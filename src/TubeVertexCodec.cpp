@@ -0,0 +1,293 @@
+#include "TubeVertexCodec.h"
+
+#include <osg/Uniform>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+static short toSnorm16( float value )
+{
+	float clamped = std::min( std::max( value, -1.0f ), 1.0f );
+	return static_cast<short>( floorf( clamped * TubeVertexCodec::SNORM16_MAX + 0.5f ) );
+}
+
+static float fromSnorm16( short value )
+{
+	return static_cast<float>( value ) / TubeVertexCodec::SNORM16_MAX;
+}
+
+// Angle between two unit vectors, acos is not accurate for small angles
+static float angleBetween( const osg::Vec3& a, const osg::Vec3& b )
+{
+	return atan2f( ( a ^ b ).length(), a * b );
+}
+
+bool TubeVertexCodec::Range::contains( const osg::Vec3& position ) const
+{
+	for( int i = 0; i < 3; i++ )
+	{
+		if( fabsf( position[i] - origin[i] ) > scale )
+			return false;
+	}
+	return true;
+}
+
+void TubeVertexCodec::Blocks::apply( osg::StateSet* stateSet ) const
+{
+	osg::Uniform* uniform = stateSet->getUniform( "positionBlocks" );
+	if( !uniform )
+	{
+		uniform = new osg::Uniform( osg::Uniform::FLOAT_VEC4, "positionBlocks", MAX_BLOCKS );
+		stateSet->addUniform( uniform );
+	}
+
+	// Setting an element dirties the uniform, the blocks that did not change are left alone
+	for( unsigned int i = 0; i < ranges.size() && i < MAX_BLOCKS; i++ )
+	{
+		osg::Vec4 block( ranges[i].origin, ranges[i].scale );
+		osg::Vec4 current;
+		if( !uniform->getElement( i, current ) || current != block )
+			uniform->setElement( i, block );
+	}
+}
+
+bool TubeVertexCodec::Blocks::get( const osg::StateSet* stateSet, Blocks& blocks )
+{
+	const osg::Uniform* uniform = stateSet ? stateSet->getUniform( "positionBlocks" ) : NULL;
+	if( !uniform )
+		return false;
+
+	blocks.ranges.resize( uniform->getNumElements() );
+	for( unsigned int i = 0; i < blocks.ranges.size(); i++ )
+	{
+		osg::Vec4 block;
+		if( !uniform->getElement( i, block ) )
+			return false;
+		blocks.ranges[i].origin = osg::Vec3( block[0], block[1], block[2] );
+		blocks.ranges[i].scale = block[3];
+	}
+	return true;
+}
+
+unsigned int TubeVertexCodec::getBlockSections( size_t numSections )
+{
+	unsigned int blockSections = MIN_BLOCK_SECTIONS;
+	while( numSections > static_cast<size_t>( blockSections ) * MAX_BLOCKS )
+		blockSections *= 2;
+	return blockSections;
+}
+
+TubeVertexCodec::Range TubeVertexCodec::computeRange( const std::vector<TubeSection>& sections, size_t begin, size_t end,
+	float growth )
+{
+	Range range;
+	if( begin >= end )
+		return range;
+
+	osg::Vec3 boxMin = sections[begin].position;
+	osg::Vec3 boxMax = sections[begin].position;
+	for( size_t i = begin + 1; i < end; i++ )
+	{
+		const osg::Vec3& p = sections[i].position;
+		for( int k = 0; k < 3; k++ )
+		{
+			boxMin[k] = std::min( boxMin[k], p[k] );
+			boxMax[k] = std::max( boxMax[k], p[k] );
+		}
+	}
+
+	range.origin = ( boxMin + boxMax ) * 0.5f;
+	float halfExtent = 0.0f;
+	float magnitude = 1.0f;
+	for( int k = 0; k < 3; k++ )
+	{
+		halfExtent = std::max( halfExtent, ( boxMax[k] - boxMin[k] ) * 0.5f * growth );
+		magnitude = std::max( magnitude, fabsf( range.origin[k] ) );
+	}
+	// A single point still needs a scale, and the float rounding of the center must stay inside it
+	range.scale = std::max( halfExtent * ( 1.0f + 1e-6f ), magnitude * 1e-6f );
+	return range;
+}
+
+// Range of block \block of \blocks, grown when the block is not full yet
+static TubeVertexCodec::Range computeBlockRange( const std::vector<TubeSection>& sections,
+	const TubeVertexCodec::Blocks& blocks, unsigned int block )
+{
+	size_t begin = static_cast<size_t>( block ) * blocks.blockSections;
+	size_t end = std::min( begin + blocks.blockSections, sections.size() );
+	return TubeVertexCodec::computeRange( sections, begin, end, end - begin < blocks.blockSections ? 2.0f : 1.0f );
+}
+
+TubeVertexCodec::Blocks TubeVertexCodec::computeBlocks( const std::vector<TubeSection>& sections )
+{
+	Blocks blocks;
+	blocks.blockSections = getBlockSections( sections.size() );
+	unsigned int numBlocks = blocks.getBlock( sections.size() + blocks.blockSections - 1 );
+	for( unsigned int i = 0; i < numBlocks; i++ )
+		blocks.ranges.push_back( computeBlockRange( sections, blocks, i ) );
+	return blocks;
+}
+
+size_t TubeVertexCodec::updateBlocks( const std::vector<TubeSection>& sections, size_t firstSection, Blocks& blocks )
+{
+	if( firstSection == 0 || getBlockSections( sections.size() ) != blocks.blockSections )
+	{
+		blocks = computeBlocks( sections );
+		return 0;
+	}
+
+	// The block of firstSection keeps its range if it still holds its sections, the next ones are new
+	size_t firstChanged = firstSection;
+	unsigned int firstBlock = blocks.getBlock( firstSection );
+	unsigned int numBlocks = blocks.getBlock( sections.size() + blocks.blockSections - 1 );
+	blocks.ranges.resize( std::min<size_t>( blocks.ranges.size(), numBlocks ) );
+	for( unsigned int i = firstBlock; i < numBlocks; i++ )
+	{
+		if( i < blocks.ranges.size() )
+		{
+			size_t end = std::min( static_cast<size_t>( i + 1 ) * blocks.blockSections, sections.size() );
+			bool contained = true;
+			for( size_t j = std::max( firstSection, static_cast<size_t>( i ) * blocks.blockSections ); j < end && contained; j++ )
+				contained = blocks.ranges[i].contains( sections[j].position );
+			if( contained )
+				continue;
+			blocks.ranges[i] = computeBlockRange( sections, blocks, i );
+			firstChanged = std::min( firstChanged, static_cast<size_t>( i ) * blocks.blockSections );
+		}
+		else
+			blocks.ranges.push_back( computeBlockRange( sections, blocks, i ) );
+	}
+	return firstChanged;
+}
+
+osg::Vec4s TubeVertexCodec::encodePosition( const osg::Vec3& position, const Range& range, unsigned int block )
+{
+	return osg::Vec4s( toSnorm16( ( position[0] - range.origin[0] ) / range.scale ),
+		toSnorm16( ( position[1] - range.origin[1] ) / range.scale ),
+		toSnorm16( ( position[2] - range.origin[2] ) / range.scale ), static_cast<short>( block ) );
+}
+
+osg::Vec3 TubeVertexCodec::decodePosition( const osg::Vec4s& encoded, const Range& range )
+{
+	return osg::Vec3( range.origin[0] + fromSnorm16( encoded[0] ) * range.scale,
+		range.origin[1] + fromSnorm16( encoded[1] ) * range.scale,
+		range.origin[2] + fromSnorm16( encoded[2] ) * range.scale );
+}
+
+osg::Vec3 TubeVertexCodec::decodePosition( const osg::Vec4s& encoded, const Blocks& blocks )
+{
+	unsigned int block = static_cast<unsigned short>( encoded[3] );
+	return block < blocks.ranges.size() ? decodePosition( encoded, blocks.ranges[block] ) : osg::Vec3();
+}
+
+osg::Vec4s TubeVertexCodec::encodeFrame( const osg::Vec3& normal, const osg::Vec3& binormal )
+{
+	// Rotation whose columns are the normal, the binormal and the tangent
+	osg::Vec3 n = normal;
+	n.normalize();
+	osg::Vec3 t = n ^ binormal;
+	t.normalize();
+	osg::Vec3 b = t ^ n;
+
+	float m00 = n[0], m10 = n[1], m20 = n[2];
+	float m01 = b[0], m11 = b[1], m21 = b[2];
+	float m02 = t[0], m12 = t[1], m22 = t[2];
+
+	float x, y, z, w;
+	float trace = m00 + m11 + m22;
+	if( trace > 0.0f )
+	{
+		float s = 0.5f / sqrtf( trace + 1.0f );
+		w = 0.25f / s;
+		x = ( m21 - m12 ) * s;
+		y = ( m02 - m20 ) * s;
+		z = ( m10 - m01 ) * s;
+	}
+	else if( m00 > m11 && m00 > m22 )
+	{
+		float s = 2.0f * sqrtf( 1.0f + m00 - m11 - m22 );
+		w = ( m21 - m12 ) / s;
+		x = 0.25f * s;
+		y = ( m01 + m10 ) / s;
+		z = ( m02 + m20 ) / s;
+	}
+	else if( m11 > m22 )
+	{
+		float s = 2.0f * sqrtf( 1.0f + m11 - m00 - m22 );
+		w = ( m02 - m20 ) / s;
+		x = ( m01 + m10 ) / s;
+		y = 0.25f * s;
+		z = ( m12 + m21 ) / s;
+	}
+	else
+	{
+		float s = 2.0f * sqrtf( 1.0f + m22 - m00 - m11 );
+		w = ( m10 - m01 ) / s;
+		x = ( m02 + m20 ) / s;
+		y = ( m12 + m21 ) / s;
+		z = 0.25f * s;
+	}
+
+	// q and -q are the same rotation, w is kept positive so every frame has a single encoding
+	float sign = w < 0.0f ? -1.0f : 1.0f;
+	return osg::Vec4s( toSnorm16( sign * x ), toSnorm16( sign * y ), toSnorm16( sign * z ), toSnorm16( sign * w ) );
+}
+
+void TubeVertexCodec::decodeFrame( const osg::Vec4s& encoded, osg::Vec3& normal, osg::Vec3& binormal )
+{
+	float x = fromSnorm16( encoded[0] );
+	float y = fromSnorm16( encoded[1] );
+	float z = fromSnorm16( encoded[2] );
+	float w = fromSnorm16( encoded[3] );
+	float norm = sqrtf( x * x + y * y + z * z + w * w );
+	if( norm > 0.0f )
+	{
+		x /= norm;
+		y /= norm;
+		z /= norm;
+		w /= norm;
+	}
+
+	// First and second columns of the rotation matrix of the quaternion
+	normal = osg::Vec3( 1.0f - 2.0f * ( y * y + z * z ), 2.0f * ( x * y + w * z ), 2.0f * ( x * z - w * y ) );
+	binormal = osg::Vec3( 2.0f * ( x * y - w * z ), 1.0f - 2.0f * ( x * x + z * z ), 2.0f * ( y * z + w * x ) );
+}
+
+TubeVertexCodec::Error TubeVertexCodec::measureError( const std::vector<TubeSection>& sections, const Blocks& blocks )
+{
+	Error error;
+	for( size_t i = 0; i < sections.size(); i++ )
+	{
+		const TubeSection& section = sections[i];
+		unsigned int block = blocks.getBlock( i );
+		osg::Vec3 position = decodePosition( encodePosition( section.position, blocks.ranges[block], block ), blocks );
+		error.position = std::max( error.position, ( position - section.position ).length() );
+
+		osg::Vec3 normal, binormal;
+		decodeFrame( encodeFrame( section.normal, section.binormal ), normal, binormal );
+		osg::Vec3 sectionNormal = section.normal;
+		sectionNormal.normalize();
+		osg::Vec3 sectionBinormal = section.binormal;
+		sectionBinormal.normalize();
+		error.normalAngle = std::max( error.normalAngle, angleBetween( normal, sectionNormal ) );
+		error.binormalAngle = std::max( error.binormalAngle, angleBetween( binormal, sectionBinormal ) );
+	}
+	return error;
+}
+
+float TubeVertexCodec::getPositionErrorBound( const Range& range )
+{
+	// Plus the float rounding of the decoded position, a few ulps of its magnitude
+	osg::Vec3 magnitude( fabsf( range.origin[0] ) + range.scale, fabsf( range.origin[1] ) + range.scale,
+		fabsf( range.origin[2] ) + range.scale );
+	return range.scale * sqrtf( 3.0f ) * 0.5f / SNORM16_MAX + magnitude.length() * 2.0f * FLT_EPSILON;
+}
+
+float TubeVertexCodec::getPositionErrorBound( const Blocks& blocks )
+{
+	float bound = 0.0f;
+	for( size_t i = 0; i < blocks.ranges.size(); i++ )
+		bound = std::max( bound, getPositionErrorBound( blocks.ranges[i] ) );
+	return bound;
+}
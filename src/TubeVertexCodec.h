@@ -0,0 +1,121 @@
+#ifndef _TUBE_VERTEX_CODEC_
+#define _TUBE_VERTEX_CODEC_
+
+#include <osg/StateSet>
+#include <osg/Vec3>
+#include <osg/Vec4s>
+
+#include "TubeSection.h"
+
+#include <vector>
+
+/*
+	Compact vertex layout of the tube sections, 20 bytes per vertex instead of the 40 of three Vec3 and
+	a float:
+	- the position, 3 snorm16 relative to the range of its block, origin + v / 32767 * scale, and the
+	  block in the fourth short
+	- the frame, a snorm16 quaternion rotating the x axis to the normal and the y axis to the binormal
+	- distanceTo0, kept as a float since the flux needs its precision along long tubes
+
+	The sections are split into blocks of consecutive sections, each one quantized in the cube around
+	its own positions, so the position error follows the extent of a block instead of the whole tube.
+	A tube has at most MAX_BLOCKS blocks, whose ranges are the positionBlocks uniform array.
+
+	The shorts are read unnormalized by tube.vert and tube_line.vert compiled with TUBE_COMPACT, which
+	decode them as decodePosition and decodeFrame do. Keep both in sync.
+*/
+class TubeVertexCodec
+{
+public:
+	static const int SNORM16_MAX = 32767;
+
+	//! Blocks of a tube, the size of the positionBlocks uniform array.
+	static const unsigned int MAX_BLOCKS = 128;
+
+	//! Sections per block of the tubes of up to MAX_BLOCKS times as many sections, longer tubes double it.
+	static const unsigned int MIN_BLOCK_SECTIONS = 256;
+
+	//! Cube the positions of a block are quantized in, from origin - scale to origin + scale on every axis.
+	struct Range
+	{
+		Range() : scale( 1.0f ) {}
+
+		osg::Vec3 origin;
+		float scale;
+
+		bool contains( const osg::Vec3& position ) const;
+	};
+
+	/*
+		Ranges of the blocks of a tube, block i holding the sections from i * blockSections to
+		( i + 1 ) * blockSections.
+	*/
+	struct Blocks
+	{
+		Blocks() : blockSections( MIN_BLOCK_SECTIONS ) {}
+
+		unsigned int getBlock( size_t section ) const { return static_cast<unsigned int>( section / blockSections ); }
+
+		//! Sets the positionBlocks uniform array read by the TUBE_COMPACT shaders, where it changed.
+		void apply( osg::StateSet* stateSet ) const;
+
+		//! Reads the ranges set by apply, returns false if \stateSet does not hold them. blockSections is not kept.
+		static bool get( const osg::StateSet* stateSet, Blocks& blocks );
+
+		unsigned int blockSections;
+		std::vector<Range> ranges;
+	};
+
+	//! Sections per block of a tube of \numSections sections, so it has MAX_BLOCKS blocks at most.
+	static unsigned int getBlockSections( size_t numSections );
+
+	/*
+		Range holding the positions of the sections from \begin to \end. The cube is grown \growth times
+		around its center.
+	*/
+	static Range computeRange( const std::vector<TubeSection>& sections, size_t begin, size_t end, float growth = 1.0f );
+
+	/*
+		Blocks of \sections. The last block, unless it is full, is grown twice around its center, so a tube
+		extended by appends needs to encode it again only now and then.
+	*/
+	static Blocks computeBlocks( const std::vector<TubeSection>& sections );
+
+	/*
+		Updates \blocks for the sections appended from \firstSection on, the ones before it being
+		unchanged. Returns the first section to encode again: \firstSection, the first section of the last
+		block when its range no longer holds it, or 0 when the tube outgrew its block size and every block
+		was computed again.
+	*/
+	static size_t updateBlocks( const std::vector<TubeSection>& sections, size_t firstSection, Blocks& blocks );
+
+	static osg::Vec4s encodePosition( const osg::Vec3& position, const Range& range, unsigned int block );
+	static osg::Vec3 decodePosition( const osg::Vec4s& encoded, const Range& range );
+	//! Decodes with the range of the block of \encoded.
+	static osg::Vec3 decodePosition( const osg::Vec4s& encoded, const Blocks& blocks );
+
+	//! The frame is made orthonormal before being encoded, the tangent is normal ^ binormal.
+	static osg::Vec4s encodeFrame( const osg::Vec3& normal, const osg::Vec3& binormal );
+	static void decodeFrame( const osg::Vec4s& encoded, osg::Vec3& normal, osg::Vec3& binormal );
+
+	//! Largest errors of the encoding, the angles are in radians.
+	struct Error
+	{
+		Error() : position( 0.0f ), normalAngle( 0.0f ), binormalAngle( 0.0f ) {}
+
+		float position;
+		float normalAngle;
+		float binormalAngle;
+	};
+
+	//! Encodes and decodes every section and measures the errors against the sections.
+	static Error measureError( const std::vector<TubeSection>& sections, const Blocks& blocks );
+
+	//! Largest position error of \range, half a quantization step along the diagonal plus the float rounding.
+	static float getPositionErrorBound( const Range& range );
+
+	//! Largest position error of the blocks.
+	static float getPositionErrorBound( const Blocks& blocks );
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include "TubeVertexSubload.h"
+
+#include <osg/BufferObject>
+#include <osg/RenderInfo>
+#include <osg/State>
+#include <OpenThreads/ScopedLock>
+
+#include <algorithm>
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+TubeVertexSubload::TubeVertexSubload( osg::Geometry* geometry )
+{
+	_arrays.push_back( geometry->getVertexArray() );
+	// Normal, binormal, compact frame and distanceTo0, whichever the layout has
+	static const unsigned int attributes[] = { 2, 3, 4, 6 };
+	for( unsigned int i = 0; i < 4; i++ )
+	{
+		if( geometry->getVertexAttribArray( attributes[i] ) )
+			_arrays.push_back( geometry->getVertexAttribArray( attributes[i] ) );
+	}
+}
+
+void TubeVertexSubload::dirtyVertices( unsigned int begin, unsigned int end )
+{
+	if( begin >= end )
+		return;
+
+	ScopedLock lock( _mutex );
+	for( size_t i = 0; i < _contexts.size(); i++ )
+	{
+		ContextRange& context = _contexts[i];
+		if( !context.loaded )
+			continue;
+		if( context.dirtyBegin == context.dirtyEnd )
+		{
+			context.dirtyBegin = begin;
+			context.dirtyEnd = end;
+		}
+		else
+		{
+			context.dirtyBegin = std::min( context.dirtyBegin, begin );
+			context.dirtyEnd = std::max( context.dirtyEnd, end );
+		}
+	}
+}
+
+void TubeVertexSubload::drawImplementation( osg::RenderInfo& renderInfo, const osg::Drawable* drawable ) const
+{
+	upload( *renderInfo.getState() );
+	drawable->drawImplementation( renderInfo );
+}
+
+void TubeVertexSubload::upload( osg::State& state ) const
+{
+	ScopedLock lock( _mutex );
+	unsigned int contextID = state.getContextID();
+	if( contextID >= _contexts.size() )
+		_contexts.resize( contextID + 1 );
+
+	// The first draw of a context loads the buffer objects whole, the changes after it are subloaded
+	ContextRange& context = _contexts[contextID];
+	context.loaded = true;
+	if( context.dirtyBegin == context.dirtyEnd )
+		return;
+
+	for( size_t i = 0; i < _arrays.size(); i++ )
+	{
+		const osg::Array* array = _arrays[i].get();
+		osg::GLBufferObject* glBufferObject = array->getOrCreateGLBufferObject( contextID );
+		if( !glBufferObject )
+			continue;
+
+		// Binding a dirty buffer object loads it whole, the range is then sent again, which is harmless
+		state.bindVertexBufferObject( glBufferObject );
+		unsigned int end = std::min( context.dirtyEnd, array->getNumElements() );
+		if( context.dirtyBegin >= end )
+			continue;
+		unsigned int elementSize = array->getElementSize();
+		glBufferObject->getExtensions()->glBufferSubData( GL_ARRAY_BUFFER_ARB,
+			glBufferObject->getOffset( array->getBufferIndex() ) + context.dirtyBegin * elementSize,
+			( end - context.dirtyBegin ) * elementSize,
+			static_cast<const char*>( array->getDataPointer() ) + context.dirtyBegin * elementSize );
+	}
+	context.dirtyBegin = context.dirtyEnd = 0;
+}
@@ -0,0 +1,56 @@
+#ifndef _TUBE_VERTEX_SUBLOAD_
+#define _TUBE_VERTEX_SUBLOAD_
+
+#include <osg/Array>
+#include <osg/Drawable>
+#include <osg/Geometry>
+
+#include <OpenThreads/Mutex>
+
+#include <vector>
+
+/*
+	Uploads the vertices of a tube that changed since the last draw instead of its whole arrays, so
+	growing a tube by appendTrajectory sends the new sections only. The arrays are not marked dirty
+	when they are written in place, the draw callback sends the changed range to the buffer object of
+	each graphics context with glBufferSubData before the drawable is drawn, as TubeStyleTable does
+	for its texture. Arrays that grew are marked dirty instead, their buffer object is then loaded
+	whole with its new size.
+
+	Every drawable reading the arrays, the chunks and the line, must have the same callback, the first
+	one drawn in a context uploads the range. A context that never drew the tube loads the whole
+	arrays through their buffer object.
+*/
+class TubeVertexSubload : public osg::Drawable::DrawCallback
+{
+public:
+	//! Uploads the vertex array and the vertex attribute arrays of \geometry, they must not be replaced.
+	TubeVertexSubload( osg::Geometry* geometry );
+
+	//! The vertices from \begin to \end were written in place, the next draw of every context uploads them.
+	void dirtyVertices( unsigned int begin, unsigned int end );
+
+	virtual void drawImplementation( osg::RenderInfo& renderInfo, const osg::Drawable* drawable ) const;
+
+private:
+	//! Vertices a graphics context has not received yet.
+	struct ContextRange
+	{
+		ContextRange() : loaded( false ), dirtyBegin( 0 ), dirtyEnd( 0 ) {}
+
+		//! Set once the context drew the tube, its buffer objects were loaded whole then.
+		bool loaded;
+		unsigned int dirtyBegin;
+		unsigned int dirtyEnd;
+	};
+
+	void upload( osg::State& state ) const;
+
+	std::vector< osg::ref_ptr<osg::Array> > _arrays;
+
+	//! Guards the ranges, the draw threads upload while the tube grows.
+	mutable OpenThreads::Mutex _mutex;
+	mutable std::vector<ContextRange> _contexts;
+};
+
+#endif
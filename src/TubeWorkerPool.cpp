@@ -0,0 +1,192 @@
+#include "TubeWorkerPool.h"
+
+#include <OpenThreads/ScopedLock>
+
+#include <algorithm>
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+class TubeWorkerPool::WorkerThread : public OpenThreads::Thread
+{
+public:
+	WorkerThread( TubeWorkerPool* pool, unsigned int workerIndex ) : _pool( pool ), _workerIndex( workerIndex )
+	{
+	}
+
+	virtual void run()
+	{
+		_pool->workerLoop( _workerIndex );
+	}
+
+private:
+	TubeWorkerPool* _pool;
+	unsigned int _workerIndex;
+};
+
+static OpenThreads::Mutex s_instanceMutex;
+static TubeWorkerPool* s_instance = NULL;
+
+TubeWorkerPool* TubeWorkerPool::instance()
+{
+	ScopedLock lock( s_instanceMutex );
+	if( !s_instance )
+		s_instance = new TubeWorkerPool;
+	return s_instance;
+}
+
+TubeWorkerPool::TubeWorkerPool( unsigned int numWorkers ) :
+	_generation( 0 ), _pending( 0 ), _quit( false ), _task( NULL ), _grainSize( 1 )
+{
+	if( numWorkers == 0 )
+		numWorkers = std::max( OpenThreads::GetNumberOfProcessors(), 1 );
+
+	for( unsigned int i = 0; i < numWorkers; i++ )
+	{
+		WorkRange* range = new WorkRange;
+		range->begin = range->end = 0;
+		_ranges.push_back( range );
+	}
+
+	// Worker 0 is the thread calling parallelFor
+	for( unsigned int i = 1; i < numWorkers; i++ )
+	{
+		WorkerThread* thread = new WorkerThread( this, i );
+		_threads.push_back( thread );
+		thread->start();
+	}
+}
+
+TubeWorkerPool::~TubeWorkerPool()
+{
+	{
+		ScopedLock lock( _stateMutex );
+		_quit = true;
+		_wakeCondition.broadcast();
+	}
+
+	for( unsigned int i = 0; i < _threads.size(); i++ )
+	{
+		_threads[i]->join();
+		delete _threads[i];
+	}
+
+	for( unsigned int i = 0; i < _ranges.size(); i++ )
+		delete _ranges[i];
+}
+
+void TubeWorkerPool::parallelFor( unsigned int count, Task& task, unsigned int grainSize )
+{
+	if( count == 0 )
+		return;
+
+	ScopedLock runLock( _runMutex );
+
+	unsigned int numWorkers = _ranges.size();
+	for( unsigned int i = 0; i < numWorkers; i++ )
+	{
+		// 64 bits intermediate so count * numWorkers does not overflow
+		_ranges[i]->begin = static_cast<unsigned int>( static_cast<unsigned long long>( count ) * i / numWorkers );
+		_ranges[i]->end = static_cast<unsigned int>( static_cast<unsigned long long>( count ) * ( i + 1 ) / numWorkers );
+	}
+	_task = &task;
+	_grainSize = std::max( grainSize, 1u );
+
+	{
+		ScopedLock lock( _stateMutex );
+		_pending = _threads.size();
+		_generation++;
+		_wakeCondition.broadcast();
+	}
+
+	workUntilDone( 0 );
+
+	{
+		ScopedLock lock( _stateMutex );
+		while( _pending > 0 )
+			_doneCondition.wait( &_stateMutex );
+	}
+	_task = NULL;
+}
+
+void TubeWorkerPool::workerLoop( unsigned int workerIndex )
+{
+	unsigned int lastGeneration = 0;
+	for( ;; )
+	{
+		{
+			ScopedLock lock( _stateMutex );
+			while( _generation == lastGeneration && !_quit )
+				_wakeCondition.wait( &_stateMutex );
+			if( _quit )
+				return;
+			lastGeneration = _generation;
+		}
+
+		workUntilDone( workerIndex );
+
+		{
+			ScopedLock lock( _stateMutex );
+			if( --_pending == 0 )
+				_doneCondition.signal();
+		}
+	}
+}
+
+void TubeWorkerPool::workUntilDone( unsigned int workerIndex )
+{
+	unsigned int begin, end;
+	for( ;; )
+	{
+		if( popLocal( workerIndex, begin, end ) )
+		{
+			for( unsigned int i = begin; i < end; i++ )
+				_task->run( i, workerIndex );
+		}
+		else if( !steal( workerIndex ) )
+		{
+			// Indices are never given back, so once every range is empty the loop is over for this worker
+			return;
+		}
+	}
+}
+
+bool TubeWorkerPool::popLocal( unsigned int workerIndex, unsigned int& begin, unsigned int& end )
+{
+	WorkRange* range = _ranges[workerIndex];
+	ScopedLock lock( range->mutex );
+	if( range->begin >= range->end )
+		return false;
+
+	begin = range->begin;
+	end = std::min( range->begin + _grainSize, range->end );
+	range->begin = end;
+	return true;
+}
+
+bool TubeWorkerPool::steal( unsigned int workerIndex )
+{
+	unsigned int numWorkers = _ranges.size();
+	for( unsigned int i = 1; i < numWorkers; i++ )
+	{
+		WorkRange* victim = _ranges[( workerIndex + i ) % numWorkers];
+		unsigned int begin, end;
+		{
+			ScopedLock lock( victim->mutex );
+			if( victim->begin >= victim->end )
+				continue;
+
+			// Takes the back half, the victim keeps working on the front of its range
+			unsigned int half = ( victim->end - victim->begin + 1 ) / 2;
+			end = victim->end;
+			begin = end - half;
+			victim->end = begin;
+		}
+
+		WorkRange* own = _ranges[workerIndex];
+		ScopedLock lock( own->mutex );
+		own->begin = begin;
+		own->end = end;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,74 @@
+#ifndef _TUBE_WORKER_POOL_
+#define _TUBE_WORKER_POOL_
+
+#include <OpenThreads/Mutex>
+#include <OpenThreads/Condition>
+#include <OpenThreads/Thread>
+
+#include <vector>
+
+/*
+	Fixed set of worker threads running parallel loops. The index range of a loop is split evenly
+	between the workers, and a worker that runs out of indices steals half of the remaining range of
+	another one, so uneven work ( e.g. trajectories of very different sizes ) stays balanced.
+	The calling thread takes part in the loop as worker 0.
+*/
+class TubeWorkerPool
+{
+public:
+	class Task
+	{
+	public:
+		virtual ~Task() {}
+
+		//! Processes one index of the loop. \workerIndex is in [0, getNumWorkers()) and can select per worker scratch data.
+		virtual void run( unsigned int index, unsigned int workerIndex ) = 0;
+	};
+
+	//! \numWorkers includes the calling thread, 0 means one worker per processor.
+	TubeWorkerPool( unsigned int numWorkers = 0 );
+	~TubeWorkerPool();
+
+	unsigned int getNumWorkers() const { return _ranges.size(); }
+
+	/*
+		Runs \task for every index in [0, count) and returns when all of them are done. Indices are
+		taken in chunks of \grainSize. Loops are serialized, a task must not start another loop on the
+		same pool.
+	*/
+	void parallelFor( unsigned int count, Task& task, unsigned int grainSize = 1 );
+
+	//! Pool shared by the bulk builders, created on first use with one worker per processor.
+	static TubeWorkerPool* instance();
+
+private:
+	class WorkerThread;
+
+	struct WorkRange
+	{
+		OpenThreads::Mutex mutex;
+		unsigned int begin;
+		unsigned int end;
+	};
+
+	bool popLocal( unsigned int workerIndex, unsigned int& begin, unsigned int& end );
+	bool steal( unsigned int workerIndex );
+	void workUntilDone( unsigned int workerIndex );
+	void workerLoop( unsigned int workerIndex );
+
+	std::vector<WorkRange*> _ranges;
+	std::vector<WorkerThread*> _threads;
+
+	OpenThreads::Mutex _runMutex;
+	OpenThreads::Mutex _stateMutex;
+	OpenThreads::Condition _wakeCondition;
+	OpenThreads::Condition _doneCondition;
+	unsigned int _generation;
+	unsigned int _pending;
+	bool _quit;
+
+	Task* _task;
+	unsigned int _grainSize;
+};
+
+#endif
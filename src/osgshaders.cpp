@@ -25,16 +25,31 @@
  * the OpenGL Shading Language.
 */
 
+#include <osg/AnimationPath>
+#include <osg/ArgumentParser>
 #include <osg/Notify>
+#include <osg/Timer>
+#include <osgGA/AnimationPathManipulator>
 #include <osgGA/GUIEventAdapter>
 #include <osgGA/GUIActionAdapter>
 #include <osgDB/ReadFile>
 #include <osgUtil/Optimizer>
 #include <osgViewer/Viewer>
+#include <osgViewer/ViewerEventHandlers>
 #include <osgGA/StateSetManipulator>
 #include <osg/ShapeDrawable>
 
+#include "TrajectoryReader.h"
+#include "TubeBundleBuilder.h"
 #include "TubeGeometryBuilder.h"
+#include "TubeCameraUniforms.h"
+#include "TubeBuildStats.h"
+#include "TubePatchLayout.h"
+
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
 
 using namespace osg;
 
@@ -55,7 +70,7 @@ class KeyHandler: public osgGA::GUIEventHandler
 };
 
 ///////////////////////////////////////////////////////////////////////////
-std::vector<osg::Vec3> genTrajectory( int numPoints )
+std::vector<osg::Vec3> genTrajectory( int numPoints, const osg::Vec3& offset = osg::Vec3() )
 {
 	std::vector<osg::Vec3> trajectory;
 
@@ -63,17 +78,282 @@ std::vector<osg::Vec3> genTrajectory( int numPoints )
 	for( int i = 0; i < numPoints; i++ )
 	{
 		delta = 0.2 * i;
-		trajectory.push_back( osg::Vec3( sin( delta ), delta, cos( delta ) ) );
+		trajectory.push_back( osg::Vec3( sin( delta ), delta, cos( delta ) ) + offset );
 	}
 	return trajectory;
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Load test
+
+/*
+	Writes the timings of every frame as CSV, in milliseconds. The draw and GPU times of a frame are
+	known a few frames later, so a row is written LAG frames after its frame, from the stats history.
+*/
+class FrameRecorder
+{
+public:
+	static const unsigned int LAG = 8;
+
+	FrameRecorder( std::ostream& out, osgViewer::Viewer& viewer ) :
+		_out( out ), _viewerStats( viewer.getViewerStats() ), _cameraStats( viewer.getCamera()->getStats() ),
+		_nextRow( 0 ), _started( false ), _pendingBuildMs( 0.0 )
+	{
+		_viewerStats->collectStats( "frame_rate", true );
+		_viewerStats->collectStats( "event", true );
+		_viewerStats->collectStats( "update", true );
+		if( _cameraStats.valid() )
+		{
+			_cameraStats->collectStats( "rendering", true );
+			_cameraStats->collectStats( "gpu", true );
+		}
+		_out << "frame,frame_ms,event_ms,update_ms,cull_ms,draw_ms,gpu_ms,build_ms" << std::endl;
+	}
+
+	//! Time spent building tubes, counted in the next recorded frame.
+	void addBuildTime( double ms ) { _pendingBuildMs += ms; }
+
+	void frameDone( unsigned int frameNumber )
+	{
+		if( !_started )
+		{
+			_nextRow = frameNumber;
+			_started = true;
+		}
+		_buildMs[frameNumber] = _pendingBuildMs;
+		_pendingBuildMs = 0.0;
+
+		for( ; _nextRow + LAG <= frameNumber; _nextRow++ )
+			writeRow( _nextRow );
+	}
+
+	//! Writes the frames not written yet, with the timings that arrived.
+	void finish( unsigned int lastFrameNumber )
+	{
+		for( ; _started && _nextRow <= lastFrameNumber; _nextRow++ )
+			writeRow( _nextRow );
+		_out.flush();
+	}
+
+private:
+	void writeTime( osg::Stats* stats, unsigned int frameNumber, const std::string& attribute )
+	{
+		double seconds;
+		_out << ",";
+		if( stats && stats->getAttribute( frameNumber, attribute, seconds ) )
+			_out << seconds * 1000.0;
+	}
+
+	void writeRow( unsigned int frameNumber )
+	{
+		_out << frameNumber;
+		writeTime( _viewerStats.get(), frameNumber, "Frame duration" );
+		writeTime( _viewerStats.get(), frameNumber, "Event traversal time taken" );
+		writeTime( _viewerStats.get(), frameNumber, "Update traversal time taken" );
+		writeTime( _cameraStats.get(), frameNumber, "Cull traversal time taken" );
+		writeTime( _cameraStats.get(), frameNumber, "Draw traversal time taken" );
+		writeTime( _cameraStats.get(), frameNumber, "GPU draw time taken" );
+		_out << "," << _buildMs[frameNumber] << "\n";
+		_buildMs.erase( frameNumber );
+	}
+
+	std::ostream& _out;
+	osg::ref_ptr<osg::Stats> _viewerStats;
+	osg::ref_ptr<osg::Stats> _cameraStats;
+	unsigned int _nextRow;
+	bool _started;
+	double _pendingBuildMs;
+	std::map<unsigned int, double> _buildMs;
+};
 
-int main(int, char **)
+// Places the camera of frame \frame out of \numFrames, along \path, or on an orbit around \bound without one
+void placeCamera( osg::Camera* camera, osg::AnimationPath* path, const osg::BoundingSphere& bound,
+	unsigned int frame, unsigned int numFrames )
 {
-    // construct the viewer.
-    osgViewer::Viewer viewer;
-	viewer.setUpViewInWindow(100,100,700,300);
+	double t = numFrames > 1 ? static_cast<double>( frame ) / ( numFrames - 1 ) : 0.0;
+	if( path )
+	{
+		osg::Matrixd matrix;
+		path->getMatrix( path->getFirstTime() + t * path->getPeriod(), matrix );
+		camera->setViewMatrix( osg::Matrixd::inverse( matrix ) );
+		return;
+	}
+
+	double angle = 2.0 * osg::PI * t;
+	double distance = 2.5 * bound.radius();
+	osg::Vec3d eye = bound.center() + osg::Vec3d( cos( angle ) * distance, 0.3 * distance, sin( angle ) * distance );
+	camera->setViewMatrixAsLookAt( eye, bound.center(), osg::Vec3d( 0.0, 1.0, 0.0 ) );
+}
+
+// Builds the tubes of a trajectory file as they are read, or adds them to \bundle when not NULL
+class TubeFileBuilder : public TrajectoryReader::Consumer
+{
+public:
+	TubeFileBuilder( TubeGeometryBuilder& builder, osg::Group* parent, float radius, float minRadius,
+		const osg::Vec4& color, const osg::Vec4& fluxColor, int fluxSpeed, int fluxStep, int sectionVertices, int lineWidth,
+		TubeBundleBuilder* bundle = NULL ) :
+		_builder( builder ), _parent( parent ), _radius( radius ), _minRadius( minRadius ), _color( color ),
+		_fluxColor( fluxColor ), _fluxSpeed( fluxSpeed ), _fluxStep( fluxStep ), _sectionVertices( sectionVertices ),
+		_lineWidth( lineWidth ), _bundle( bundle )
+	{
+	}
+
+	virtual void consume( const TrajectoryReader::Chunk&, const std::vector< std::vector<TubeSection> >& sections )
+	{
+		for( unsigned int i = 0; i < sections.size(); i++ )
+		{
+			if( sections[i].size() < 2 )
+				continue;
+			if( _bundle )
+			{
+				_bundle->addTube( sections[i], TubeStyle( _radius, _minRadius, _color, _fluxColor, true, _fluxSpeed, _fluxStep ) );
+				continue;
+			}
+			_builder.setSections( sections[i] );
+			osg::Group* tube = new osg::Group;
+			_builder.createTubeWithLOD( tube, NULL, _radius, _minRadius, _color, _fluxColor, true, _fluxSpeed, _fluxStep,
+				_sectionVertices, _lineWidth );
+			_parent->addChild( tube );
+		}
+	}
+
+private:
+	TubeGeometryBuilder& _builder;
+	osg::Group* _parent;
+	float _radius;
+	float _minRadius;
+	osg::Vec4 _color;
+	osg::Vec4 _fluxColor;
+	int _fluxSpeed;
+	int _fluxStep;
+	int _sectionVertices;
+	int _lineWidth;
+	TubeBundleBuilder* _bundle;
+};
+
+int main( int argc, char** argv )
+{
+	osg::ArgumentParser arguments( &argc, argv );
+	osg::ApplicationUsage* usage = arguments.getApplicationUsage();
+	usage->setApplicationName( arguments.getApplicationName() );
+	usage->setCommandLineUsage( arguments.getApplicationName() + " [options]" );
+	usage->addCommandLineOption( "--tubes <n>", "Number of tubes, on a grid. Default 1." );
+	usage->addCommandLineOption( "--points <n>", "Points of each tube. Default 600." );
+	usage->addCommandLineOption( "--trajectories <file>", "Builds the tubes of a trajectory file instead, see TrajectoryReader." );
+	usage->addCommandLineOption( "--radius <r>", "Tube radius. Default 0.4." );
+	usage->addCommandLineOption( "--bundle", "Draws the tubes as a bundle, clustered into proxy tubes from afar." );
+	usage->addCommandLineOption( "--mesh", "Builds triangle strips on the CPU instead of tessellating." );
+	usage->addCommandLineOption( "--patch-vertices <n>", "Sections per patch, 0 for the largest the GPU allows." );
+	usage->addCommandLineOption( "--chunk-patches <n>", "Patches per culled chunk, 0 for a single chunk. Default 8." );
+	usage->addCommandLineOption( "--compact", "Compact vertex layout." );
+	usage->addCommandLineOption( "--no-lighting", "Unlit tubes." );
+	usage->addCommandLineOption( "--quality <q>", "Scales the tessellation levels. Default 1." );
+	usage->addCommandLineOption( "--pixels-per-edge <p>", "Target edge length in pixels. Default 8." );
+	usage->addCommandLineOption( "--max-levels <radial> <lengthwise>", "Tessellation level clamps. Default 10 64." );
+	usage->addCommandLineOption( "--segment-subdivisions <n>", "Lengthwise level per segment at most. Default 4." );
+	usage->addCommandLineOption( "--window <x> <y> <width> <height>", "Window placement. Default 100 100 700 300." );
+	usage->addCommandLineOption( "--offscreen <width> <height>", "Renders to a pbuffer instead of a window." );
+	usage->addCommandLineOption( "--frames <n>", "Renders n frames along the camera path and exits." );
+	usage->addCommandLineOption( "--camera-path <file>", "osg::AnimationPath followed by the camera, an orbit by default." );
+	usage->addCommandLineOption( "--record <file>", "Writes the frame and build timings to a CSV file, with --frames." );
+
+	if( arguments.read( "-h" ) || arguments.read( "--help" ) )
+	{
+		usage->write( std::cout, osg::ApplicationUsage::COMMAND_LINE_OPTION );
+		return 0;
+	}
+
+	unsigned int numTubes = 1;
+	unsigned int numPoints = 600;
+	std::string trajectoryFile;
+	float _tubeRadius = 0.4f;
+	unsigned int patchVertices = 0;
+	unsigned int chunkPatches = 8;
+	TubeTessellation::Settings tessellation;
+	int windowX = 100, windowY = 100, windowWidth = 700, windowHeight = 300;
+	int offscreenWidth = 0, offscreenHeight = 0;
+	unsigned int numFrames = 0;
+	std::string cameraPathFile;
+	std::string recordFile;
+	arguments.read( "--tubes", numTubes );
+	arguments.read( "--points", numPoints );
+	arguments.read( "--trajectories", trajectoryFile );
+	arguments.read( "--radius", _tubeRadius );
+	bool bundle = arguments.read( "--bundle" );
+	bool mesh = arguments.read( "--mesh" );
+	arguments.read( "--patch-vertices", patchVertices );
+	arguments.read( "--chunk-patches", chunkPatches );
+	bool compact = arguments.read( "--compact" );
+	bool lighting = !arguments.read( "--no-lighting" );
+	arguments.read( "--quality", tessellation.quality );
+	arguments.read( "--pixels-per-edge", tessellation.pixelsPerEdge );
+	arguments.read( "--max-levels", tessellation.maxLevels.x(), tessellation.maxLevels.y() );
+	arguments.read( "--segment-subdivisions", tessellation.segmentSubdivisions );
+	arguments.read( "--window", windowX, windowY, windowWidth, windowHeight );
+	arguments.read( "--offscreen", offscreenWidth, offscreenHeight );
+	arguments.read( "--frames", numFrames );
+	arguments.read( "--camera-path", cameraPathFile );
+	arguments.read( "--record", recordFile );
+
+	osg::ref_ptr<osg::AnimationPath> cameraPath;
+	if( !cameraPathFile.empty() )
+	{
+		std::ifstream pathStream( cameraPathFile.c_str() );
+		cameraPath = new osg::AnimationPath;
+		cameraPath->read( pathStream );
+		if( !pathStream.eof() || cameraPath->empty() )
+		{
+			osg::notify(osg::FATAL) << "Can not read the camera path \"" << cameraPathFile << "\"." << std::endl;
+			return 1;
+		}
+	}
+
+	std::ofstream recordStream;
+	if( !recordFile.empty() )
+	{
+		recordStream.open( recordFile.c_str() );
+		if( !recordStream )
+		{
+			osg::notify(osg::FATAL) << "Can not write \"" << recordFile << "\"." << std::endl;
+			return 1;
+		}
+	}
+
+    // construct the viewer, it reads its own options, e.g. --SingleThreaded
+    osgViewer::Viewer viewer( arguments );
+	arguments.reportRemainingOptionsAsUnrecognized();
+	if( arguments.errors() )
+	{
+		arguments.writeErrorMessages( std::cerr );
+		return 1;
+	}
+
+	if( offscreenWidth > 0 && offscreenHeight > 0 )
+	{
+		// A pbuffer needs no display of its own, on a machine without GPU Mesa renders it, e.g. under Xvfb
+		osg::ref_ptr<osg::GraphicsContext::Traits> traits = new osg::GraphicsContext::Traits;
+		traits->x = 0;
+		traits->y = 0;
+		traits->width = offscreenWidth;
+		traits->height = offscreenHeight;
+		traits->windowDecoration = false;
+		traits->doubleBuffer = false;
+		traits->pbuffer = true;
+		osg::ref_ptr<osg::GraphicsContext> context = osg::GraphicsContext::createGraphicsContext( traits.get() );
+		if( !context.valid() )
+		{
+			osg::notify(osg::FATAL) << "Can not create a " << offscreenWidth << "x" << offscreenHeight << " pbuffer." << std::endl;
+			return 1;
+		}
+		osg::Camera* camera = viewer.getCamera();
+		camera->setGraphicsContext( context.get() );
+		camera->setViewport( new osg::Viewport( 0, 0, offscreenWidth, offscreenHeight ) );
+		camera->setProjectionMatrixAsPerspective( 30.0, static_cast<double>( offscreenWidth ) / offscreenHeight, 1.0, 10000.0 );
+		camera->setDrawBuffer( GL_FRONT );
+		camera->setReadBuffer( GL_FRONT );
+	}
+	else
+		viewer.setUpViewInWindow( windowX, windowY, windowWidth, windowHeight );
 	viewer.setLightingMode( osg::View::HEADLIGHT );
 	viewer.addEventHandler( new KeyHandler( "HANDLER 1" ) );
 	viewer.addEventHandler( new KeyHandler( "HANDLER 2" ) );
@@ -120,22 +400,35 @@ int main(int, char **)
     geometry->setColorArray(colors);
     geometry->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
 
+	// Realized before the tubes are built, so their patch size can use GL_MAX_PATCH_VERTICES
+	viewer.setRealizeOperation( new TubePatchLayout::QueryOperation );
+	viewer.realize();
+
 	//Gets camera params
 	osg::Camera* cam = viewer.getCamera();
 	double fov,n,f,ar;
 	cam->getProjectionMatrixAsPerspective( fov, ar, n, f );
 	int screenSize = cam->getViewport()->height();
 
-	// Creates the tube node.
-	std::vector<osg::Vec3> traj = genTrajectory( 600 );
+	// Creates the tube nodes.
 	TubeGeometryBuilder tgb;
-	tgb.setTrajectory( traj );
+	// Chunks of the tube out of the view or smaller than a few pixels are culled
+	tgb.setChunkPatches( chunkPatches );
+	tgb.setPatchVertices( patchVertices );
+	tgb.setCompactVertices( compact );
+	tgb.setLighting( lighting );
+	tgb.setTessellation( tessellation );
+	if( mesh )
+		tgb.setBackend( TubeGeometryBuilder::CPU_MESH );
+	// The flux is read from a table, toggling it does not touch the tube StateSet
+	osg::ref_ptr<TubeStyleTable> fluxTable = new TubeStyleTable;
+	tgb.setFluxTable( fluxTable.get() );
+	cam->setCullingMode( cam->getCullingMode() | osg::CullSettings::SMALL_FEATURE_CULLING );
 
 	bool _fluxOn = true; 
 	bool _fluxUp = true;
 	co::int32 _fluxSpeed = 10;
 	co::int32 _fluxStep = 10;
-	float _tubeRadius = 0.4f;
 	float _minRadius = 4.0f;
 	co::int32 _lineWidth = 4;
 	co::int32 _sectionVertices = 10;
@@ -144,19 +437,76 @@ int main(int, char **)
 	::osg::Vec4 _fluxColor = osg::Vec4(1,0,0,1);
 	::osg::Vec4 _tubeColor = osg::Vec4(1,1,1,1);
 	osg::Group* geode = new osg::Group;
-	tgb.createTubeWithLOD( geode, cam, _tubeRadius, _minRadius, _tubeColor, 
-						_fluxColor, _fluxUp, _fluxSpeed, _fluxStep, _sectionVertices, _lineWidth );
+
+	TubeBundleBuilder bundleBuilder;
+	bundleBuilder.setPatchVertices( patchVertices );
+	bundleBuilder.setTessellation( tessellation );
+
+	osg::Timer_t buildStart = osg::Timer::instance()->tick();
+	if( !trajectoryFile.empty() )
+	{
+		TrajectoryReader reader;
+		if( !reader.open( trajectoryFile ) )
+			return 1;
+		TubeFileBuilder fileBuilder( tgb, geode, _tubeRadius, _minRadius, _tubeColor, _fluxColor, _fluxSpeed, _fluxStep,
+			_sectionVertices, _lineWidth, bundle ? &bundleBuilder : NULL );
+		reader.buildSections( fileBuilder, _verticalScale, _curveTolerance );
+	}
+	else
+	{
+		// Helices along y on a square grid in the xz plane
+		unsigned int columns = static_cast<unsigned int>( std::ceil( std::sqrt( static_cast<double>( numTubes ) ) ) );
+		for( unsigned int i = 0; i < numTubes; i++ )
+		{
+			tgb.setTrajectory( genTrajectory( numPoints, osg::Vec3( 4.0f * ( i % columns ), 0.0f, 4.0f * ( i / columns ) ) ),
+				_verticalScale, _curveTolerance );
+			if( bundle )
+			{
+				bundleBuilder.addTube( tgb, TubeStyle( _tubeRadius, _minRadius, _tubeColor, _fluxColor, _fluxUp, _fluxSpeed, _fluxStep ) );
+				continue;
+			}
+			osg::Group* tube = new osg::Group;
+			tgb.createTubeWithLOD( tube, NULL, _tubeRadius, _minRadius, _tubeColor, 
+								_fluxColor, _fluxUp, _fluxSpeed, _fluxStep, _sectionVertices, _lineWidth );
+			geode->addChild( tube );
+		}
+	}
+	unsigned int numBuilt = geode->getNumChildren();
+	if( bundle )
+	{
+		bundleBuilder.createBundle( geode, NULL );
+		numBuilt = bundleBuilder.getNumTubes();
+		osg::notify(osg::NOTICE) << bundleBuilder.getNumLevels() << " levels of proxies." << std::endl;
+	}
+	double buildMs = osg::Timer::instance()->delta_m( buildStart, osg::Timer::instance()->tick() );
+	osg::notify(osg::NOTICE) << numBuilt << " tubes built in " << buildMs << " ms." << std::endl;
 	
 	osg::Group* root = new osg::Group();
+	// View uniforms shared by every tube in the scene
+	TubeCameraUniforms::install( root );
+	fluxTable->apply( root->getOrCreateStateSet() );
 	root->addChild( geode );
 	root->addChild( axis );
+
+	// Tube build counters next to the frame timings, press 's' to cycle the stats
+	osgViewer::StatsHandler* statsHandler = new osgViewer::StatsHandler;
+	statsHandler->addUserStatsLine( "Tube sections", osg::Vec4( 1, 1, 1, 1 ), osg::Vec4( 0.5, 0.5, 1, 1 ),
+		"Tube sections", 1.0, false, false, "", "", 100000.0 );
+	statsHandler->addUserStatsLine( "Tube patches", osg::Vec4( 1, 1, 1, 1 ), osg::Vec4( 0.5, 0.5, 1, 1 ),
+		"Tube patches", 1.0, false, false, "", "", 10000.0 );
+	statsHandler->addUserStatsLine( "Tube frames ms", osg::Vec4( 1, 1, 1, 1 ), osg::Vec4( 1, 0.5, 0.5, 1 ),
+		"Tube frame time", 1.0, false, false, "", "", 100.0 );
+	statsHandler->addUserStatsLine( "Tube packing ms", osg::Vec4( 1, 1, 1, 1 ), osg::Vec4( 1, 0.5, 0.5, 1 ),
+		"Tube pack time", 1.0, false, false, "", "", 100.0 );
+	viewer.addEventHandler( statsHandler );
+	root->setUpdateCallback( new TubeStatsPublisher( &tgb, viewer.getViewerStats() ) );
     viewer.setSceneData( root );
 
-	// switch on the uniforms that track the modelview and projection matrices
-    osgViewer::Viewer::Windows windows;
-    viewer.getWindows(windows);
-    for(osgViewer::Viewer::Windows::iterator itr = windows.begin();
-        itr != windows.end();
+	// switch on the uniforms that track the modelview and projection matrices, of the windows and pbuffers
+    osgViewer::Viewer::Contexts contexts;
+    viewer.getContexts(contexts);
+    for(osgViewer::Viewer::Contexts::iterator itr = contexts.begin();
+        itr != contexts.end();
         ++itr)
     {
         osg::State *s=(*itr)->getState();
@@ -164,9 +514,32 @@ int main(int, char **)
         s->setUseVertexAttributeAliasing(true);
     }
 
-	viewer.frame();
-    return viewer.run();
+	if( numFrames == 0 )
+	{
+		if( cameraPath.valid() )
+			viewer.setCameraManipulator( new osgGA::AnimationPathManipulator( cameraPath.get() ) );
+		viewer.frame();
+		return viewer.run();
+	}
+
+	// Load test: the same frames whatever the speed of the machine, so runs can be compared
+	FrameRecorder* recorder = recordStream.is_open() ? new FrameRecorder( recordStream, viewer ) : NULL;
+	if( recorder )
+		recorder->addBuildTime( buildMs );
+	osg::BoundingSphere bound = root->getBound();
+	for( unsigned int i = 0; i < numFrames && !viewer.done(); i++ )
+	{
+		placeCamera( viewer.getCamera(), cameraPath.get(), bound, i, numFrames );
+		viewer.frame();
+		if( recorder )
+			recorder->frameDone( viewer.getFrameStamp()->getFrameNumber() );
+	}
+	if( recorder )
+	{
+		recorder->finish( viewer.getFrameStamp()->getFrameNumber() );
+		delete recorder;
+	}
+	return 0;
 }
 
 /*EOF*/
-
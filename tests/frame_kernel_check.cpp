@@ -0,0 +1,265 @@
+/*
+	Checks the frames of TubeFrameKernel against the TubeSectionBuilder reference, see
+	TubeGeometryBuilder::buildReferenceSections, and against the same propagation evaluated in double
+	precision, on curves of a million points. Fails when a frame component differs by more than the
+	bounds documented in TubeFrameKernel.h, or when too many points are culled by one and not by the
+	other.
+
+	usage: frame_kernel_check
+*/
+
+#include "TubeGeometryBuilder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+static const unsigned int NUM_POINTS = 1000000;
+static const float CURVE_TOLERANCE = 0.001f;
+
+//! Sections culled by one and kept by the other, over the sections compared.
+static const double MAX_UNMATCHED = 1e-3;
+
+//! Difference per component with the double precision frames.
+static const double MAX_DOUBLE_ERROR = 1e-3;
+
+struct DVec
+{
+	DVec() { v[0] = v[1] = v[2] = 0.0; }
+	DVec( double x, double y, double z ) { v[0] = x; v[1] = y; v[2] = z; }
+	DVec( const osg::Vec3& p ) { v[0] = p[0]; v[1] = p[1]; v[2] = p[2]; }
+
+	DVec operator+( const DVec& o ) const { return DVec( v[0] + o.v[0], v[1] + o.v[1], v[2] + o.v[2] ); }
+	DVec operator-( const DVec& o ) const { return DVec( v[0] - o.v[0], v[1] - o.v[1], v[2] - o.v[2] ); }
+	DVec operator*( double s ) const { return DVec( v[0] * s, v[1] * s, v[2] * s ); }
+	double operator*( const DVec& o ) const { return v[0] * o.v[0] + v[1] * o.v[1] + v[2] * o.v[2]; }
+	DVec operator^( const DVec& o ) const
+	{
+		return DVec( v[1] * o.v[2] - v[2] * o.v[1], v[2] * o.v[0] - v[0] * o.v[2], v[0] * o.v[1] - v[1] * o.v[0] );
+	}
+	double length2() const { return *this * *this; }
+	void normalize()
+	{
+		double norm = sqrt( length2() );
+		if( norm > 0.0 )
+			*this = *this * ( 1.0 / norm );
+	}
+
+	double v[3];
+};
+
+struct DSection
+{
+	DVec position;
+	DVec normal;
+	DVec binormal;
+	DVec tangent;
+};
+
+// Rotates \v around the unit \axis by the angle whose cosine is \c
+static DVec rotate( const DVec& v, const DVec& axis, double c )
+{
+	double s = sqrt( std::max( 1.0 - c * c, 0.0 ) );
+	return v * c + ( axis ^ v ) * s + axis * ( ( axis * v ) * ( 1.0 - c ) );
+}
+
+// Same as TubeSectionBuilder::buildNewPoint, in double precision
+static bool buildNewPoint( DSection& current, const DVec& next, const DSection& previous )
+{
+	DVec forward = current.position - next;
+	forward.normalize();
+	DVec backward = current.position - previous.position;
+	backward.normalize();
+	current.tangent = forward - backward;
+	current.normal = previous.normal;
+	current.binormal = previous.binormal;
+	if( current.tangent.length2() == 0.0 )
+		return false;
+	current.tangent.normalize();
+
+	DVec axis = previous.tangent ^ current.tangent;
+	if( axis.length2() < CURVE_TOLERANCE )
+		return false;
+	axis.normalize();
+	double c = std::min( std::max( previous.tangent * current.tangent, -1.0 ), 1.0 );
+	current.normal = rotate( previous.normal, axis, c );
+	current.normal.normalize();
+	current.binormal = rotate( previous.binormal, axis, c );
+	current.binormal.normalize();
+	return true;
+}
+
+// Same as TubeGeometryBuilder::buildReferenceSections, in double precision
+static void buildDoubleSections( const std::vector<osg::Vec3>& points, std::vector<DSection>& sections )
+{
+	sections.clear();
+	unsigned int second = 1;
+	while( second < points.size() && ( points[0] - points[second] ).length2() == 0 )
+		second++;
+	if( second >= points.size() )
+		return;
+
+	DSection previous;
+	previous.position = points[0];
+	previous.tangent = previous.position - DVec( points[second] );
+	previous.tangent.normalize();
+	const DVec& t = previous.tangent;
+	previous.normal = DVec( -t.v[1] + t.v[2], t.v[0] + t.v[2], -t.v[0] - t.v[1] );
+	previous.normal.normalize();
+	previous.binormal = t ^ previous.normal;
+	sections.push_back( previous );
+
+	for( unsigned int i = second; i + 1 < points.size(); i++ )
+	{
+		DSection current;
+		current.position = points[i];
+		if( buildNewPoint( current, points[i + 1], previous ) )
+		{
+			sections.push_back( current );
+			previous = current;
+		}
+	}
+
+	DSection last;
+	last.position = points.back();
+	buildNewPoint( last, last.position * 2.0 - DVec( points[points.size() - 2] ), previous );
+	sections.push_back( last );
+}
+
+// Exact position of a section, the sections of the same point have the same one
+struct PositionKey
+{
+	PositionKey( const DVec& p ) { for( int k = 0; k < 3; k++ ) v[k] = static_cast<float>( p.v[k] ); }
+
+	bool operator<( const PositionKey& o ) const
+	{
+		return v[0] < o.v[0] || ( v[0] == o.v[0] && ( v[1] < o.v[1] || ( v[1] == o.v[1] && v[2] < o.v[2] ) ) );
+	}
+
+	float v[3];
+};
+
+static std::vector<DSection> toDouble( const std::vector<TubeSection>& sections )
+{
+	std::vector<DSection> result( sections.size() );
+	for( size_t i = 0; i < sections.size(); i++ )
+	{
+		result[i].position = sections[i].position;
+		result[i].normal = sections[i].normal;
+		result[i].binormal = sections[i].binormal;
+	}
+	return result;
+}
+
+/*
+	Largest difference per component between the frames of the sections of \a and \b at the same
+	point. \unmatched receives the fraction of the sections of \a that \b does not have.
+*/
+static double compare( const std::vector<DSection>& a, const std::vector<DSection>& b, double& unmatched )
+{
+	std::map<PositionKey, size_t> index;
+	for( size_t i = 0; i < b.size(); i++ )
+		index[PositionKey( b[i].position )] = i;
+
+	double maxError = 0.0;
+	size_t numUnmatched = 0;
+	for( size_t i = 0; i < a.size(); i++ )
+	{
+		std::map<PositionKey, size_t>::const_iterator it = index.find( PositionKey( a[i].position ) );
+		if( it == index.end() )
+		{
+			numUnmatched++;
+			continue;
+		}
+		const DSection& other = b[it->second];
+		for( int k = 0; k < 3; k++ )
+		{
+			maxError = std::max( maxError, fabs( a[i].normal.v[k] - other.normal.v[k] ) );
+			maxError = std::max( maxError, fabs( a[i].binormal.v[k] - other.binormal.v[k] ) );
+		}
+	}
+	unmatched = a.empty() ? 0.0 : static_cast<double>( numUnmatched ) / a.size();
+	return maxError;
+}
+
+// Helix around z of \radius, turning by \step radians and rising by \rise per point
+static void makeHelix( float radius, float step, float rise, std::vector<osg::Vec3>& points )
+{
+	points.resize( NUM_POINTS );
+	for( unsigned int i = 0; i < NUM_POINTS; i++ )
+		points[i] = osg::Vec3( cosf( i * step ) * radius, sinf( i * step ) * radius, i * rise );
+}
+
+// Random walk of steps in the unit cube, the same on every platform
+static void makeRandomWalk( std::vector<osg::Vec3>& points )
+{
+	unsigned int seed = 1;
+	osg::Vec3 position;
+	points.resize( NUM_POINTS );
+	for( unsigned int i = 0; i < NUM_POINTS; i++ )
+	{
+		float step[3];
+		for( int k = 0; k < 3; k++ )
+		{
+			seed = seed * 1664525u + 1013904223u;
+			step[k] = ( seed >> 8 ) / 16777216.0f - 0.5f;
+		}
+		position += osg::Vec3( step[0], step[1], step[2] );
+		points[i] = position;
+	}
+}
+
+int main()
+{
+	struct Case
+	{
+		const char* name;
+		//! Difference per component with the reference.
+		double maxReferenceError;
+	};
+	static const Case cases[] =
+	{
+		{ "helix", 1e-2 },
+		{ "slow helix", 1e-1 },
+		{ "wide slow helix", 1e-1 },
+		{ "random walk", 1e-2 }
+	};
+
+	int failures = 0;
+	for( unsigned int c = 0; c < sizeof( cases ) / sizeof( cases[0] ); c++ )
+	{
+		std::vector<osg::Vec3> points;
+		if( c == 0 )
+			makeHelix( 5.0f, 0.01f, 0.001f, points );
+		else if( c == 1 )
+			makeHelix( 50.0f, 0.0005f, 0.0001f, points );
+		else if( c == 2 )
+			makeHelix( 200.0f, 0.002f, 0.0001f, points );
+		else
+			makeRandomWalk( points );
+
+		std::vector<TubeSection> kernelSections;
+		TubeGeometryBuilder::buildSections( points, kernelSections, 1.0f, CURVE_TOLERANCE );
+		std::vector<TubeSection> referenceSections;
+		TubeGeometryBuilder::buildReferenceSections( points, referenceSections, 1.0f, CURVE_TOLERANCE );
+		std::vector<DSection> doubleSections;
+		buildDoubleSections( points, doubleSections );
+
+		std::vector<DSection> kernel = toDouble( kernelSections );
+		double referenceUnmatched, doubleUnmatched;
+		double referenceError = compare( kernel, toDouble( referenceSections ), referenceUnmatched );
+		double doubleError = compare( kernel, doubleSections, doubleUnmatched );
+
+		bool ok = referenceError <= cases[c].maxReferenceError && doubleError <= MAX_DOUBLE_ERROR &&
+			referenceUnmatched <= MAX_UNMATCHED && doubleUnmatched <= MAX_UNMATCHED;
+		printf( "%-16s %7u sections, reference %.2e (unmatched %.1e), double %.2e (unmatched %.1e) %s\n",
+			cases[c].name, static_cast<unsigned int>( kernelSections.size() ), referenceError, referenceUnmatched,
+			doubleError, doubleUnmatched, ok ? "ok" : "FAILED" );
+		if( !ok )
+			failures++;
+	}
+
+	return failures == 0 ? 0 : 1;
+}
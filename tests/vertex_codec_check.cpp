@@ -0,0 +1,147 @@
+/*
+	Checks the compact vertex layout of TubeVertexCodec on tubes built by createTubeWithLOD, whole or
+	grown by appendTrajectory, up to 10 km long. The vertex arrays are decoded and compared with the
+	sections. Fails when a position is further than TubeVertexCodec::getPositionErrorBound of its
+	blocks or than a fraction of the tube radius, or when a frame turned more than MAX_FRAME_ANGLE.
+
+	usage: vertex_codec_check
+*/
+
+#include "TubeGeometryBuilder.h"
+#include "TubeVertexCodec.h"
+
+#include <osg/Group>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+static const float RADIUS = 0.4f;
+
+//! Largest position error, as a fraction of the tube radius.
+static const float MAX_RADIUS_FRACTION = 0.01f;
+
+//! Largest angle between a decoded frame axis and the section one, in radians.
+static const float MAX_FRAME_ANGLE = 1e-3f;
+
+//! Points given to each appendTrajectory of the grown tubes.
+static const unsigned int APPEND_POINTS = 500;
+
+// Angle between two vectors, acos is not accurate for small angles
+static float angleBetween( osg::Vec3 a, osg::Vec3 b )
+{
+	a.normalize();
+	b.normalize();
+	return atan2f( ( a ^ b ).length(), a * b );
+}
+
+// Helix around z of \radius, turning by \step radians and rising by \rise per point
+static void makeHelix( unsigned int numPoints, float radius, float step, float rise, std::vector<osg::Vec3>& points )
+{
+	points.resize( numPoints );
+	for( unsigned int i = 0; i < numPoints; i++ )
+		points[i] = osg::Vec3( cosf( i * step ) * radius, sinf( i * step ) * radius, i * rise );
+}
+
+// Meander along x of \length, the bends keep the curve from being culled to its ends
+static void makeMeander( unsigned int numPoints, float length, std::vector<osg::Vec3>& points )
+{
+	points.resize( numPoints );
+	for( unsigned int i = 0; i < numPoints; i++ )
+		points[i] = osg::Vec3( i * length / numPoints, sinf( i * 0.01f ) * 20.0f, cosf( i * 0.003f ) * 5.0f );
+}
+
+// Random walk of steps in the unit cube, the same on every platform
+static void makeRandomWalk( unsigned int numPoints, std::vector<osg::Vec3>& points )
+{
+	unsigned int seed = 1;
+	osg::Vec3 position;
+	points.resize( numPoints );
+	for( unsigned int i = 0; i < numPoints; i++ )
+	{
+		float step[3];
+		for( int k = 0; k < 3; k++ )
+		{
+			seed = seed * 1664525u + 1013904223u;
+			step[k] = ( seed >> 8 ) / 16777216.0f - 0.5f;
+		}
+		position += osg::Vec3( step[0], step[1], step[2] );
+		points[i] = position;
+	}
+}
+
+/*
+	Builds the tube of \points in the compact layout, in one go or by appends of APPEND_POINTS, and
+	compares its vertices with the sections. Returns false if an error is out of bounds.
+*/
+static bool check( const char* name, const std::vector<osg::Vec3>& points, bool append )
+{
+	TubeGeometryBuilder builder;
+	builder.setCompactVertices( true );
+	osg::ref_ptr<osg::Group> tube = new osg::Group;
+	if( append )
+	{
+		builder.setTrajectory( std::vector<osg::Vec3>( points.begin(), points.begin() + APPEND_POINTS ) );
+		builder.createTubeWithLOD( tube.get(), NULL, RADIUS, 4.0f );
+		for( size_t i = APPEND_POINTS; i < points.size(); i += APPEND_POINTS )
+		{
+			size_t end = std::min<size_t>( i + APPEND_POINTS, points.size() );
+			builder.appendTrajectory( std::vector<osg::Vec3>( points.begin() + i, points.begin() + end ), tube.get() );
+		}
+	}
+	else
+	{
+		builder.setTrajectory( points );
+		builder.createTubeWithLOD( tube.get(), NULL, RADIUS, 4.0f );
+	}
+
+	const std::vector<TubeGeometryBuilder::Section>& sections = builder.getSections();
+	TubeNodeData* data = TubeNodeData::get( tube.get() );
+	const osg::Vec4sArray* pos = static_cast<const osg::Vec4sArray*>( data->geometry->getVertexArray() );
+	const osg::Vec4sArray* frames = static_cast<const osg::Vec4sArray*>( data->geometry->getVertexAttribArray( 4 ) );
+
+	float positionError = 0.0f;
+	float frameError = 0.0f;
+	for( size_t i = 0; i < sections.size(); i++ )
+	{
+		osg::Vec3 position = TubeVertexCodec::decodePosition( ( *pos )[i], data->positionBlocks );
+		positionError = std::max( positionError, ( position - sections[i].position ).length() );
+
+		osg::Vec3 normal, binormal;
+		TubeVertexCodec::decodeFrame( ( *frames )[i], normal, binormal );
+		frameError = std::max( frameError, angleBetween( normal, sections[i].normal ) );
+		frameError = std::max( frameError, angleBetween( binormal, sections[i].binormal ) );
+	}
+
+	float bound = TubeVertexCodec::getPositionErrorBound( data->positionBlocks );
+	bool ok = data->numVertices == sections.size() && positionError <= bound &&
+		positionError <= RADIUS * MAX_RADIUS_FRACTION && frameError <= MAX_FRAME_ANGLE;
+	printf( "%-20s %-7s %7u sections, %3u blocks, position %.2e (bound %.2e), frame %.2e %s\n", name,
+		append ? "append" : "whole", static_cast<unsigned int>( sections.size() ),
+		static_cast<unsigned int>( data->positionBlocks.ranges.size() ), positionError, bound, frameError,
+		ok ? "ok" : "FAILED" );
+	return ok;
+}
+
+int main()
+{
+	int failures = 0;
+	for( int append = 0; append < 2; append++ )
+	{
+		std::vector<osg::Vec3> points;
+		makeHelix( 100000, 5.0f, 0.01f, 0.001f, points );
+		failures += check( "helix", points, append != 0 ) ? 0 : 1;
+
+		makeMeander( 200000, 1000.0f, points );
+		failures += check( "1 km meander", points, append != 0 ) ? 0 : 1;
+
+		makeMeander( 400000, 10000.0f, points );
+		failures += check( "10 km meander", points, append != 0 ) ? 0 : 1;
+
+		makeRandomWalk( 100000, points );
+		failures += check( "random walk", points, append != 0 ) ? 0 : 1;
+	}
+
+	return failures == 0 ? 0 : 1;
+}